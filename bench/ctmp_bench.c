@@ -0,0 +1,602 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "ctmp.h"
+
+#define BENCH_MAX_SINKS 1024
+#define UNIX_PREFIX "unix:"  // endpoints as the proxy takes them, see listener.h
+#define BENCH_MIN_PAYLOAD 16  // sequence number + send timestamp, both 8 bytes
+#define BENCH_BATCH 65536  // source writes are batched up to this, when not rate limited
+#define SINK_BUFFER (1 << 18)
+#define SINK_IDLE_MS 3000  // a sink gives up once nothing has arrived for this long after the source finished
+
+#define LAT_SUB_BITS 4  // histogram is log-linear, 16 sub-buckets per power of two - ~6% worst case error
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+/**
+ * @brief Latency histogram in nanoseconds, fixed size so sinks can record without allocating or locking
+ */
+typedef struct {
+    uint64_t counts[LAT_BUCKETS];
+    uint64_t max;
+} lat_hist;
+
+typedef struct {
+    int id;
+    int fd;
+    pthread_t thread;
+
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t corrupt;  // messages that didn't come out as they went in
+    uint64_t first_seq;  // lowest sequence number it should get - 0, or for a late sink the lowest it was sent
+    uint64_t next_seq;  // expected next, when checking order
+    uint64_t misordered;
+    bool late;  // joined part way through
+    bool ordered;  // count messages that arrive out of order, -o
+    uint64_t last_arrival;  // ns timestamp of the read the last message came in with
+    lat_hist hist;
+} sink;
+
+typedef struct {
+    const char *ip;
+    const char *src;  // port, or unix:/path as the proxy takes them
+    const char *dst;
+    int num_sinks;
+    int late_sinks;  // of num_sinks, how many connect once half the messages have been sent
+    uint64_t count;
+    uint32_t min_size;
+    uint32_t max_size;
+    double sensitive;  // fraction of messages flagged sensitive, and so checksummed by the proxy
+    double rate;  // messages per second, 0 for as fast as the proxy will take them
+    const char *proxy;  // proxy binary to spawn, NULL to use one that's already running
+    const char *proxy_args;
+    bool ordered;
+    bool verbose;
+} bench_config;
+
+static volatile bool sending = true;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static int lat_bucket(uint64_t ns) {
+    if (ns < (1u << LAT_SUB_BITS)) {
+        return (int)ns;
+    }
+
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) + (int)((ns >> shift) & ((1u << LAT_SUB_BITS) - 1));
+}
+
+/**
+ * @brief Upper bound of a bucket, what gets reported for a percentile landing in it
+ */
+static uint64_t lat_bucket_ceiling(int bucket) {
+    if (bucket < (1 << LAT_SUB_BITS)) {
+        return bucket;
+    }
+
+    int shift = (bucket >> LAT_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1u << LAT_SUB_BITS) - 1);
+    return (((1ull << LAT_SUB_BITS) | sub) << shift) + (1ull << shift) - 1;
+}
+
+static void lat_record(lat_hist *hist, uint64_t ns) {
+    hist->counts[lat_bucket(ns)]++;
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+static uint64_t lat_percentile(const lat_hist *hist, uint64_t total, double pct) {
+    uint64_t rank = (uint64_t)(pct / 100.0 * total);
+    uint64_t seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist->counts[b];
+        if (seen > rank) {
+            uint64_t ceiling = lat_bucket_ceiling(b);
+            return ceiling < hist->max ? ceiling : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+/**
+ * @brief Reads the proxy's total CPU time (user + system) from /proc
+ *
+ * @return double - seconds, or -1 if it couldn't be read
+ */
+static double proc_cpu_seconds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // comm may contain spaces, so count fields from after its closing bracket - utime and stime are 14 and 15
+    char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * @brief Connects to the proxy, retrying for a couple of seconds in case it has only just been spawned
+ *
+ * @param ip address of a TCP endpoint
+ * @param endpoint port number or unix:/path
+ * @return int - connected socket, -1 on failure
+ */
+static int connect_proxy(const char *ip, const char *endpoint) {
+    struct sockaddr_storage addr = {0};
+    socklen_t addr_len;
+
+    if (strncmp(endpoint, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        const char *path = endpoint + strlen(UNIX_PREFIX);
+        if (strlen(path) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Socket path '%s' is too long\n", path);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        addr_len = sizeof(*un);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(endpoint));
+        if (inet_pton(AF_INET, ip, &in->sin_addr) != 1) {
+            fprintf(stderr, "Invalid IP address '%s'\n", ip);
+            return -1;
+        }
+        addr_len = sizeof(*in);
+    }
+
+    for (int attempt = 0; attempt < 40; attempt++) {
+        int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, addr_len) == 0) {
+            int one = 1;
+            if (addr.ss_family == AF_INET) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            return fd;
+        }
+
+        close(fd);
+        usleep(50000);
+    }
+
+    fprintf(stderr, "Failed to connect to %s (%s): %s\n", endpoint, ip, strerror(errno));
+    return -1;
+}
+
+/**
+ * @brief Receives and parses the CTMP stream for one destination, recording the latency of every message
+ */
+static void *sink_run(void *arg) {
+    sink *sk = arg;
+    uint8_t *buf = malloc(SINK_BUFFER);
+    size_t have = 0;
+
+    struct timeval idle = {.tv_sec = SINK_IDLE_MS / 1000, .tv_usec = (SINK_IDLE_MS % 1000) * 1000};
+    setsockopt(sk->fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+    while (true) {
+        ssize_t count = recv(sk->fd, buf + have, SINK_BUFFER - have, 0);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && sending) {
+            continue;  // source still going, just slow
+        }
+        if (count <= 0) {
+            break;  // idle after the source finished, or the proxy closed us
+        }
+
+        uint64_t now = now_ns();  // one timestamp per read, messages in the same read arrived together
+        have += count;
+
+        size_t off = 0;
+        while (have - off >= sizeof(ctmp_header)) {
+            const ctmp_header *header = (const ctmp_header *)(buf + off);
+            size_t len = sizeof(ctmp_header) + ntohs(header->length);
+            if (have - off < len) {
+                break;
+            }
+
+            uint64_t seq, sent_at;
+            memcpy(&seq, buf + off + sizeof(ctmp_header), sizeof(seq));
+            memcpy(&sent_at, buf + off + sizeof(ctmp_header) + sizeof(seq), sizeof(sent_at));
+
+            // the filler is the sequence number's low byte throughout, spot check either end of it
+            const uint8_t *filler = buf + off + sizeof(ctmp_header) + BENCH_MIN_PAYLOAD;
+            size_t filler_len = len - sizeof(ctmp_header) - BENCH_MIN_PAYLOAD;
+            if (header->magic != CTMP_MAGIC || len < sizeof(ctmp_header) + BENCH_MIN_PAYLOAD
+                || (filler_len > 0 && (filler[0] != (uint8_t)seq || filler[filler_len - 1] != (uint8_t)seq))) {
+                sk->corrupt++;
+            }
+
+            // not necessarily in order, sensitive messages jump the queue unless the proxy has -g 0
+            if (sk->late && seq < sk->first_seq) {
+                sk->first_seq = seq;
+            }
+            if (sk->ordered && seq != sk->next_seq && (sk->msgs > 0 || !sk->late)) {
+                sk->misordered++;
+            }
+            sk->next_seq = seq + 1;
+            sk->msgs++;
+            sk->bytes += len;
+            lat_record(&sk->hist, now - sent_at);
+
+            sk->last_arrival = now;
+            off += len;
+        }
+
+        memmove(buf, buf + off, have - off);
+        have -= off;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Writes one generated message into out, stamped with its sequence number and the current time
+ *
+ * @return size_t - bytes written
+ */
+static size_t build_message(uint8_t *out, const bench_config *cfg, uint64_t seq, uint64_t *rng) {
+    uint32_t payload = cfg->min_size;
+    if (cfg->max_size > cfg->min_size) {
+        payload += xorshift(rng) % (cfg->max_size - cfg->min_size + 1);
+    }
+
+    bool sensitive = (double)(xorshift(rng) >> 11) / (double)(1ull << 53) < cfg->sensitive;
+
+    ctmp_header header = {
+        .magic = CTMP_MAGIC,
+        .options = sensitive ? CTMP_OPTION_SENSITIVE : 0,
+        .length = htons(payload),
+        .checksum = 0xCCCC,  // stands in for the checksum while it's computed, as per spec
+    };
+    memcpy(out, &header, sizeof(header));
+
+    uint8_t *body = out + sizeof(header);
+    uint64_t sent_at = now_ns();
+    memcpy(body, &seq, sizeof(seq));
+    memcpy(body + sizeof(seq), &sent_at, sizeof(sent_at));
+    memset(body + BENCH_MIN_PAYLOAD, (uint8_t)seq, payload - BENCH_MIN_PAYLOAD);
+
+    if (sensitive) {
+        uint16_t checksum = htons(compute_checksum(out, sizeof(header) + payload));
+        memcpy(out + offsetof(ctmp_header, checksum), &checksum, sizeof(checksum));
+    }
+
+    return sizeof(header) + payload;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t count = write(fd, buf, len);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error writing to source connection: %s\n", strerror(errno));
+            return -1;
+        }
+        buf += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Connects sinks from up to (but not including) to, and starts receiving on them
+ *
+ * @return int - 0 on success, -1 if one couldn't connect
+ */
+static int start_sinks(const bench_config *cfg, sink *sinks, int from, int to) {
+    for (int i = from; i < to; i++) {
+        sinks[i].fd = connect_proxy(cfg->ip, cfg->dst);
+        if (sinks[i].fd < 0) {
+            return -1;
+        }
+        pthread_create(&sinks[i].thread, NULL, sink_run, &sinks[i]);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drives the source connection - as fast as possible in batches, or paced to the configured rate - bringing in
+ * the late sinks half way through
+ *
+ * @return int - 0 on success, -1 if the proxy dropped the source
+ */
+static int run_source(int fd, const bench_config *cfg, sink *sinks) {
+    uint8_t *batch = malloc(BENCH_BATCH + sizeof(ctmp_header) + UINT16_MAX);
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    uint64_t start = now_ns();
+    size_t used = 0;
+    int rc = 0;
+
+    for (uint64_t seq = 0; seq < cfg->count && rc == 0; seq++) {
+        if (cfg->rate > 0) {
+            uint64_t due = start + (uint64_t)(seq * 1e9 / cfg->rate);
+            uint64_t now = now_ns();
+
+            if (due > now) {
+                // flush anything batched before sleeping, it would otherwise pick up the sleep as latency
+                if (used > 0) {
+                    rc = write_all(fd, batch, used);
+                    used = 0;
+                }
+
+                struct timespec ts = {.tv_sec = (due - now) / 1000000000ull, .tv_nsec = (due - now) % 1000000000ull};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        if (cfg->late_sinks > 0 && seq == cfg->count / 2) {
+            rc = used > 0 ? write_all(fd, batch, used) : 0;
+            used = 0;
+            if (rc == 0 && start_sinks(cfg, sinks, cfg->num_sinks - cfg->late_sinks, cfg->num_sinks) < 0) {
+                rc = -1;
+            }
+        }
+
+        used += build_message(batch + used, cfg, seq, &rng);
+
+        if (used >= BENCH_BATCH) {
+            rc = write_all(fd, batch, used);
+            used = 0;
+        }
+    }
+
+    if (rc == 0 && used > 0) {
+        rc = write_all(fd, batch, used);
+    }
+
+    free(batch);
+    return rc;
+}
+
+static pid_t spawn_proxy(const bench_config *cfg) {
+    char *args = strdup(cfg->proxy_args);
+    char *argv[64] = {(char *)cfg->proxy, "-i", (char *)cfg->ip, "-s", (char *)cfg->src, "-d", (char *)cfg->dst};
+    int argc = 7;
+    for (char *tok = strtok(args, " "); tok != NULL && argc < 63; tok = strtok(NULL, " ")) {
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);  // a bench killed part way through, e.g. by make check, takes the proxy too
+        if (!cfg->verbose) {
+            freopen("/dev/null", "w", stdout);
+        }
+        execv(cfg->proxy, argv);
+        fprintf(stderr, "Failed to run %s: %s\n", cfg->proxy, strerror(errno));
+        _exit(127);
+    }
+
+    free(args);
+    return pid;
+}
+
+static int parse_sizes(const char *spec, bench_config *cfg) {
+    char *end;
+    unsigned long min = strtoul(spec, &end, 10);
+    unsigned long max = min;
+
+    if (*end == '-') {
+        max = strtoul(end + 1, &end, 10);
+    }
+
+    if (*end != '\0' || min < BENCH_MIN_PAYLOAD || max < min || max > UINT16_MAX) {
+        return -1;
+    }
+
+    cfg->min_size = min;
+    cfg->max_size = max;
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-i ip] [-s src_port|unix:path] [-d dst_port|unix:path] [-c sinks] [-n messages] [-z size|min-max] "
+            "[-f sensitive_fraction] [-r msgs_per_sec] [-l late_sinks] [-o] [-p proxy_binary | -x] [-a \"proxy args\"] [-v]\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    bench_config cfg = {
+        .ip = "127.0.0.1",
+        .src = "33333",
+        .dst = "44444",
+        .num_sinks = 4,
+        .count = 1000000,
+        .min_size = 64,
+        .max_size = 1024,
+        .sensitive = 0.1,
+        .proxy = "./proxy",
+        .proxy_args = "",
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:s:d:c:l:n:z:f:r:op:xa:v")) != -1) {
+        switch (opt) {
+            case 'i': cfg.ip = optarg; break;
+            case 's': cfg.src = optarg; break;
+            case 'd': cfg.dst = optarg; break;
+            case 'c': cfg.num_sinks = atoi(optarg); break;
+            case 'l': cfg.late_sinks = atoi(optarg); break;
+            case 'n': cfg.count = strtoull(optarg, NULL, 10); break;
+            case 'f': cfg.sensitive = atof(optarg); break;
+            case 'r': cfg.rate = atof(optarg); break;
+            case 'o': cfg.ordered = true; break;
+            case 'p': cfg.proxy = optarg; break;
+            case 'x': cfg.proxy = NULL; break;
+            case 'a': cfg.proxy_args = optarg; break;
+            case 'v': cfg.verbose = true; break;
+            case 'z':
+                if (parse_sizes(optarg, &cfg) == 0) {
+                    break;
+                }
+                fprintf(stderr, "Payload sizes must be between %d and %d bytes\n", BENCH_MIN_PAYLOAD, UINT16_MAX);
+                exit(EXIT_FAILURE);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (cfg.num_sinks < 1 || cfg.num_sinks > BENCH_MAX_SINKS || cfg.late_sinks < 0 || cfg.late_sinks >= cfg.num_sinks
+        || cfg.count == 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t proxy = cfg.proxy != NULL ? spawn_proxy(&cfg) : -1;
+
+    sink *sinks = calloc(cfg.num_sinks, sizeof(sink));
+    for (int i = 0; i < cfg.num_sinks; i++) {
+        sinks[i].id = i;
+        sinks[i].fd = -1;
+        sinks[i].late = i >= cfg.num_sinks - cfg.late_sinks;
+        sinks[i].first_seq = sinks[i].late ? UINT64_MAX : 0;
+        sinks[i].ordered = cfg.ordered;
+    }
+
+    if (start_sinks(&cfg, sinks, 0, cfg.num_sinks - cfg.late_sinks) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    usleep(100000);  // let worker shards pick the destinations up before anything is published
+
+    int src_fd = connect_proxy(cfg.ip, cfg.src);
+    if (src_fd < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    double proxy_cpu_start = proxy > 0 ? proc_cpu_seconds(proxy) : -1;
+    double self_cpu_start = self_cpu_seconds();
+    uint64_t start = now_ns();
+
+    int rc = run_source(src_fd, &cfg, sinks);
+    sending = false;
+
+    for (int i = 0; i < cfg.num_sinks; i++) {
+        if (sinks[i].fd != -1) {
+            pthread_join(sinks[i].thread, NULL);
+        }
+    }
+
+    double proxy_cpu = proxy > 0 ? proc_cpu_seconds(proxy) - proxy_cpu_start : -1;
+    double self_cpu = self_cpu_seconds() - self_cpu_start;
+
+    lat_hist total = {0};
+    uint64_t msgs = 0, bytes = 0, lost = 0, corrupt = 0, misordered = 0, last = start;
+    for (int i = 0; i < cfg.num_sinks; i++) {
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            total.counts[b] += sinks[i].hist.counts[b];
+        }
+        if (sinks[i].hist.max > total.max) {
+            total.max = sinks[i].hist.max;
+        }
+        if (sinks[i].last_arrival > last) {
+            last = sinks[i].last_arrival;  // run ends when the last message reached the last sink, not at the timeout
+        }
+        msgs += sinks[i].msgs;
+        bytes += sinks[i].bytes;
+        // a drop policy, say - and a late sink that was sent nothing has missed everything
+        lost += sinks[i].msgs > 0 ? cfg.count - sinks[i].first_seq - sinks[i].msgs : cfg.count;
+        corrupt += sinks[i].corrupt;
+        misordered += sinks[i].misordered;
+    }
+
+    double secs = (last - start) / 1e9;
+
+    printf("messages sent      %lu (%s)\n", (unsigned long)cfg.count, rc == 0 ? "ok" : "source dropped");
+    printf("messages received  %lu across %d sinks, %lu lost, %lu corrupt", (unsigned long)msgs, cfg.num_sinks,
+           (unsigned long)lost, (unsigned long)corrupt);
+    printf(cfg.ordered ? ", %lu out of order\n" : "\n", (unsigned long)misordered);
+    printf("elapsed            %.3f s\n", secs);
+    printf("throughput in      %.0f msg/s\n", cfg.count / secs);
+    printf("throughput out     %.0f msg/s, %.1f MB/s\n", msgs / secs, bytes / secs / 1e6);
+    printf("latency (us)       p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           lat_percentile(&total, msgs, 50) / 1e3, lat_percentile(&total, msgs, 90) / 1e3,
+           lat_percentile(&total, msgs, 99) / 1e3, lat_percentile(&total, msgs, 99.9) / 1e3, total.max / 1e3);
+    if (proxy_cpu >= 0) {
+        printf("proxy cpu          %.3f s, %.2f us/msg in, %.3f us/msg out\n", proxy_cpu,
+               proxy_cpu * 1e6 / cfg.count, msgs ? proxy_cpu * 1e6 / msgs : 0);
+    }
+    printf("bench cpu          %.3f s\n", self_cpu);
+
+    close(src_fd);
+    for (int i = 0; i < cfg.num_sinks; i++) {
+        close(sinks[i].fd);
+    }
+    free(sinks);
+
+    if (proxy > 0) {
+        kill(proxy, SIGINT);
+        waitpid(proxy, NULL, 0);
+    }
+
+    return rc == 0 && lost == 0 && corrupt == 0 && misordered == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
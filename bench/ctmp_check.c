@@ -0,0 +1,1057 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "ctmp.h"
+#include "listener.h"
+#include "mcast.h"
+#include "relay.h"
+
+/*
+ * Loopback protocol checks, run by make check
+ *
+ * Each case spawns the proxy with the options it covers, plays the source and whatever sits on the other end over
+ * loopback, and checks that every message comes out byte for byte as it went in. The exit code is the number of
+ * cases that failed.
+ *
+ *   mcast    multicast datagrams (-u), with every fifth one thrown away so the gaps have to be filled over resend=
+ *   handoff  a source and destinations handed over as socketpair ends with SCM_RIGHTS (-x), plus one with a role the
+ *            proxy doesn't know, which has to be closed
+ *   relay    two proxies chained with -R, checked at the far end and at a relay destination of the first, whose
+ *            envelopes have to run in sequence, sum correctly and hold exactly the messages they say
+ *   uplink   the downstream end of a relay link, fed by the check itself - batches with a bad checksum, out of
+ *            sequence or with the wrong message count have to close the link without any of their messages getting out
+ *
+ * Where it can't be known when a destination is ready to be sent to, pings (see send_pings) go out until one arrives,
+ * and are skipped over by whatever reads the destination.
+ */
+
+#define CHECK_PROXY "./proxy"
+#define CHECK_MAX_PAYLOAD 4000  // above the datagram size used, so multicast has to fragment
+#define CHECK_TIMEOUT_MS 5000  // longest anything may go quiet before a case gives up
+#define CHECK_MCAST_DATAGRAM "1200"
+#define CHECK_MCAST_DROP 5  // every this many datagrams one is dropped on purpose
+#define CHECK_HANDOFF_DSTS 3
+#define CHECK_MAX_PROXIES 2
+#define CHECK_MAX_PINGS 40
+#define CHECK_PING_SEQ UINT64_MAX  // what a ping carries where a message would carry its seq
+#define CHECK_PING_LEN (sizeof(ctmp_header) + sizeof(uint64_t))
+
+#define FAIL(...) do { \
+    stop_proxies(); \
+    fprintf(stderr, "FAIL %s: ", name); \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, "\n"); \
+    return -1; \
+} while (0)
+
+/**
+ * @brief The messages a case sends, all in one buffer, and which of them have come out the other end
+ */
+typedef struct {
+    uint8_t *stream;
+    size_t *offsets;  // count + 1 of them, message seq is stream[offsets[seq]..offsets[seq + 1])
+    uint64_t count;
+    bool *seen;
+    uint64_t num_seen;
+} check_msgs;
+
+/**
+ * @brief What one destination has read so far
+ */
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} check_sink;
+
+static bool verbose = false;
+static int port_base;
+static pid_t proxies[CHECK_MAX_PROXIES];  // spawned for the case in progress, downstream last
+static int num_proxies = 0;
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/**
+ * @brief Generates count messages of up to CHECK_MAX_PAYLOAD bytes, a quarter of them sensitive, each starting with
+ * its sequence number and otherwise random
+ */
+static int msgs_build(check_msgs *msgs, uint64_t count, uint64_t seed) {
+    *msgs = (check_msgs){.count = count};
+    msgs->stream = malloc(count * (sizeof(ctmp_header) + CHECK_MAX_PAYLOAD));
+    msgs->offsets = malloc((count + 1) * sizeof(size_t));
+    msgs->seen = calloc(count, sizeof(bool));
+    if (msgs->stream == NULL || msgs->offsets == NULL || msgs->seen == NULL) {
+        return -1;
+    }
+
+    size_t len = 0;
+    for (uint64_t seq = 0; seq < count; seq++) {
+        uint8_t *msg = msgs->stream + len;
+        uint32_t payload = sizeof(seq) + xorshift(&seed) % (CHECK_MAX_PAYLOAD - sizeof(seq) + 1);
+        bool sensitive = xorshift(&seed) % 4 == 0;
+
+        ctmp_header header = {.magic = CTMP_MAGIC, .options = sensitive ? CTMP_OPTION_SENSITIVE : 0,
+                              .length = htons(payload), .checksum = 0xCCCC};
+        memcpy(msg, &header, sizeof(header));
+        memcpy(msg + sizeof(header), &seq, sizeof(seq));
+        for (uint32_t b = sizeof(seq); b < payload; b++) {
+            msg[sizeof(header) + b] = (uint8_t)xorshift(&seed);
+        }
+        if (sensitive) {
+            uint16_t checksum = htons(compute_checksum(msg, sizeof(header) + payload));
+            memcpy(msg + offsetof(ctmp_header, checksum), &checksum, sizeof(checksum));
+        } else {
+            memset(msg + offsetof(ctmp_header, checksum), 0, sizeof(header.checksum));
+        }
+
+        msgs->offsets[seq] = len;
+        len += sizeof(header) + payload;
+    }
+    msgs->offsets[count] = len;
+
+    return 0;
+}
+
+static void msgs_free(check_msgs *msgs) {
+    free(msgs->stream);
+    free(msgs->offsets);
+    free(msgs->seen);
+}
+
+static size_t msg_len(const uint8_t *msg) {
+    return sizeof(ctmp_header) + ntohs(((const ctmp_header *)msg)->length);
+}
+
+/**
+ * @brief Checks that msg is message seq as it was sent, and marks it seen
+ */
+static bool msgs_match(check_msgs *msgs, uint64_t seq, const uint8_t *msg, size_t len) {
+    if (seq >= msgs->count || len != msgs->offsets[seq + 1] - msgs->offsets[seq]
+        || memcmp(msg, msgs->stream + msgs->offsets[seq], len) != 0) {
+        return false;
+    }
+
+    msgs->num_seen += !msgs->seen[seq];
+    msgs->seen[seq] = true;
+    return true;
+}
+
+static void set_timeout(int fd, int ms) {
+    struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * @brief Connects to a port on loopback, retrying for a couple of seconds in case the proxy has only just started
+ *
+ * @return int - connected socket, -1 on failure
+ */
+static int connect_port(int port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+
+    for (int attempt = 0; attempt < 40; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            set_timeout(fd, CHECK_TIMEOUT_MS);
+            return fd;
+        }
+
+        close(fd);
+        usleep(50000);
+    }
+
+    fprintf(stderr, "Failed to connect to port %d: %s\n", port, strerror(errno));
+    return -1;
+}
+
+/**
+ * @brief Connects to a unix socket, retrying for a couple of seconds in case the proxy has only just started
+ *
+ * @return int - connected socket, -1 on failure
+ */
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    for (int attempt = 0; attempt < 40; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            set_timeout(fd, CHECK_TIMEOUT_MS);
+            return fd;
+        }
+
+        close(fd);
+        usleep(50000);
+    }
+
+    fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+    return -1;
+}
+
+/**
+ * @brief Hands descriptors over to the proxy's handoff listener, attached to a single role byte
+ */
+static int send_fds(int fd, char role, const int *fds, int num_fds) {
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control = {0};
+    struct iovec iov = {.iov_base = &role, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = CMSG_SPACE(num_fds * sizeof(int))};
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t count = send(fd, buf, len, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const uint8_t *)buf + count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reads exactly len bytes
+ *
+ * @return int - 0 on success, -1 on error, timeout or the other end closing first
+ */
+static int read_all(int fd, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t count = recv(fd, buf, len, 0);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (uint8_t *)buf + count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Runs a proxy for the case in progress, on loopback with the given options on top of its source and
+ * destination ports
+ *
+ * @param args NULL terminated
+ */
+static void spawn_proxy(int src_port, int dst_port, const char *const *args) {
+    char src[16];
+    char dst[16];
+    snprintf(src, sizeof(src), "%d", src_port);
+    snprintf(dst, sizeof(dst), "%d", dst_port);
+
+    const char *argv[32] = {CHECK_PROXY, "-i", "127.0.0.1", "-s", src, "-d", dst};
+    int argc = 7;
+    for (; *args != NULL && argc < 31; args++) {
+        argv[argc++] = *args;
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);  // or the child's freopen writes out a second copy of what earlier cases printed
+    pid_t pid = fork();
+    if (pid > 0 && num_proxies < CHECK_MAX_PROXIES) {
+        proxies[num_proxies++] = pid;
+    } else if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);  // killed by make check's timeout, take the proxy too
+        if (!verbose) {
+            freopen("/dev/null", "w", stdout);
+        }
+        execv(CHECK_PROXY, (char *const *)argv);
+        fprintf(stderr, "Failed to run %s: %s\n", CHECK_PROXY, strerror(errno));
+        _exit(127);
+    }
+}
+
+/**
+ * @brief Stops the proxies of the case in progress the way an operator would, downstream first
+ *
+ * @return bool - true if there were any and they all exited cleanly
+ */
+static bool stop_proxies(void) {
+    bool clean = num_proxies > 0;
+    while (num_proxies > 0) {
+        int status = 0;
+        pid_t pid = proxies[--num_proxies];
+        kill(pid, SIGINT);
+        waitpid(pid, &status, 0);
+        clean &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    return clean;
+}
+
+static void tmp_path(char *path, size_t len, const char *what) {
+    snprintf(path, len, "/tmp/ctmp-check-%d-%s", (int)getuid(), what);
+}
+
+static void make_ping(uint8_t *ping) {
+    ctmp_header header = {.magic = CTMP_MAGIC, .length = htons(sizeof(uint64_t))};
+    uint64_t seq = CHECK_PING_SEQ;
+    memcpy(ping, &header, sizeof(header));
+    memcpy(ping + sizeof(header), &seq, sizeof(seq));
+}
+
+/**
+ * @brief Steps over the pings at the front of what a destination read
+ *
+ * @return size_t - offset of the first thing that isn't one
+ */
+static size_t skip_pings(const uint8_t *buf, size_t len) {
+    uint8_t ping[CHECK_PING_LEN];
+    make_ping(ping);
+
+    size_t off = 0;
+    while (len - off >= CHECK_PING_LEN && memcmp(buf + off, ping, CHECK_PING_LEN) == 0) {
+        off += CHECK_PING_LEN;
+    }
+    return off;
+}
+
+/**
+ * @brief Sends a ping down src every so often until something turns up at dst, for when dst can't otherwise be known
+ * to be ready - a ping sent before it was is simply never delivered, and the ones that are get skipped by the reader
+ *
+ * @return int - 0 once dst is readable, -1 if nothing turned up after CHECK_MAX_PINGS
+ */
+static int send_pings(int src, int dst) {
+    uint8_t ping[CHECK_PING_LEN];
+    make_ping(ping);
+
+    for (int k = 0; k < CHECK_MAX_PINGS; k++) {
+        struct pollfd pfd = {.fd = dst, .events = POLLIN};
+        if (write_all(src, ping, sizeof(ping)) < 0) {
+            return -1;
+        }
+        if (poll(&pfd, 1, 100) > 0) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Writes data down src while reading every sink at once, so none of them is ever left to back up, until each
+ * has read something ending with the last message in data
+ *
+ * @param last_len length of the last message in data
+ * @return const char * - NULL once every sink is done, otherwise what went wrong
+ */
+static const char *pump(int src, const uint8_t *data, size_t len, size_t last_len, check_sink *sinks, int num_sinks) {
+    static char error[128];
+    const uint8_t *last = data + len - last_len;
+    size_t sent = 0;
+    int done = 0;
+
+    fcntl(src, F_SETFL, fcntl(src, F_GETFL) | O_NONBLOCK);
+    while (done < num_sinks) {
+        struct pollfd fds[num_sinks + 1];
+        for (int d = 0; d < num_sinks; d++) {
+            check_sink *sink = &sinks[d];
+            bool finished = sink->len >= last_len && memcmp(sink->buf + sink->len - last_len, last, last_len) == 0;
+            fds[d] = (struct pollfd){.fd = finished ? -1 : sink->fd, .events = POLLIN};
+        }
+        fds[num_sinks] = (struct pollfd){.fd = sent < len ? src : -1, .events = POLLOUT};
+
+        if (poll(fds, num_sinks + 1, CHECK_TIMEOUT_MS) <= 0) {
+            snprintf(error, sizeof(error), "stalled with %zu of %zu bytes written", sent, len);
+            return error;
+        }
+
+        if (fds[num_sinks].revents != 0) {
+            ssize_t count = send(src, data + sent, len - sent, MSG_NOSIGNAL);
+            if (count < 0 && errno != EAGAIN) {
+                snprintf(error, sizeof(error), "source write: %s", strerror(errno));
+                return error;
+            }
+            sent += count > 0 ? count : 0;
+        }
+
+        for (int d = 0; d < num_sinks; d++) {
+            check_sink *sink = &sinks[d];
+            if (fds[d].revents == 0) {
+                continue;
+            }
+
+            ssize_t count = sink->len < sink->cap ? recv(sink->fd, sink->buf + sink->len, sink->cap - sink->len, 0) : 0;
+            if (count <= 0) {
+                snprintf(error, sizeof(error), "destination %d %s after %zu bytes", d,
+                         sink->len < sink->cap ? "closed" : "overran", sink->len);
+                return error;
+            }
+            sink->len += count;
+            done += sink->len >= last_len && memcmp(sink->buf + sink->len - last_len, last, last_len) == 0;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Asks for messages first to last over a retransmit connection, checking that every one of them comes back
+ * intact
+ *
+ * @return int - 0 on success, -1 if the reply is short or anything in it isn't as sent
+ */
+static int mcast_resend(int fd, check_msgs *msgs, uint64_t first, uint64_t last) {
+    char request[MCAST_CTL_LEN];
+    int len = snprintf(request, sizeof(request), "resend=%lu-%lu\n", (unsigned long)first, (unsigned long)last);
+    mcast_resend_header reply;
+    if (write_all(fd, request, len) < 0 || read_all(fd, &reply, sizeof(reply)) < 0 || be64toh(reply.seq) != first) {
+        return -1;
+    }
+
+    uint64_t bytes = be64toh(reply.len);
+    if (bytes != msgs->offsets[last + 1] - msgs->offsets[first]) {
+        return -1;
+    }
+
+    uint8_t *data = malloc(bytes);
+    int rc = data != NULL && read_all(fd, data, bytes) == 0 ? 0 : -1;
+    for (size_t off = 0, seq = first; rc == 0 && off < bytes; seq++) {
+        size_t mlen = msg_len(data + off);
+        rc = off + mlen <= bytes && msgs_match(msgs, seq, data + off, mlen) ? 0 : -1;
+        off += mlen;
+    }
+
+    free(data);
+    return rc;
+}
+
+/**
+ * @brief Multicast egress - a subscriber joins the group, drops every CHECK_MCAST_DROP'th datagram, reassembles
+ * fragments and checks each message, then once a heartbeat says everything has gone out asks for each gap over
+ * resend= and checks what comes back. A malformed request has to get the retransmit connection closed.
+ */
+static int check_mcast(void) {
+    const char *name = "mcast";
+    const uint64_t count = 3000;
+    int src_port = port_base;
+    int mcast_port = port_base + 2;
+
+    char journal[64];
+    char group[32];
+    char spec[64];
+    tmp_path(journal, sizeof(journal), "mcast.journal");
+    snprintf(group, sizeof(group), "239.255.%d.%d", getpid() >> 8 & 0xFF, getpid() & 0xFF);
+    snprintf(spec, sizeof(spec), "%s:%d:%s", group, mcast_port, CHECK_MCAST_DATAGRAM);
+
+    // joined before the proxy even starts, so nothing is sent before the subscriber is listening
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(mcast_port)};
+    inet_pton(AF_INET, group, &addr.sin_addr);
+    int sub = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    struct ip_mreq mreq = {.imr_multiaddr = addr.sin_addr, .imr_interface.s_addr = htonl(INADDR_LOOPBACK)};
+    setsockopt(sub, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sub, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || setsockopt(sub, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        FAIL("can't join %s: %s", group, strerror(errno));
+    }
+    set_timeout(sub, CHECK_TIMEOUT_MS);
+
+    const char *args[] = {"-u", spec, "-j", journal, NULL};
+    spawn_proxy(src_port, port_base + 1, args);
+
+    check_msgs msgs;
+    int src = connect_port(src_port);
+    if (msgs_build(&msgs, count, 0x5DEECE66Dull) < 0 || src < 0
+        || write_all(src, msgs.stream, msgs.offsets[count]) < 0) {
+        FAIL("couldn't send the feed");
+    }
+
+    static uint8_t buffer[MCAST_MAX_DATAGRAM];
+    static uint8_t frag[sizeof(ctmp_header) + UINT16_MAX];
+    uint64_t frag_seq = UINT64_MAX;
+    size_t frag_len = 0;
+    uint64_t datagrams = 0;
+    uint64_t dropped = 0;
+
+    while (true) {
+        ssize_t len = recv(sub, buffer, sizeof(buffer), 0);
+        if (len < (ssize_t)sizeof(mcast_header)) {
+            FAIL("%s waiting for datagrams", len < 0 ? strerror(errno) : "runt datagram");
+        }
+
+        mcast_header header;
+        memcpy(&header, buffer, sizeof(header));
+        uint64_t seq = be64toh(header.seq);
+        uint16_t msgs_in = ntohs(header.count);
+        uint32_t frag_off = ntohl(header.frag_off);
+        const uint8_t *body = buffer + sizeof(header);
+        size_t body_len = len - sizeof(header);
+
+        if (msgs_in == 0 && frag_off == MCAST_HEARTBEAT_OFF) {
+            if (seq == count) {
+                break;  // everything has gone out
+            }
+            continue;
+        }
+
+        if (++datagrams % CHECK_MCAST_DROP == 0) {
+            dropped++;
+            continue;
+        }
+
+        if (msgs_in == 0) {  // a piece of one message, only taken in order - any gap and it's fetched again
+            if (frag_off == 0) {
+                frag_seq = seq;
+                frag_len = 0;
+            }
+            if (seq != frag_seq || frag_off != frag_len || frag_len + body_len > sizeof(frag)) {
+                continue;
+            }
+            memcpy(frag + frag_len, body, body_len);
+            frag_len += body_len;
+            if (frag_len >= sizeof(ctmp_header) && frag_len == msg_len(frag) && !msgs_match(&msgs, seq, frag, frag_len)) {
+                FAIL("message %lu reassembled from fragments isn't as sent", (unsigned long)seq);
+            }
+            continue;
+        }
+
+        size_t off = 0;
+        for (uint16_t k = 0; k < msgs_in; k++) {
+            size_t mlen = off + sizeof(ctmp_header) <= body_len ? msg_len(body + off) : SIZE_MAX;
+            if (mlen > body_len - off || !msgs_match(&msgs, seq + k, body + off, mlen)) {
+                FAIL("message %lu in a datagram isn't as sent", (unsigned long)(seq + k));
+            }
+            off += mlen;
+        }
+        if (off != body_len) {
+            FAIL("datagram from message %lu has %zu bytes left over", (unsigned long)seq, body_len - off);
+        }
+    }
+
+    uint64_t received = msgs.num_seen;
+    int resend = connect_port(mcast_port);
+    for (uint64_t first = 0; first < count && resend >= 0;) {
+        if (msgs.seen[first]) {
+            first++;
+            continue;
+        }
+
+        uint64_t last = first;
+        while (last + 1 < count && !msgs.seen[last + 1]) {
+            last++;
+        }
+        if (mcast_resend(resend, &msgs, first, last) < 0) {
+            FAIL("resend=%lu-%lu didn't come back as sent", (unsigned long)first, (unsigned long)last);
+        }
+        first = last + 1;
+    }
+
+    char byte;
+    bool rejected = write_all(resend, "resend=-1\n", 10) == 0 && recv(resend, &byte, 1, 0) == 0;
+
+    close(resend);
+    close(src);
+    close(sub);
+    bool clean = stop_proxies();
+    unlink(journal);
+    msgs_free(&msgs);  // only the counts are looked at from here on
+
+    if (msgs.num_seen != count) {
+        FAIL("only %lu of %lu messages arrived", (unsigned long)msgs.num_seen, (unsigned long)count);
+    }
+    if (dropped == 0 || received == count) {
+        FAIL("nothing was dropped, so resend= went unchecked");
+    }
+    if (!rejected) {
+        FAIL("a malformed retransmit request didn't get the connection closed");
+    }
+    if (!clean) {
+        FAIL("proxy didn't exit cleanly");
+    }
+
+    printf("%s: %lu messages in %lu datagrams, %lu dropped on purpose, %lu fetched again over resend=\n", name,
+           (unsigned long)count, (unsigned long)datagrams, (unsigned long)dropped, (unsigned long)(count - received));
+    return 0;
+}
+
+/**
+ * @brief Handed over descriptors - the proxy gets CHECK_HANDOFF_DSTS destinations then a source, all socketpair ends,
+ * over one handoff connection. With no priority lane every destination has to see the feed exactly as it was written,
+ * and a descriptor handed over with a role the proxy doesn't know has to be closed rather than kept.
+ */
+static int check_handoff(void) {
+    const char *name = "handoff";
+    const uint64_t count = 3000;
+
+    char path[64];
+    tmp_path(path, sizeof(path), "handoff.sock");
+    const char *args[] = {"-g", "0", "-x", path, NULL};
+    spawn_proxy(port_base, port_base + 1, args);
+
+    // ours[0] is the source's end, then one per destination, then the one with the unknown role
+    int ours[CHECK_HANDOFF_DSTS + 2];
+    int theirs[CHECK_HANDOFF_DSTS + 2];
+    for (int k = 0; k < CHECK_HANDOFF_DSTS + 2; k++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+            FAIL("socketpair: %s", strerror(errno));
+        }
+        ours[k] = pair[0];
+        theirs[k] = pair[1];
+    }
+
+    int conn = connect_unix(path);
+    if (conn < 0 || send_fds(conn, HANDOFF_DST, theirs + 1, CHECK_HANDOFF_DSTS) < 0
+        || send_fds(conn, 'q', theirs + CHECK_HANDOFF_DSTS + 1, 1) < 0 || send_fds(conn, HANDOFF_SRC, theirs, 1) < 0) {
+        FAIL("couldn't hand the descriptors over");
+    }
+    for (int k = 0; k < CHECK_HANDOFF_DSTS + 2; k++) {
+        close(theirs[k]);  // the proxy has its own copies now
+    }
+
+    char byte;
+    int unknown = ours[CHECK_HANDOFF_DSTS + 1];
+    set_timeout(unknown, CHECK_TIMEOUT_MS);
+    bool rejected = recv(unknown, &byte, 1, 0) == 0;
+    close(unknown);
+
+    check_msgs msgs;
+    if (msgs_build(&msgs, count, 0x2545F4914F6CDD1Dull) < 0) {
+        FAIL("out of memory");
+    }
+    size_t total = msgs.offsets[count];
+    check_sink sinks[CHECK_HANDOFF_DSTS];
+    for (int d = 0; d < CHECK_HANDOFF_DSTS; d++) {
+        sinks[d] = (check_sink){.fd = ours[d + 1], .buf = malloc(total), .cap = total};
+        if (sinks[d].buf == NULL) {
+            FAIL("out of memory");
+        }
+    }
+
+    const char *error = pump(ours[0], msgs.stream, total, total - msgs.offsets[count - 1], sinks, CHECK_HANDOFF_DSTS);
+    int corrupt = -1;
+    for (int d = 0; d < CHECK_HANDOFF_DSTS; d++) {
+        if (corrupt == -1 && (sinks[d].len != total || memcmp(sinks[d].buf, msgs.stream, total) != 0)) {
+            corrupt = d;
+        }
+        free(sinks[d].buf);
+    }
+    msgs_free(&msgs);
+
+    close(conn);
+    for (int k = 0; k <= CHECK_HANDOFF_DSTS; k++) {
+        close(ours[k]);
+    }
+    bool clean = stop_proxies();
+
+    if (error != NULL) {
+        FAIL("%s", error);
+    }
+    if (corrupt != -1) {
+        FAIL("destination %d didn't get the feed as it was written", corrupt);
+    }
+    if (!rejected) {
+        FAIL("a descriptor handed over with an unknown role wasn't closed");
+    }
+    if (!clean) {
+        FAIL("proxy didn't exit cleanly");
+    }
+
+    printf("%s: %lu messages (%zu bytes) from a handed over source to %d handed over destinations\n", name,
+           (unsigned long)count, total, CHECK_HANDOFF_DSTS);
+    return 0;
+}
+
+/**
+ * @brief Wraps a batch of messages in an envelope, the way a proxy sends them down a relay link
+ *
+ * @param out where the envelope and a copy of the body go
+ * @return size_t - bytes written to out
+ */
+static size_t relay_wrap(uint8_t *out, uint32_t seq, uint16_t msgs, const uint8_t *body, size_t len) {
+    relay_header header = {.magic = RELAY_MAGIC, .msgs = htons(msgs), .len = htonl(len), .seq = htonl(seq)};
+    ctmp_csum sum = {0};
+    ctmp_csum_update(&sum, (const uint8_t *)&header, sizeof(header));
+    ctmp_csum_update(&sum, body, len);
+    header.checksum = htons(ctmp_csum_final(&sum));
+
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), body, len);
+    return sizeof(header) + len;
+}
+
+/**
+ * @brief Takes the envelopes off what a relay destination read - the plain messages sent before the proxy saw the
+ * relay line, then batches that have to run in sequence from 0, sum correctly and hold exactly the messages they say
+ *
+ * @param out set to the messages, in order, at least len bytes
+ * @param out_len set to how many bytes of messages there were
+ * @param batches set to how many envelopes there were
+ * @return const char * - NULL if everything checked out, otherwise what didn't
+ */
+static const char *relay_unwrap(const uint8_t *raw, size_t len, uint8_t *out, size_t *out_len, uint32_t *batches) {
+    size_t off = 0;
+    *out_len = 0;
+    *batches = 0;
+
+    while (off < len && *batches == 0 && raw[off] == CTMP_MAGIC) {
+        size_t mlen = len - off >= sizeof(ctmp_header) ? msg_len(raw + off) : SIZE_MAX;
+        if (mlen > len - off) {
+            return "cut off part way through a plain message";
+        }
+        memcpy(out + *out_len, raw + off, mlen);
+        *out_len += mlen;
+        off += mlen;
+    }
+
+    while (off < len) {
+        relay_header header;
+        if (len - off < sizeof(header)) {
+            return "cut off part way through an envelope";
+        }
+        memcpy(&header, raw + off, sizeof(header));
+
+        uint32_t body_len = ntohl(header.len);
+        if (header.magic != RELAY_MAGIC || header.rpad != 0 || header.cpad != 0 || body_len > RELAY_MAX_BODY
+            || body_len > len - off - sizeof(header)) {
+            return "invalid envelope";
+        }
+        if (ntohl(header.seq) != *batches) {
+            return "envelope out of sequence";
+        }
+
+        const uint8_t *body = raw + off + sizeof(header);
+        uint16_t checksum = ntohs(header.checksum);
+        header.checksum = 0;
+        ctmp_csum sum = {0};
+        ctmp_csum_update(&sum, (const uint8_t *)&header, sizeof(header));
+        ctmp_csum_update(&sum, body, body_len);
+        if (ctmp_csum_final(&sum) != checksum) {
+            return "envelope checksum doesn't match";
+        }
+
+        uint32_t msgs = 0;
+        for (size_t moff = 0; moff < body_len; msgs++) {
+            size_t mlen = body_len - moff >= sizeof(ctmp_header) ? msg_len(body + moff) : SIZE_MAX;
+            if (mlen > body_len - moff) {
+                return "messages in an envelope don't fill it";
+            }
+            moff += mlen;
+        }
+        if (msgs == 0 || msgs != ntohs(header.msgs)) {
+            return "envelope message count is wrong";
+        }
+
+        memcpy(out + *out_len, body, body_len);
+        *out_len += body_len;
+        off += sizeof(header) + body_len;
+        (*batches)++;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Two proxies chained with -R, no priority lane on either - a plain destination and a relay destination on the
+ * first, and a plain destination on the second, all have to see the feed exactly as it was written once pings and
+ * envelopes are taken off
+ */
+static int check_relay(void) {
+    const char *name = "relay";
+    const uint64_t count = 3000;
+    char uplink[32];
+    snprintf(uplink, sizeof(uplink), "127.0.0.1:%d", port_base + 1);
+
+    const char *upper_args[] = {"-g", "0", NULL};
+    spawn_proxy(port_base, port_base + 1, upper_args);
+    int raw = connect_port(port_base + 1);  // ahead of the lower proxy, which only starts once this one is up
+    if (raw < 0 || write_all(raw, RELAY_CTL, strlen(RELAY_CTL)) < 0) {
+        FAIL("couldn't ask for batches");
+    }
+
+    const char *lower_args[] = {"-g", "0", "-R", uplink, NULL};
+    spawn_proxy(port_base + 2, port_base + 3, lower_args);
+    int plain = connect_port(port_base + 1);
+    int lower = connect_port(port_base + 3);
+    int src = connect_port(port_base);
+    if (plain < 0 || lower < 0 || src < 0 || send_pings(src, lower) < 0) {
+        FAIL("the lower proxy never got anything through the relay link");
+    }
+
+    check_msgs msgs;
+    if (msgs_build(&msgs, count, 0x9E3779B97F4A7C15ull) < 0) {
+        FAIL("out of memory");
+    }
+    size_t total = msgs.offsets[count];
+    size_t pings = CHECK_MAX_PINGS * (sizeof(relay_header) + CHECK_PING_LEN);
+    check_sink sinks[] = {
+        {.fd = plain, .cap = total + pings},
+        {.fd = lower, .cap = total + pings},
+        {.fd = raw, .cap = total + count * sizeof(relay_header) + pings},  // one envelope per message at most
+    };
+    uint8_t *unwrapped = malloc(sinks[2].cap);
+    for (int d = 0; d < 3; d++) {
+        sinks[d].buf = malloc(sinks[d].cap);
+        if (sinks[d].buf == NULL || unwrapped == NULL) {
+            FAIL("out of memory");
+        }
+    }
+
+    const char *error = pump(src, msgs.stream, total, total - msgs.offsets[count - 1], sinks, 3);
+    size_t unwrapped_len = 0;
+    uint32_t batches = 0;
+    const char *relay_error = error == NULL ? relay_unwrap(sinks[2].buf, sinks[2].len, unwrapped, &unwrapped_len,
+                                                           &batches) : NULL;
+    int corrupt = -1;
+    for (int d = 0; d < 3; d++) {
+        const uint8_t *buf = d < 2 ? sinks[d].buf : unwrapped;
+        size_t len = d < 2 ? sinks[d].len : unwrapped_len;
+        size_t off = skip_pings(buf, len);
+        if (corrupt == -1 && (len - off != total || memcmp(buf + off, msgs.stream, total) != 0)) {
+            corrupt = d;
+        }
+        free(sinks[d].buf);
+    }
+    free(unwrapped);
+    msgs_free(&msgs);
+
+    close(src);
+    close(lower);
+    close(plain);
+    close(raw);
+    bool clean = stop_proxies();
+
+    if (error != NULL) {
+        FAIL("%s", error);
+    }
+    if (relay_error != NULL) {
+        FAIL("relay destination: %s", relay_error);
+    }
+    if (corrupt != -1) {
+        static const char *const where[] = {"the upper proxy's destination", "the lower proxy's destination",
+                                            "the relay destination"};
+        FAIL("%s didn't get the feed as it was written", where[corrupt]);
+    }
+    if (!clean) {
+        FAIL("proxies didn't exit cleanly");
+    }
+
+    printf("%s: %lu messages (%zu bytes) through two proxies, %u batches to the relay destination\n", name,
+           (unsigned long)count, total, batches);
+    return 0;
+}
+
+/**
+ * @brief Reads len bytes from a destination into buf, skipping any pings that come first
+ */
+static int read_past_pings(int fd, uint8_t *buf, size_t len) {
+    uint8_t ping[CHECK_PING_LEN];
+    make_ping(ping);
+
+    do {
+        if (read_all(fd, buf, CHECK_PING_LEN) < 0) {
+            return -1;
+        }
+    } while (memcmp(buf, ping, CHECK_PING_LEN) == 0);
+
+    return read_all(fd, buf + CHECK_PING_LEN, len - CHECK_PING_LEN);
+}
+
+/**
+ * @brief The downstream end of a relay link, with the check as the upstream proxy. Over one link after another it
+ * sends a plain message, a good batch of two, then one more batch, which is either good or broken in one way. The
+ * messages before the last batch have to come out either way, and those in it only if it was good - a broken one has to
+ * get the link closed.
+ */
+static int check_uplink(void) {
+    const char *name = "uplink";
+    const char *const breaks[] = {"checksum", "seq", "count", NULL};  // the good one last, nothing may follow it out
+    const int links = sizeof(breaks) / sizeof(breaks[0]);
+    int upstream_port = port_base + 2;
+    char uplink[32];
+    snprintf(uplink, sizeof(uplink), "127.0.0.1:%d", upstream_port);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(upstream_port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int one = 1;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0) {
+        FAIL("can't listen on %d: %s", upstream_port, strerror(errno));
+    }
+    set_timeout(listener, CHECK_TIMEOUT_MS);  // the proxy reconnects within RELAY_RETRY
+
+    const char *args[] = {"-g", "0", "-R", uplink, NULL};
+    spawn_proxy(port_base, port_base + 1, args);
+    int dst = connect_port(port_base + 1);
+
+    check_msgs msgs;
+    if (dst < 0 || msgs_build(&msgs, links * 4, 0xD1B54A32D192ED03ull) < 0) {
+        FAIL("couldn't set up");
+    }
+
+    static uint8_t link_buf[4 * sizeof(relay_header) + 4 * (sizeof(ctmp_header) + CHECK_MAX_PAYLOAD)];
+    static uint8_t got[4 * (sizeof(ctmp_header) + CHECK_MAX_PAYLOAD)];
+    for (int k = 0; k < links; k++) {
+        const char *broken = breaks[k];
+        int conn = accept(listener, NULL, NULL);
+        char ctl[sizeof(RELAY_CTL) - 1];
+        if (conn < 0 || read_all(conn, ctl, sizeof(ctl)) < 0 || memcmp(ctl, RELAY_CTL, sizeof(ctl)) != 0) {
+            FAIL("link %d never asked for batches", k);
+        }
+        set_timeout(conn, CHECK_TIMEOUT_MS);
+        if (k == 0 && send_pings(conn, dst) < 0) {
+            FAIL("nothing sent up the link got through");
+        }
+
+        // messages 4k to 4k + 3 - one plain, two in batch 0, one in batch 1
+        const uint8_t *m = msgs.stream + msgs.offsets[4 * k];
+        size_t lens[4];
+        for (int j = 0; j < 4; j++) {
+            lens[j] = msgs.offsets[4 * k + j + 1] - msgs.offsets[4 * k + j];
+        }
+
+        size_t len = 0;
+        memcpy(link_buf, m, lens[0]);
+        len += lens[0];
+        len += relay_wrap(link_buf + len, 0, 2, m + lens[0], lens[1] + lens[2]);
+        size_t last = len;
+        len += relay_wrap(link_buf + len, broken != NULL && strcmp(broken, "seq") == 0 ? 5 : 1,
+                          broken != NULL && strcmp(broken, "count") == 0 ? 2 : 1, m + lens[0] + lens[1] + lens[2],
+                          lens[3]);
+        if (broken != NULL && strcmp(broken, "checksum") == 0) {
+            link_buf[last + offsetof(relay_header, checksum)] ^= 0x01;
+        }
+
+        size_t want = lens[0] + lens[1] + lens[2] + (broken == NULL ? lens[3] : 0);
+        if (write_all(conn, link_buf, len) < 0 || read_past_pings(dst, got, want) < 0 || memcmp(got, m, want) != 0) {
+            FAIL("link %d: the messages %s didn't come out as sent", k,
+                 broken == NULL ? "of an intact link" : "ahead of a broken batch");
+        }
+
+        char byte;
+        if (broken != NULL && recv(conn, &byte, 1, 0) != 0) {
+            FAIL("link %d: a batch with a bad %s didn't get the link closed", k, broken);
+        }
+        close(conn);
+    }
+
+    // a bad batch whose messages got out after all would show up as extra bytes here, after the good one's
+    char byte;
+    set_timeout(dst, 200);
+    bool extra = recv(dst, &byte, 1, 0) > 0;
+
+    close(dst);
+    close(listener);
+    bool clean = stop_proxies();
+    msgs_free(&msgs);
+
+    if (extra) {
+        FAIL("more came out than was sent in good batches");
+    }
+    if (!clean) {
+        FAIL("proxy didn't exit cleanly");
+    }
+
+    printf("%s: %d links, a bad checksum, sequence number and message count each closed theirs\n", name, links);
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    int (*run)(void);
+} check_case;
+
+static const check_case cases[] = {
+    {"mcast", check_mcast},
+    {"handoff", check_handoff},
+    {"relay", check_relay},
+    {"uplink", check_uplink},
+};
+
+#define NUM_CASES (sizeof(cases) / sizeof(cases[0]))
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-v] [case...]\ncases:", name);
+    for (size_t c = 0; c < NUM_CASES; c++) {
+        fprintf(stderr, " %s", cases[c].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    port_base = 20000 + getpid() % 20000 * 2;  // every case stays under port_base + 10
+
+    int failed = 0;
+    for (size_t c = 0; c < NUM_CASES; c++) {
+        bool wanted = optind == argc;
+        for (int k = optind; k < argc && !wanted; k++) {
+            wanted = strcmp(argv[k], cases[c].name) == 0;
+        }
+
+        if (wanted) {
+            failed += cases[c].run() < 0;
+            port_base += 10;
+        }
+    }
+
+    return failed;
+}
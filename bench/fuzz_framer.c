@@ -0,0 +1,471 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "ctmp.h"
+#include "mcast.h"
+#include "relay.h"
+
+/*
+ * Fuzz harness for the CTMP framing loop
+ *
+ * Each input is an arbitrary byte stream, fed to ctmp_framer_feed in pieces the way reads would deliver it, with the
+ * first bytes of the input choosing where the pieces end. Every outcome is checked against a straightforward
+ * reference that parses the whole stream in one go with a byte at a time big-endian checksum, and the checksum
+ * kernels are checked against the same reference directly, whole and in odd sized chunks. The same bytes, read the
+ * same way, are fed to relay_framer_feed as a stream of relay batches, and also split into lines and parsed as
+ * multicast retransmit requests (see mcast_parse_resend), against a reference built on strtoull. Any disagreement
+ * aborts.
+ *
+ * Built for libFuzzer by default, or with FUZZ_STANDALONE as a plain driver that runs each file named on the
+ * command line (or stdin, for AFL), or -r N random streams of mostly valid frames.
+ */
+
+#define FUZZ_SPLITS 8  // leading input bytes that pick read sizes, the rest is the stream
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        abort(); \
+    } \
+} while (0)
+
+/**
+ * @brief RFC 1071 the slow way, one big-endian word at a time
+ */
+static uint16_t reference_checksum(const uint8_t *buffer, size_t len) {
+    uint32_t sum = 0;
+    for (size_t k = 0; k < len; k += 2) {
+        sum += (uint32_t)buffer[k] << 8 | (k + 1 < len ? buffer[k + 1] : 0);
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+/**
+ * @brief What the front frame of data should come out as, given avail bytes of it
+ */
+static ctmp_status reference_frame(const uint8_t *data, size_t avail, size_t *frame_len) {
+    if (avail < sizeof(ctmp_header)) {
+        return CTMP_NEED_MORE;
+    }
+
+    if (data[0] != CTMP_MAGIC || (data[1] != 0 && data[1] != CTMP_OPTION_SENSITIVE) || data[6] != 0 || data[7] != 0) {
+        return CTMP_BAD_HEADER;
+    }
+
+    *frame_len = sizeof(ctmp_header) + ((size_t)data[2] << 8 | data[3]);
+    if (avail < *frame_len) {
+        return CTMP_NEED_MORE;
+    }
+
+    if (data[1] == CTMP_OPTION_SENSITIVE) {
+        uint8_t *copy = malloc(*frame_len);
+        CHECK(copy != NULL);
+        memcpy(copy, data, *frame_len);
+        copy[4] = copy[5] = 0xCC;  // summed as if the checksum field were 0xCC filled
+
+        uint16_t expected = reference_checksum(copy, *frame_len);
+        free(copy);
+        if (expected != ((uint16_t)data[4] << 8 | data[5])) {
+            return CTMP_BAD_CHECKSUM;
+        }
+    }
+
+    return CTMP_FRAME_READY;
+}
+
+static void check_checksums(const uint8_t *data, size_t size, const uint8_t *splits) {
+    uint16_t expected = reference_checksum(data, size);
+    CHECK(compute_checksum(data, size) == expected);
+
+    // the same bytes folded in piece by piece, odd lengths and all, have to finish the same
+    ctmp_csum sum = {0};
+    size_t off = 0;
+    for (int k = 0; off < size; k++) {
+        size_t chunk = 1 + splits[k % FUZZ_SPLITS] % 67;
+        if (chunk > size - off) {
+            chunk = size - off;
+        }
+        ctmp_csum_update(&sum, data + off, chunk);
+        off += chunk;
+    }
+    CHECK(ctmp_csum_final(&sum) == expected);
+}
+
+/**
+ * @brief Scans the whole stream as one burst after another, which has to find the same frames as the reference
+ */
+static void check_scan(const uint8_t *data, size_t size) {
+    static ctmp_scan scan;
+    size_t off = 0;
+    while (true) {
+        ctmp_scan_burst(&scan, data + off, size - off);
+        CHECK(scan.count <= CTMP_SCAN_MAX);
+
+        for (; ctmp_scan_pending(&scan); scan.next++) {
+            const ctmp_frame_span *span = &scan.spans[scan.next];
+            size_t frame_len = 0;
+            CHECK(scan.base + span->offset == data + off);
+            CHECK(reference_frame(data + off, size - off, &frame_len) == CTMP_FRAME_READY);
+            CHECK(span->len == frame_len && span->options == data[off + 1]);
+            off += frame_len;
+        }
+
+        if (scan.count == 0 || scan.stop != CTMP_NEED_MORE) {
+            break;
+        }
+    }
+
+    size_t frame_len = 0;
+    CHECK(reference_frame(data + off, size - off, &frame_len) == scan.stop);
+}
+
+/**
+ * @brief What the front relay batch of data should come out as, given avail bytes of it and the seq expected
+ */
+static relay_status reference_batch(const uint8_t *data, size_t avail, uint32_t seq, size_t *frame_len) {
+    if (avail < sizeof(relay_header)) {
+        return RELAY_NEED_MORE;
+    }
+
+    uint32_t len = (uint32_t)data[4] << 24 | (uint32_t)data[5] << 16 | (uint32_t)data[6] << 8 | data[7];
+    if (data[0] != RELAY_MAGIC || data[1] != 0 || data[14] != 0 || data[15] != 0 || (data[2] == 0 && data[3] == 0)
+        || len < sizeof(ctmp_header) || len > RELAY_MAX_BODY) {
+        return RELAY_BAD_HEADER;
+    }
+
+    if (((uint32_t)data[8] << 24 | (uint32_t)data[9] << 16 | (uint32_t)data[10] << 8 | data[11]) != seq) {
+        return RELAY_BAD_SEQ;
+    }
+
+    *frame_len = sizeof(relay_header) + len;
+    if (avail < *frame_len) {
+        return RELAY_NEED_MORE;
+    }
+
+    uint8_t *copy = malloc(*frame_len);
+    CHECK(copy != NULL);
+    memcpy(copy, data, *frame_len);
+    copy[12] = copy[13] = 0;  // summed with the checksum field as 0
+    uint16_t expected = reference_checksum(copy, *frame_len);
+    free(copy);
+    if (expected != ((uint16_t)data[12] << 8 | data[13])) {
+        return RELAY_BAD_CHECKSUM;
+    }
+
+    size_t off = sizeof(relay_header);
+    size_t msgs = 0;
+    for (; off + sizeof(ctmp_header) <= *frame_len; msgs++) {
+        off += sizeof(ctmp_header) + ((size_t)data[off + 2] << 8 | data[off + 3]);
+    }
+
+    return off == *frame_len && msgs == ((size_t)data[2] << 8 | data[3]) ? RELAY_BATCH_READY : RELAY_BAD_BODY;
+}
+
+/**
+ * @brief The batch loop of publish_src_turn on a relay link, with avail growing by one read at a time
+ */
+static void check_relay(const uint8_t *data, size_t size, const uint8_t *splits) {
+    relay_framer rf = {.batched = true};
+    size_t rd = 0;
+    size_t wr = 0;
+    for (int read = 0; rd < size; read++) {
+        relay_status status = relay_framer_feed(&rf, data + rd, wr - rd);
+
+        size_t frame_len = 0;
+        relay_status expected = reference_batch(data + rd, wr - rd, rf.seq, &frame_len);
+        CHECK(status == expected);
+
+        if (status == RELAY_BATCH_READY) {
+            CHECK(rf.frame_len == frame_len);
+            CHECK(relay_framer_feed(&rf, data + rd, wr - rd) == RELAY_BATCH_READY);  // as if held up by backpressure
+
+            uint32_t seq = rf.seq;
+            relay_framer_open(&rf);
+            CHECK(rf.left == frame_len - sizeof(relay_header) && rf.seq == seq + 1);
+            rd += frame_len;
+            rf.left = 0;  // every message taken
+            continue;
+        }
+
+        if (status != RELAY_NEED_MORE) {
+            break;  // the proxy drops the link here
+        }
+
+        if (wr == size) {
+            break;
+        }
+
+        uint8_t pick = splits[read % FUZZ_SPLITS] ^ (uint8_t)read;
+        size_t chunk = pick & 0x80 ? (size_t)pick << 8 : 1 + (pick & 0x1F);
+        wr = chunk < size - wr ? wr + chunk : size;
+    }
+}
+
+/**
+ * @brief What a retransmit request line should parse as
+ */
+static int reference_resend(const char *line, uint64_t *first, uint64_t *last) {
+    if (strncmp(line, "resend=", 7) != 0) {
+        return -1;
+    }
+
+    const char *p = line + 7;
+    uint64_t values[2] = {0, MCAST_RESEND_ALL};
+    for (int k = 0; k < 2; k++) {
+        size_t digits = strspn(p, "0123456789");
+        if (digits == 0) {
+            return -1;
+        }
+
+        errno = 0;
+        values[k] = strtoull(p, NULL, 10);
+        if (errno == ERANGE) {
+            return -1;
+        }
+        p += digits;
+
+        if (k == 1 || *p != '-') {
+            break;
+        }
+        p++;
+    }
+
+    if ((strcmp(p, "") != 0 && strcmp(p, "\r") != 0) || values[1] < values[0] || values[1] > MCAST_RESEND_ALL
+        || (values[1] == MCAST_RESEND_ALL && strchr(line, '-') != NULL)) {
+        return -1;
+    }
+
+    *first = values[0];
+    *last = values[1];
+    return 0;
+}
+
+/**
+ * @brief Splits the stream into lines the way a retransmit connection does, each has to parse the same as the
+ * reference
+ */
+static void check_resend(const uint8_t *data, size_t size) {
+    char line[MCAST_CTL_LEN];
+    size_t len = 0;
+
+    for (size_t k = 0; k < size; k++) {
+        if (data[k] != '\n' && len < MCAST_CTL_LEN - 1) {
+            line[len++] = (char)data[k];
+            continue;
+        }
+        line[len] = '\0';  // the proxy sees up to the first NUL, same as here
+        len = 0;
+
+        uint64_t first = 0;
+        uint64_t last = 0;
+        uint64_t ref_first = 0;
+        uint64_t ref_last = 0;
+        int rc = mcast_parse_resend(line, &first, &last);
+        CHECK(rc == reference_resend(line, &ref_first, &ref_last));
+        CHECK(rc < 0 || (first == ref_first && last == ref_last));
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    uint8_t splits[FUZZ_SPLITS] = {0};
+    size_t taken = size < FUZZ_SPLITS ? size : FUZZ_SPLITS;
+    memcpy(splits, data, taken);
+    data += taken;
+    size -= taken;
+
+    check_checksums(data, size, splits);
+    check_scan(data, size);
+    check_relay(data, size, splits);
+    check_resend(data, size);
+
+    // the framing loop of publish_src_turn, with avail growing by one read at a time
+    ctmp_framer framer = {0};
+    size_t rd = 0;
+    size_t wr = 0;
+    for (int read = 0; rd < size; read++) {
+        ctmp_status status = ctmp_framer_feed(&framer, data + rd, wr - rd);
+
+        size_t frame_len = 0;
+        ctmp_status expected = reference_frame(data + rd, wr - rd, &frame_len);
+        CHECK(status == expected);
+
+        if (status == CTMP_FRAME_READY) {
+            CHECK(framer.frame_len == frame_len);
+            CHECK(ctmp_framer_feed(&framer, data + rd, wr - rd) == CTMP_FRAME_READY);  // as if held up by backpressure
+            rd += frame_len;
+            ctmp_framer_consume(&framer);
+            continue;
+        }
+
+        if (status != CTMP_NEED_MORE) {
+            break;  // the proxy drops the source here
+        }
+
+        if (wr == size) {
+            break;  // ends part way through a frame
+        }
+
+        // mostly small reads, now and then a big one, so frames get split every which way
+        uint8_t pick = splits[read % FUZZ_SPLITS] ^ (uint8_t)read;
+        size_t chunk = pick & 0x80 ? (size_t)pick << 8 : 1 + (pick & 0x1F);
+        wr = chunk < size - wr ? wr + chunk : size;
+    }
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/**
+ * @brief Writes one valid frame of up to max_payload bytes at frame, if it fits in room
+ *
+ * @return size_t - bytes written, 0 if it didn't fit
+ */
+static size_t random_frame(uint8_t *frame, size_t room, size_t max_payload, uint64_t *state) {
+    size_t payload = xorshift(state) % 4 == 0 ? xorshift(state) % (max_payload + 1) : xorshift(state) % 300;
+    if (sizeof(ctmp_header) + payload > room) {
+        return 0;
+    }
+
+    for (size_t b = 0; b < payload; b++) {
+        frame[sizeof(ctmp_header) + b] = (uint8_t)xorshift(state);
+    }
+
+    bool sensitive = xorshift(state) & 1;
+    ctmp_header header = {.magic = CTMP_MAGIC, .options = sensitive ? CTMP_OPTION_SENSITIVE : 0,
+                          .length = htons(payload), .checksum = sensitive ? 0xCCCC : 0};
+    memcpy(frame, &header, sizeof(header));
+    if (sensitive) {
+        header.checksum = htons(reference_checksum(frame, sizeof(header) + payload));
+        memcpy(frame, &header, sizeof(header));
+    }
+    return sizeof(ctmp_header) + payload;
+}
+
+/**
+ * @brief Writes a relay batch of a few valid frames at batch, now and then with the wrong seq or message count
+ *
+ * @return size_t - bytes written, 0 if not even one frame fit
+ */
+static size_t random_batch(uint8_t *batch, size_t room, uint32_t seq, uint64_t *state) {
+    if (room < sizeof(relay_header)) {
+        return 0;
+    }
+
+    uint8_t *body = batch + sizeof(relay_header);
+    size_t len = 0;
+    uint16_t msgs = 0;
+    for (int f = 1 + xorshift(state) % 8; f > 0; f--) {
+        size_t frame_len = random_frame(body + len, room - sizeof(relay_header) - len, 4096, state);  // 8 fit a batch
+        if (frame_len == 0) {
+            break;
+        }
+        len += frame_len;
+        msgs++;
+    }
+    if (msgs == 0) {
+        return 0;
+    }
+
+    uint64_t odd = xorshift(state) % 16;
+    relay_header header = {.magic = RELAY_MAGIC, .msgs = htons(odd == 0 ? msgs + 1 : msgs), .len = htonl(len),
+                           .seq = htonl(odd == 1 ? seq + 1 : seq)};
+    memcpy(batch, &header, sizeof(header));
+    header.checksum = htons(reference_checksum(batch, sizeof(header) + len));
+    memcpy(batch, &header, sizeof(header));
+    return sizeof(header) + len;
+}
+
+/**
+ * @brief Builds a stream of valid frames, or a third of the time relay batches of them, with the odd byte flipped,
+ * much more likely to get deep into the framers than uniformly random bytes
+ */
+static size_t random_input(uint8_t *buffer, size_t max, uint64_t *state) {
+    size_t len = 0;
+    for (; len < FUZZ_SPLITS; len++) {
+        buffer[len] = (uint8_t)xorshift(state);
+    }
+
+    bool batches = xorshift(state) % 3 == 0;
+    int pieces = 1 + xorshift(state) % 16;
+    for (int p = 0; p < pieces; p++) {
+        size_t piece = batches ? random_batch(buffer + len, max - len, p, state)
+                               : random_frame(buffer + len, max - len, UINT16_MAX, state);
+        if (piece == 0) {
+            break;
+        }
+        len += piece;
+    }
+
+    if (xorshift(state) % 4 == 0) {
+        buffer[FUZZ_SPLITS + xorshift(state) % (len - FUZZ_SPLITS)] ^= (uint8_t)(1 << xorshift(state) % 8);
+    }
+    if (xorshift(state) % 4 == 0) {
+        len -= xorshift(state) % (len - FUZZ_SPLITS);  // cut off part way through
+    }
+
+    // and now and then some retransmit requests after it, mostly well formed, to get past the prefix
+    for (int lines = xorshift(state) % 4 == 0 ? 1 + xorshift(state) % 8 : 0; lines > 0 && len + 64 < max; lines--) {
+        uint64_t first = xorshift(state) % 3 == 0 ? xorshift(state) : xorshift(state) % 100000;
+        uint64_t last = xorshift(state) % 3 == 0 ? xorshift(state) : first + xorshift(state) % 100;
+        const char *forms[] = {"resend=%llu-%llu\n", "resend=%llu\r\n", "resend=%llu-%llu\r\n", "resend=%llu-\n",
+                               "resend=-%llu\n", "resend=%llu0%llu\n", "resend=+%llu\n"};
+        len += snprintf((char *)buffer + len, 64, forms[xorshift(state) % 7], (unsigned long long)first,
+                        (unsigned long long)last);
+    }
+
+    return len;
+}
+
+static int run_file(FILE *file) {
+    static uint8_t buffer[1 << 22];
+    size_t len = fread(buffer, 1, sizeof(buffer), file);
+    return LLVMFuzzerTestOneInput(buffer, len);
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "-r") == 0) {
+        static uint8_t buffer[1 << 20];
+        long runs = atol(argv[2]);
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+
+        for (long r = 0; r < runs; r++) {
+            LLVMFuzzerTestOneInput(buffer, random_input(buffer, sizeof(buffer), &state));
+        }
+        printf("%ld random streams ok\n", runs);
+        return 0;
+    }
+
+    if (argc == 1) {
+        return run_file(stdin);
+    }
+
+    for (int k = 1; k < argc; k++) {
+        FILE *file = fopen(argv[k], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open '%s'\n", argv[k]);
+            return 1;
+        }
+        run_file(file);
+        fclose(file);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,412 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "ctmp.h"
+
+#define MB_STREAM (1 << 20)  // bytes of frames each kernel walks per pass, cache resident like a burst just read
+#define MB_MIN_NS 20000000  // a run repeats passes until it has taken at least this long
+#define MB_RUNS 7  // median of, to see past whatever else the box is doing without rewarding a lucky run
+#define MB_RECHECKS 3  // times a case that looks like a regression is measured again before it counts as one
+#define MB_SLACK_NS 0.25  // on top of the tolerance, for the few ns kernels where that's below the timing noise
+#define MB_DEFAULT_TOLERANCE 15  // percent slower than the baseline that counts as a regression
+#define MB_MAX_CASES 128
+#define MB_CALIBRATION "calibration 0 0"  // baseline entry for the reference loop, in ns per pass
+#define MB_CALIBRATION_WORDS 8192  // 64 KiB of the stream, so the reference loop stays in cache
+
+static const uint32_t payload_sizes[] = {16, 64, 256, 1500, 16384, 65535};
+static const uint32_t alignments[] = {0, 1};  // where the stream starts relative to a 64 byte boundary
+
+/**
+ * @brief One of the per-frame kernels, walking a stream of frames the way the proxy does and returning something
+ * derived from every result so none of the work can be optimised away
+ */
+typedef struct {
+    const char *name;
+    bool sensitive;  // stream built from sensitive (checksummed) frames rather than normal ones
+    bool header_only;  // never reads a payload, so reported in frames/s - bytes/s would count bytes it skips over
+    uint64_t (*walk)(const uint8_t *stream, size_t len);
+} mb_kernel;
+
+typedef struct {
+    char key[64];  // kernel payload align
+    double ns_per_frame;
+} mb_result;
+
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t walk_header(const uint8_t *stream, size_t len) {
+    uint64_t valid = 0;
+    for (size_t off = 0; off < len;) {
+        const ctmp_header *header = (const ctmp_header *)(stream + off);
+        valid += is_header_valid(header);
+        off += sizeof(ctmp_header) + ntohs(header->length);
+    }
+    return valid;
+}
+
+static uint64_t walk_st1_header(const uint8_t *stream, size_t len) {
+    uint64_t valid = 0;
+    for (size_t off = 0; off < len;) {
+        const ctmp1_header *header = (const ctmp1_header *)(stream + off);
+        valid += is_st1_header_valid(header);
+        off += sizeof(ctmp1_header) + ntohs(header->length);
+    }
+    return valid;
+}
+
+static uint64_t walk_checksum(const uint8_t *stream, size_t len) {
+    uint64_t sum = 0;
+    for (size_t off = 0; off < len;) {
+        size_t payload = ntohs(((const ctmp_header *)(stream + off))->length);
+        sum += compute_checksum(stream + off + sizeof(ctmp_header), payload);
+        off += sizeof(ctmp_header) + payload;
+    }
+    return sum;
+}
+
+static uint64_t walk_valid_checksum(const uint8_t *stream, size_t len) {
+    uint64_t valid = 0;
+    for (size_t off = 0; off < len;) {
+        const ctmp_header *header = (const ctmp_header *)(stream + off);
+        valid += is_valid_checksum(header, stream + off + sizeof(ctmp_header));
+        off += sizeof(ctmp_header) + ntohs(header->length);
+    }
+    return valid;
+}
+
+/**
+ * @brief The framing loop of publish_src_turn, with everything already read - one feed per frame
+ */
+static uint64_t walk_framer(const uint8_t *stream, size_t len) {
+    ctmp_framer framer = {0};
+    uint64_t ready = 0;
+    for (size_t off = 0; off < len;) {
+        ready += ctmp_framer_feed(&framer, stream + off, len - off) == CTMP_FRAME_READY;
+        off += framer.frame_len;
+        ctmp_framer_consume(&framer);
+    }
+    return ready;
+}
+
+/**
+ * @brief The same stream split up by ctmp_scan_burst, CTMP_SCAN_MAX frames at a time, and published from the spans
+ */
+static uint64_t walk_scan(const uint8_t *stream, size_t len) {
+    static ctmp_scan scan;
+    uint64_t found = 0;
+    for (size_t off = 0; off < len;) {
+        ctmp_scan_burst(&scan, stream + off, len - off);
+        if (scan.count == 0) {
+            break;
+        }
+        for (; ctmp_scan_pending(&scan); scan.next++) {
+            off += scan.spans[scan.next].len;
+        }
+        found += scan.count;
+    }
+    return found;
+}
+
+/**
+ * @brief Reference loop the kernels are timed relative to - a plain scalar sum that doesn't touch ctmp.c, so however
+ * much faster or slower the box is running right now (or than the one the baseline came from) it goes the same way
+ */
+static uint64_t walk_calibration(const uint8_t *stream, size_t len) {
+    (void)len;
+    uint64_t sum = 0;
+    for (size_t w = 0; w < MB_CALIBRATION_WORDS; w++) {
+        uint64_t word;
+        memcpy(&word, stream + w * sizeof(word), sizeof(word));
+        sum = (sum ^ word) * 0x100000001B3ull;  // FNV style, every step depends on the last
+    }
+    return sum;
+}
+
+static const mb_kernel calibration = {"calibration", false, false, walk_calibration};
+
+static const mb_kernel kernels[] = {
+    {"header", false, true, walk_header},
+    {"st1_header", false, true, walk_st1_header},
+    {"checksum", true, false, walk_checksum},
+    {"valid_checksum", true, false, walk_valid_checksum},
+    {"framer_normal", false, true, walk_framer},
+    {"framer_sensitive", true, false, walk_framer},
+    {"scan_normal", false, true, walk_scan},
+    {"scan_sensitive", true, false, walk_scan},
+};
+
+/**
+ * @brief Fills stream with back to back valid frames of one payload size
+ *
+ * @return size_t - frames written, the rest of the stream is left unused
+ */
+static size_t build_stream(uint8_t *stream, size_t len, uint32_t payload, bool sensitive, size_t *used) {
+    size_t frame_len = sizeof(ctmp_header) + payload;
+    size_t frames = len / frame_len;
+
+    for (size_t f = 0; f < frames; f++) {
+        uint8_t *frame = stream + f * frame_len;
+        for (uint32_t b = 0; b < payload; b++) {
+            frame[sizeof(ctmp_header) + b] = (uint8_t)(f * 131 + b * 7);
+        }
+
+        ctmp_header header = {.magic = CTMP_MAGIC, .length = htons(payload)};
+        if (sensitive) {
+            header.options = CTMP_OPTION_SENSITIVE;
+            header.checksum = 0xCCCC;
+            memcpy(frame, &header, sizeof(header));
+            header.checksum = htons(compute_checksum(frame, frame_len));
+        }
+        memcpy(frame, &header, sizeof(header));
+    }
+
+    *used = frames * frame_len;
+    return frames;
+}
+
+/**
+ * @brief Times passes of a kernel over a stream for at least MB_MIN_NS
+ *
+ * @return double - nanoseconds per frame
+ */
+static double measure_run(const mb_kernel *kernel, const uint8_t *stream, size_t len, size_t frames) {
+    uint64_t passes = 0;
+    uint64_t start = now_ns();
+    uint64_t elapsed;
+    do {
+        sink += kernel->walk(stream, len);
+        passes++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MB_MIN_NS);
+
+    return (double)elapsed / (double)(passes * frames);
+}
+
+static double median(double *runs, int count) {
+    for (int i = 1; i < count; i++) {  // insertion sort, there are only ever MB_RUNS of them
+        double run = runs[i];
+        int j = i;
+        for (; j > 0 && runs[j - 1] > run; j--) {
+            runs[j] = runs[j - 1];
+        }
+        runs[j] = run;
+    }
+
+    return runs[count / 2];
+}
+
+/**
+ * @brief Times a kernel relative to the calibration loop, each run of it straight after a run of the loop so both see
+ * the box at the same speed, median of MB_RUNS
+ *
+ * @param cal_stream what the calibration loop reads
+ * @return double - nanoseconds per frame for each nanosecond the calibration loop takes per pass
+ */
+static double measure(const mb_kernel *kernel, const uint8_t *stream, size_t len, size_t frames,
+                      const uint8_t *cal_stream) {
+    double runs[MB_RUNS];
+
+    for (int r = 0; r < MB_RUNS; r++) {
+        double cal = measure_run(&calibration, cal_stream, 0, 1);
+        runs[r] = measure_run(kernel, stream, len, frames) / cal;
+    }
+
+    return median(runs, MB_RUNS);
+}
+
+/**
+ * @brief Reads a baseline written by -w, lines of "kernel payload align ns_per_frame" with # comments
+ *
+ * @return int - entries read, -1 if the file couldn't be opened
+ */
+static int load_baseline(const char *path, mb_result *base, int max) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), file) != NULL) {
+        char name[32];
+        unsigned payload, align;
+        double ns;
+        if (line[0] == '#' || sscanf(line, "%31s %u %u %lf", name, &payload, &align, &ns) != 4) {
+            continue;
+        }
+
+        snprintf(base[count].key, sizeof(base[count].key), "%s %u %u", name, payload, align);
+        base[count++].ns_per_frame = ns;
+    }
+
+    fclose(file);
+    return count;
+}
+
+static const mb_result *find_baseline(const mb_result *base, int count, const char *key) {
+    for (int k = 0; k < count; k++) {
+        if (strcmp(base[k].key, key) == 0) {
+            return &base[k];
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b baseline] [-w baseline] [-t tolerance_pct] [-k kernel]\n"
+                    "  -b file   compare against a baseline, exiting non-zero on any regression\n"
+                    "  -w file   write the results out as a new baseline\n"
+                    "  -t pct    how much slower than the baseline counts as a regression (default %d)\n"
+                    "  -k name   only run the named kernel\n", prog, MB_DEFAULT_TOLERANCE);
+}
+
+int main(int argc, char **argv) {
+    const char *baseline_path = NULL;
+    const char *write_path = NULL;
+    const char *only = NULL;
+    double tolerance = MB_DEFAULT_TOLERANCE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:t:k:")) != -1) {
+        switch (opt) {
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 'w':
+                write_path = optarg;
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            case 'k':
+                only = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    static mb_result base[MB_MAX_CASES];
+    static mb_result results[MB_MAX_CASES];
+    int num_base = 0;
+    int num_results = 0;
+
+    if (baseline_path != NULL && (num_base = load_baseline(baseline_path, base, MB_MAX_CASES)) < 0) {
+        fprintf(stderr, "Failed to open baseline '%s'\n", baseline_path);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t *buffer = aligned_alloc(64, MB_STREAM + 64);
+    if (buffer == NULL) {
+        fprintf(stderr, "Failed to allocate %d byte stream\n", MB_STREAM);
+        return EXIT_FAILURE;
+    }
+    memset(buffer, 0, MB_STREAM + 64);
+
+    // kernels are timed relative to the reference loop, and reported at the speed it ran at to begin with - the
+    // baseline is compared the same way, so it still holds when the box is running slower (or is another box)
+    const mb_result *base_cal = find_baseline(base, num_base, MB_CALIBRATION);
+    double cal_runs[MB_RUNS];
+    for (int r = 0; r < MB_RUNS; r++) {
+        cal_runs[r] = measure_run(&calibration, buffer, 0, 1);
+    }
+    double cal = median(cal_runs, MB_RUNS);
+    results[num_results++] = (mb_result){.key = MB_CALIBRATION, .ns_per_frame = cal};
+    if (baseline_path != NULL && base_cal == NULL) {
+        fprintf(stderr, "Baseline '%s' has no calibration entry, comparing timings as they are\n", baseline_path);
+    }
+
+    printf("%-18s %8s %5s %10s %14s %10s\n", "kernel", "payload", "align", "ns/frame", "throughput", "baseline");
+
+    int regressions = 0;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (only != NULL && strcmp(only, kernels[k].name) != 0) {
+            continue;
+        }
+
+        for (size_t p = 0; p < sizeof(payload_sizes) / sizeof(payload_sizes[0]); p++) {
+            for (size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++) {
+                uint8_t *stream = buffer + alignments[a];
+                char key[64];
+                snprintf(key, sizeof(key), "%s %u %u", kernels[k].name, payload_sizes[p], alignments[a]);
+                size_t len;
+                size_t frames = build_stream(stream, MB_STREAM, payload_sizes[p], kernels[k].sensitive, &len);
+
+                const mb_result *expected = find_baseline(base, num_base, key);
+                double limit = 0;
+                if (expected != NULL) {
+                    double expected_ns = expected->ns_per_frame * (base_cal != NULL ? cal / base_cal->ns_per_frame : 1);
+                    limit = expected_ns * (1 + tolerance / 100) + MB_SLACK_NS;
+                }
+
+                double ns = measure(&kernels[k], stream, len, frames, buffer) * cal;
+
+                // a real regression is still there when measured again, a neighbour stealing the CPU usually isn't
+                for (int r = 0; expected != NULL && ns > limit && r < MB_RECHECKS; r++) {
+                    double again = measure(&kernels[k], stream, len, frames, buffer) * cal;
+                    ns = again < ns ? again : ns;
+                }
+
+                results[num_results] = (mb_result){.ns_per_frame = ns};
+                snprintf(results[num_results++].key, sizeof(results[0].key), "%s", key);
+
+                printf("%-18s %8u %5u %10.2f", kernels[k].name, payload_sizes[p], alignments[a], ns);
+                if (kernels[k].header_only) {
+                    printf(" %8.1f Mfr/s", 1e3 / ns);  // frames per ns is 1000 Mframes/s
+                } else {
+                    printf(" %9.2f GB/s", (double)len / frames / ns);  // bytes per ns is GB/s
+                }
+
+                if (expected == NULL) {
+                    printf(baseline_path != NULL ? " %10s\n" : "\n", "-");
+                } else if (ns > limit) {
+                    double expected_ns = (limit - MB_SLACK_NS) / (1 + tolerance / 100);
+                    printf(" %10.2f  REGRESSION (+%.0f%%)\n", expected_ns, (ns / expected_ns - 1) * 100);
+                    regressions++;
+                } else {
+                    printf(" %10.2f\n", (limit - MB_SLACK_NS) / (1 + tolerance / 100));
+                }
+            }
+        }
+    }
+
+    free(buffer);
+
+    if (write_path != NULL) {
+        FILE *file = fopen(write_path, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to write baseline '%s'\n", write_path);
+            return EXIT_FAILURE;
+        }
+
+        fprintf(file, "# kernel payload align ns_per_frame - written by ctmp_microbench -w, median of %d runs, compared "
+                      "relative to the calibration loop\n", MB_RUNS);
+        for (int r = 0; r < num_results; r++) {
+            fprintf(file, "%s %.2f\n", results[r].key, results[r].ns_per_frame);
+        }
+        fclose(file);
+        printf("Baseline written to %s\n", write_path);
+    }
+
+    if (regressions > 0) {
+        fprintf(stderr, "%d case(s) more than %.0f%% slower than %s\n", regressions, tolerance, baseline_path);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
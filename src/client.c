@@ -0,0 +1,558 @@
+//
+// Created by raven on 19/08/2025.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "client.h"
+
+/**
+ * @brief Sets O_NONBLOCK on a file descriptor, so reads/writes/accepts return EAGAIN rather than blocking the loop
+ *
+ * @param fd file descriptor to modify
+ */
+void set_non_block(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        fprintf(stderr, "Failed to set fd %d as non-blocking: %s\n", fd, strerror(errno));
+    }
+}
+
+/**
+ * @brief Sets SO_BUSY_POLL, so a read that finds nothing queued spins on the device queue for up to usec rather than
+ * going back to waiting on an interrupt - raising it past net.core.busy_read needs CAP_NET_ADMIN, which is only
+ * warned about (once), the socket works the same either way
+ *
+ * @param fd socket to modify
+ * @param usec busy poll budget, 0 to leave the socket alone
+ */
+void set_busy_poll(int fd, int usec) {
+    static bool warned = false;
+
+    if (usec > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0 && !warned) {
+        fprintf(stderr, "Failed to set SO_BUSY_POLL on fd %d, continuing without: %s\n", fd, strerror(errno));
+        warned = true;
+    }
+}
+
+/**
+ * @brief Deregisters and closes the source connection, resetting it so a new source may connect
+ *
+ * @param loop event loop the source is registered with
+ * @param src source client to close
+ */
+void close_src_client(ev_loop *loop, src_client *src) {
+    if (src->fd == -1) {
+        return;
+    }
+
+    ev_del(loop, src->fd);
+    close(src->fd);
+
+    // don't bother zeroing the read buffer, rd == wr means nothing in it is considered valid
+    src->fd = -1;
+    src->rd = src->wr = 0;
+    ctmp_framer_consume(&src->framer);
+    ctmp_scan_reset(&src->scan);
+    src->relayed = false;
+    src->relay = (relay_framer){0};
+    src->prev_mask = 0;
+    src->deficit = 0;
+}
+
+/**
+ * @brief Deregisters and closes a destination connection, freeing up its slot
+ *
+ * @param loop event loop the destination is registered with
+ * @param dst destination client to close
+ */
+void close_dst_client(ev_loop *loop, dst_client *dst) {
+    if (dst->fd == -1) {
+        return;
+    }
+
+    if (dst->drops > 0) {
+        printf("Closing destination client on fd %d (dropped %lu messages, %lu bytes under %s)\n", dst->fd,
+               (unsigned long)dst->drops, (unsigned long)dst->drop_bytes, dst_policy_name(dst->policy));
+    } else {
+        printf("Closing destination client on fd %d\n", dst->fd);
+    }
+
+    ev_del(loop, dst->fd);
+    if (dst->zerocopy != NULL) {
+        zerocopy_abort(dst->zerocopy, dst->fd);
+    }
+    close(dst->fd);
+
+    if (dst->pipe[0] != -1) {  // anything still in it is lost with the connection anyway
+        close(dst->pipe[0]);
+        close(dst->pipe[1]);
+        dst->pipe[0] = dst->pipe[1] = -1;
+    }
+
+    dst->fd = -1;  // queue no longer pins anything in the broadcast ring
+    dst->head[DST_LANE_NORMAL] = dst->tail[DST_LANE_NORMAL] = 0;
+    dst->head[DST_LANE_PRIO] = dst->tail[DST_LANE_PRIO] = 0;
+    dst->sent = 0;
+    dst->spill_len = dst->spill_sent = 0;  // spill buffer itself is kept for whoever gets the slot next
+    if (dst->zerocopy != NULL) {
+        zerocopy_reset(dst->zerocopy);  // the close was abortive if anything was in flight, nothing reads the ring
+    }
+    dst->piped = 0;
+    dst->replaying = false;
+    dst->relay = dst->relay_requested = false;
+    dst->prev_mask = 0;
+    dst->ctl_len = 0;
+}
+
+/**
+ * @brief Picks the lane the next message comes from given next, the first unplanned message of each lane - the
+ * priority lane unless it has had prio_guard turns in a row with normal messages waiting
+ *
+ * @return int - lane, -1 if both are exhausted
+ */
+static int dst_pick_lane(const dst_client *dst, const uint32_t next[DST_LANES], uint32_t streak) {
+    bool prio = next[DST_LANE_PRIO] != dst->head[DST_LANE_PRIO];
+    bool normal = next[DST_LANE_NORMAL] != dst->head[DST_LANE_NORMAL];
+
+    if (prio && (!normal || streak < dst->prio_guard)) {
+        return DST_LANE_PRIO;
+    }
+    return normal ? DST_LANE_NORMAL : -1;
+}
+
+/**
+ * @brief Sensitive messages in a row written while normal ones were waiting, after one more from lane
+ */
+static uint32_t dst_next_streak(const dst_client *dst, const uint32_t next[DST_LANES], int lane, uint32_t streak) {
+    return lane == DST_LANE_PRIO && next[DST_LANE_NORMAL] != dst->head[DST_LANE_NORMAL] ? streak + 1 : 0;
+}
+
+static int dst_alloc_spill(dst_client *dst) {
+    if (dst->spill == NULL) {
+        dst->spill = malloc(DST_SPILL_LEN);  // only ever needed by dsts that fall behind
+    }
+    return dst->spill != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Copies the unwritten rest of a relay batch into the spill buffer and dequeues every message in it, as the
+ * envelope has already promised the whole batch to the other end
+ *
+ * @param iov the batch as written, envelope first
+ * @param written bytes of it the socket took
+ * @param lanes lane of each message in the batch, in order
+ * @param msgs messages in the batch
+ * @return int - 0 on success, -1 if the spill buffer couldn't be allocated
+ */
+static int spill_dst_batch(dst_client *dst, const struct iovec *iov, int iovcnt, size_t written, const uint8_t *lanes,
+                           int msgs) {
+    if (dst_alloc_spill(dst) < 0) {
+        return -1;
+    }
+
+    dst->spill_len = dst->spill_sent = 0;
+    for (int k = 0; k < iovcnt; k++) {
+        size_t skip = written < iov[k].iov_len ? written : iov[k].iov_len;
+        written -= skip;
+
+        memcpy(dst->spill + dst->spill_len, (const uint8_t *)iov[k].iov_base + skip, iov[k].iov_len - skip);
+        dst->spill_len += iov[k].iov_len - skip;
+    }
+
+    for (int m = 0; m < msgs; m++) {
+        dst->tail[lanes[m]]++;
+        dst->prio_streak = dst_next_streak(dst, dst->tail, lanes[m], dst->prio_streak);
+    }
+    dst->spill_msgs = msgs;
+    return 0;
+}
+
+/**
+ * @brief Plans the next sendmsg of a destination's queue, gathering up to DST_MAX_BATCH queued messages. Messages that
+ * are adjacent in the ring collapse into a single iovec.
+ *
+ * A message already partly written always goes first, after that the lanes are interleaved by dst_pick_lane. The
+ * order is planned up front and retired in the same order, whatever of it the socket took. With -Z a batch of large
+ * enough messages goes out with MSG_ZEROCOPY, and the ring stays pinned behind it until it completes (see
+ * dst_zerocopy).
+ *
+ * A relay destination gets each batch sealed in an envelope instead, which caps it at RELAY_MAX_BODY.
+ *
+ * @param dst destination with something pending
+ * @param ring broadcast ring the queued descriptors point into
+ * @param w filled in, w->msg is ready to send with w->flags
+ */
+void dst_plan_write(dst_client *dst, const bcast_ring *ring, dst_write *w) {
+    w->iovcnt = 0;
+    w->msgs = 0;
+
+    if (dst->spill_len > 0) {
+        w->iov[w->iovcnt++] = (struct iovec){.iov_base = dst->spill + dst->spill_sent,
+                                             .iov_len = dst->spill_len - dst->spill_sent};
+    }
+
+    w->sealing = dst->relay && dst->spill_len == 0;  // a spilled batch goes out on its own, already sealed
+    if (w->sealing) {
+        w->iov[w->iovcnt++] = (struct iovec){.iov_base = &w->envelope, .iov_len = sizeof(w->envelope)};
+    }
+
+    uint32_t next[DST_LANES] = {dst->tail[DST_LANE_NORMAL], dst->tail[DST_LANE_PRIO]};
+    uint32_t streak = dst->prio_streak;
+    w->planned = 0;
+    w->oldest = UINT64_MAX;
+    while (w->msgs < DST_MAX_BATCH && (w->sealing || !dst->relay)) {
+        bool partial = w->msgs == 0 && dst->sent > 0;
+        int lane = partial ? dst->sending : dst_pick_lane(dst, next, streak);
+        if (lane < 0) {
+            break;
+        }
+
+        const frame_desc *desc = dst_lane_at(dst, lane, next[lane]);
+        uint64_t offset = desc->offset;
+        size_t len = desc->len;
+
+        if (partial) {  // skip whatever of it already went out
+            offset += dst->sent;
+            len -= dst->sent;
+        }
+
+        if (w->sealing && w->planned + len > RELAY_MAX_BODY) {
+            break;
+        }
+
+        uint8_t *base = ring_ptr(ring, offset);  // mirrored, so contiguous even if it straddles the wrap
+
+        if (w->iovcnt > 0 && (uint8_t *)w->iov[w->iovcnt - 1].iov_base + w->iov[w->iovcnt - 1].iov_len == base) {
+            w->iov[w->iovcnt - 1].iov_len += len;  // back to back in the ring, extend rather than add
+        } else if (w->iovcnt < DST_MAX_IOV) {
+            w->iov[w->iovcnt++] = (struct iovec){.iov_base = base, .iov_len = len};
+        } else {
+            break;
+        }
+
+        w->planned += len;
+        if (offset < w->oldest) {
+            w->oldest = offset;
+        }
+
+        next[lane]++;
+        streak = dst_next_streak(dst, next, lane, streak);
+        w->lanes[w->msgs++] = lane;
+    }
+
+    if (w->sealing) {
+        relay_seal(&w->envelope, dst->relay_seq, w->msgs, w->iov + 1, w->iovcnt - 1, w->planned);
+    }
+
+    // only a blocking destination may hold on to the ring until the kernel is done with it, and only the ring may
+    // be held on to - the spill buffer gets reused, and so does the envelope
+    w->zerocopy = dst->policy == DST_POLICY_BLOCK && dst->spill_len == 0 && !dst->relay
+                  && zerocopy_wanted(dst->zerocopy, w->planned, w->msgs);
+
+    w->len = 0;
+    for (int k = 0; k < w->iovcnt; k++) {
+        w->len += w->iov[k].iov_len;
+    }
+    w->msg = (struct msghdr){.msg_iov = w->iov, .msg_iovlen = w->iovcnt};
+    w->flags = MSG_NOSIGNAL | (w->zerocopy ? MSG_ZEROCOPY : 0);  // no SIGPIPE if the dst vanished mid-write
+}
+
+/**
+ * @brief Retires whatever of a planned write the socket took, leaving sent pointing into the message that was cut
+ * short
+ *
+ * A relay batch is fixed once its envelope has gone out, so if the socket only took part of one the rest is spilled
+ * there and then, rather than replanned from the queues next time.
+ *
+ * @param w as planned by dst_plan_write
+ * @param res what sendmsg made of w->msg - bytes written, or -errno
+ * @param metrics owning shard's counters, fully written messages also get their latency recorded
+ * @return ssize_t - bytes written (0 if the socket was full), -1 on an unrecoverable write error
+ */
+ssize_t dst_finish_write(dst_client *dst, dst_write *w, ssize_t res, egress_metrics *metrics) {
+    if (res == -ENOBUFS && w->zerocopy) {  // out of option memory for completions, copy this one
+        w->zerocopy = false;
+        res = sendmsg(dst->fd, &w->msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (res < 0) {
+            res = -errno;
+        }
+    }
+
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EWOULDBLOCK) {  // actual error that isn't just no space currently
+            fprintf(stderr, "Error writing to destination on fd %d: %s\nClosing destination connection...\n",
+                    dst->fd, strerror((int)-res));
+            return -1;
+        }
+
+        return 0;  // socket full, wait for EPOLLOUT
+    }
+
+    metric_add(&dst->bytes_out, res);
+    metric_add(&metrics->bytes_out, res);
+    if (w->zerocopy) {
+        zerocopy_sent(dst->zerocopy, w->oldest);
+        metric_add(&metrics->zerocopy_bytes, res);
+    }
+
+    size_t written = res;
+    uint32_t now_us = 0;
+    if (dst->spill_len > 0) {
+        size_t remaining = dst->spill_len - dst->spill_sent;
+
+        if (written < remaining) {
+            dst->spill_sent += written;
+            return res;
+        }
+
+        written -= remaining;
+        dst->spill_len = dst->spill_sent = 0;
+        metric_add(&metrics->msgs_out, dst->spill_msgs);
+    }
+
+    if (w->sealing) {
+        dst->relay_seq++;
+        metric_add(&metrics->relay_batches, 1);
+
+        if (written < sizeof(w->envelope) + w->planned
+            && spill_dst_batch(dst, w->iov, w->iovcnt, written, w->lanes, w->msgs) < 0) {
+            fprintf(stderr, "Failed to allocate spill buffer for destination on fd %d\n", dst->fd);
+            return -1;
+        }
+        if (dst->spill_len > 0) {
+            return res;
+        }
+
+        written -= sizeof(w->envelope);
+    }
+
+    for (int m = 0; m < w->msgs && written > 0; m++) {
+        int lane = w->lanes[m];
+        const frame_desc *desc = dst_lane_at(dst, lane, dst->tail[lane]);
+        size_t remaining = desc->len - dst->sent;
+
+        if (written < remaining) {
+            dst->sent += written;
+            dst->sending = lane;
+            break;
+        }
+
+        if (now_us == 0) {
+            now_us = (uint32_t)metrics_now_us();  // once per write, everything retired by it went out together
+        }
+        lat_record(&metrics->latency, now_us - desc->stamp_us);
+        metric_add(&metrics->msgs_out, 1);
+
+        written -= remaining;
+        dst->sent = 0;
+        dst->tail[lane]++;
+        dst->prio_streak = dst_next_streak(dst, dst->tail, lane, dst->prio_streak);
+    }
+
+    return res;
+}
+
+/**
+ * @brief Writes as much of a destination's queue as the socket will take, one planned sendmsg after another
+ *
+ * @param dst destination to flush
+ * @param ring broadcast ring the queued descriptors point into
+ * @param metrics owning shard's counters
+ * @return ssize_t - bytes written (0 if the socket was already full), -1 on an unrecoverable write error
+ */
+ssize_t flush_dst_client(dst_client *dst, const bcast_ring *ring, egress_metrics *metrics) {
+    ssize_t total = 0;
+
+    while (dst_pending(dst)) {
+        dst_write w;
+        dst_plan_write(dst, ring, &w);
+
+        ssize_t res = sendmsg(dst->fd, &w.msg, w.flags);
+        res = dst_finish_write(dst, &w, res < 0 ? -errno : res, metrics);
+        if (res <= 0) {
+            return res < 0 ? -1 : total;
+        }
+
+        total += res;
+    }
+
+    return total;
+}
+
+/**
+ * @brief Copies the unwritten rest of the partly written message out of the ring and dequeues it, so the
+ * destination stops pinning the ring behind it while it still gets a complete message
+ *
+ * @param dst destination with sent > 0, and nothing already spilled
+ * @param ring broadcast ring the queue points into
+ * @return int - 0 on success, -1 if the spill buffer couldn't be allocated
+ */
+int spill_dst_front(dst_client *dst, const bcast_ring *ring) {
+    if (dst_alloc_spill(dst) < 0) {
+        return -1;
+    }
+
+    const frame_desc *desc = dst_lane_at(dst, dst->sending, dst->tail[dst->sending]);
+    dst->spill_len = desc->len - dst->sent;
+    dst->spill_sent = 0;
+    dst->spill_msgs = 1;
+    memcpy(dst->spill, ring_ptr(ring, desc->offset + dst->sent), dst->spill_len);
+
+    dst->sent = 0;
+    dst->tail[dst->sending]++;
+    return 0;
+}
+
+static const char *const policy_names[] = {
+    [DST_POLICY_BLOCK] = "block",
+    [DST_POLICY_DROP_OLDEST] = "drop-oldest",
+    [DST_POLICY_DROP_NEWEST] = "drop-newest",
+    [DST_POLICY_DISCONNECT] = "disconnect",
+};
+
+const char *dst_policy_name(dst_policy policy) {
+    return policy_names[policy];
+}
+
+/**
+ * @brief Parses a slow-consumer policy of the form name[:hwm], as given to -p or in a destination's control line
+ *
+ * @param spec e.g. "drop-oldest" or "disconnect:262144"
+ * @param policy set on success
+ * @param hwm set on success if given, left alone otherwise
+ * @return int - 0 on success, -1 if the name or high-water mark isn't valid
+ */
+int dst_parse_policy(const char *spec, dst_policy *policy, uint32_t *hwm) {
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+    for (size_t p = 0; p < sizeof(policy_names) / sizeof(policy_names[0]); p++) {
+        if (strlen(policy_names[p]) != name_len || strncmp(spec, policy_names[p], name_len) != 0) {
+            continue;
+        }
+
+        if (colon != NULL) {
+            char *end;
+            unsigned long bytes = strtoul(colon + 1, &end, 10);
+
+            // must fit the largest possible message, and leave room in the ring for everyone else to keep moving
+            if (end == colon + 1 || *end != '\0' || bytes < sizeof(ctmp_header) + UINT16_MAX || bytes > RING_SIZE / 2) {
+                return -1;
+            }
+            *hwm = bytes;
+        }
+
+        *policy = p;
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Applies one control line from a destination
+ *
+ * @return int - 0 if understood, -1 otherwise
+ */
+static int apply_dst_control(dst_client *dst, char *line) {
+    char *value = strchr(line, '=');
+    if (value == NULL) {
+        return -1;
+    }
+    *value++ = '\0';
+
+    if (strcmp(line, "policy") == 0) {
+        dst->hwm_req = UINT32_MAX;  // none given, the operator's
+        if (dst_parse_policy(value, &dst->policy_req, &dst->hwm_req) < 0) {
+            return -1;
+        }
+
+        dst->policy_requested = true;  // limited by the shard's own policy, so it does the rest
+        return 0;
+    }
+
+    if (strcmp(line, "replay") == 0) {
+        char *end;
+        unsigned long long seq = strtoull(value, &end, 10);
+        if (end == value || *end != '\0' || seq == DST_NO_REPLAY) {
+            return -1;
+        }
+
+        dst->replay_seq = seq;  // the shard starts it, it knows where the live feed is up to
+        return 0;
+    }
+
+    if (strcmp(line, "relay") == 0) {
+        if (strcmp(value, "on") != 0) {
+            return -1;
+        }
+
+        dst->relay_requested = true;  // has to wait for a message boundary, which the shard sees to
+        return 0;
+    }
+
+    if (strcmp(line, "filter") == 0) {
+        if (filter_parse(value, &dst->filter_req) < 0) {
+            return -1;
+        }
+
+        dst->filter_requested = true;  // groups belong to the shard, so it does the rest
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Reads and applies whatever control lines a destination has sent. Unrecognised lines are reported and
+ * ignored, but a line too long to ever be valid is treated as a protocol violation.
+ *
+ * @param dst destination with EPOLLIN ready
+ * @return int - 0 on success, -1 if the destination hung up, errored or overran the control buffer
+ */
+int read_dst_control(dst_client *dst) {
+    while (true) {
+        ssize_t count = read(dst->fd, dst->ctl + dst->ctl_len, DST_CTL_LEN - dst->ctl_len);
+
+        if (count < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        if (count == 0) {
+            return -1;  // peer closed, EPOLLRDHUP will usually have got here first
+        }
+
+        dst->ctl_len += count;
+
+        char *start = dst->ctl;
+        char *newline;
+        while ((newline = memchr(start, '\n', dst->ctl + dst->ctl_len - start)) != NULL) {
+            *newline = '\0';
+            if (newline > start && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+
+            if (apply_dst_control(dst, start) < 0) {
+                fprintf(stderr, "Ignoring unrecognised control line '%s' from destination on fd %d\n", start, dst->fd);
+            }
+
+            start = newline + 1;
+        }
+
+        dst->ctl_len -= start - dst->ctl;
+        memmove(dst->ctl, start, dst->ctl_len);
+
+        if (dst->ctl_len == DST_CTL_LEN) {
+            fprintf(stderr, "Control line from destination on fd %d too long\n", dst->fd);
+            return -1;
+        }
+    }
+}
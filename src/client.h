@@ -0,0 +1,264 @@
+//
+// Created by raven on 19/08/2025.
+//
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "ctmp.h"
+#include "filter.h"
+#include "ring.h"
+#include "event.h"
+#include "timer.h"
+#include "metrics.h"
+#include "pool.h"
+#include "zerocopy.h"
+#include "relay.h"
+
+#define BUFFER_SIZE 131072  // room for at least one maximum size CTMP message (8 byte header + 65535 payload), power of two
+#define CLIENT_TIMEOUT 5  // seconds a destination may sit on pending data before it is considered dead, < WHEEL_SLOTS
+#define DST_QUEUE_LEN 1024  // max messages queued per destination, must be a power of two
+#define DST_PRIO_LEN 256  // max sensitive messages queued per destination ahead of the rest, must be a power of two
+#define DST_PRIO_GUARD 8  // default sensitive messages sent in a row before a waiting normal one gets a turn
+#define DST_MAX_BATCH 256  // max messages written by a single sendmsg
+#define DST_MAX_IOV 64  // max iovecs gathered into a single sendmsg
+#define DST_CTL_LEN 128  // max length of a control line sent by a destination, including the newline
+#define DST_DEFAULT_HWM (RING_SIZE / 4)  // bytes of backlog a non-blocking destination may build up by default
+#define DST_NO_REPLAY UINT64_MAX
+#define DST_SPILL_LEN (sizeof(relay_header) + RELAY_MAX_BODY)  // the rest of a message, or of a relay batch
+#define SRC_QUANTUM (8 + 65535)  // bytes a source may publish per round-robin turn, at least one max size message
+
+/**
+ * @brief What happens when a destination falls too far behind
+ *
+ * Only DST_POLICY_BLOCK destinations ever hold back the rest of the feed. The others are bounded by their high-water
+ * mark (hwm), the span of the broadcast ring they may keep pinned, and have the policy applied on reaching it instead.
+ */
+typedef enum {
+    DST_POLICY_BLOCK = 0,  // stall the source until it catches up, the original behaviour
+    DST_POLICY_DROP_OLDEST,  // throw away the oldest queued messages to make room
+    DST_POLICY_DROP_NEWEST,  // throw away the message that doesn't fit
+    DST_POLICY_DISCONNECT  // cut it off
+} dst_policy;
+
+/**
+ * @brief The two egress queues of a destination. CTMP_OPTION_SENSITIVE messages go in the priority lane and are
+ * written ahead of anything waiting in the normal one, but only ever at message boundaries.
+ */
+typedef enum {
+    DST_LANE_NORMAL = 0,
+    DST_LANE_PRIO,
+    DST_LANES
+} dst_lane;
+
+/**
+ * @brief State for a source client, each connected source has its own
+ *
+ * read_buffer is a mirrored ring (see ring_map_mirrored) read into at wr and parsed from rd, both absolute offsets.
+ * A message is always contiguous from rd however the wrap falls, so it goes straight from here into the broadcast
+ * ring without ever being compacted to the front of the buffer.
+ *
+ * With more than one source, complete messages are merged into the broadcast ring by deficit round robin: each turn
+ * a source is credited SRC_QUANTUM bytes and publishes whole messages while they fit in its credit, so a busy source
+ * can't crowd the others out of ring space, and a message is never split between turns.
+ *
+ * Whatever complete messages are buffered are found and validated together (see ctmp_scan) and then published from
+ * the resulting spans, only a message still arriving goes through the framer.
+ *
+ * A relayed source is another proxy, which has already validated everything it sends - its batches are checked as a
+ * whole by the relay framer, and the messages in them published without going through the CTMP framer at all.
+ */
+typedef struct {
+    int fd;
+    uint8_t *read_buffer;  // BUFFER_SIZE bytes, mapped twice
+    uint64_t rd;  // oldest byte not yet published
+    uint64_t wr;  // one past the newest byte read
+    ctmp_framer framer;  // how far the message at rd has been parsed/checksummed, when it's still arriving
+    ctmp_scan scan;  // complete messages from rd onwards, found in one go
+    bool relayed;  // connected through the relay uplink (-R), so it sends batches once it gets going
+    relay_framer relay;
+    uint32_t prev_mask;  // last epoll mask registered, so we only call epoll_ctl on an actual change
+    uint32_t deficit;  // round-robin credit left over from previous turns, in bytes
+} __attribute__((aligned(CACHE_LINE))) src_client;
+
+static inline uint8_t *src_rd_ptr(const src_client *src) {
+    return src->read_buffer + (src->rd & (BUFFER_SIZE - 1));
+}
+
+static inline size_t src_buffered(const src_client *src) {
+    return src->wr - src->rd;
+}
+
+/**
+ * @brief A destination's descriptor queues, borrowed from the shared chunk_pool only while it has something queued
+ */
+typedef struct {
+    frame_desc queue[DST_QUEUE_LEN];  // normal lane
+    frame_desc prio[DST_PRIO_LEN];  // priority lane
+} dst_queues;
+
+/**
+ * @brief State for a destination client
+ *
+ * Destinations don't own a copy of each message, they hold a queue of descriptors pointing into the shared
+ * broadcast ring (see ring.h). Queued messages are flushed with a single sendmsg gathering as many as fit, rather
+ * than one write per message. The queues themselves are only attached while there is something in them, so an idle
+ * destination costs no more than this struct.
+ *
+ * Sensitive messages are queued in their own lane and jump the normal lane at the next message boundary - at most one
+ * message, the one sent points into, is ever partly written. So a burst of sensitive messages can't starve the normal
+ * lane, after prio_guard of them in a row one waiting normal message is let through (0 disables the priority lane
+ * and everything is sent in order).
+ *
+ * Destinations only ever receive the feed, but may send newline terminated control lines of the form key=value -
+ * "policy=<name>[:<hwm>]" to pick their own slow-consumer policy (see dst_parse_policy) - never a blocking one the
+ * operator didn't choose, or a higher high-water mark - "replay=<seq>" to be
+ * caught up from the journal (see journal.h) starting at the seq'th message published since the proxy started,
+ * "filter=<spec>" to only be sent the messages it wants (see ctmp_filter), and "relay=on" to be sent batches in
+ * envelopes (see relay_header) from then on, when it's another proxy.
+ */
+typedef struct {
+    int fd;
+    dst_queues *q;  // NULL while nothing is queued
+    uint32_t head[DST_LANES];  // free running, next slot to enqueue into
+    uint32_t tail[DST_LANES];  // free running, oldest message not yet fully written
+    uint32_t sent;  // bytes already written of the front message of lane sending
+    uint8_t sending;
+    uint8_t prio_guard;
+    uint8_t prio_streak;  // sensitive messages written in a row while normal ones were waiting
+    uint8_t *spill;  // rest of a partly written message copied out of the ring, so a lagging dst can let it go
+    uint32_t spill_len;  // bytes in spill, 0 when not in use - always written before anything queued
+    uint32_t spill_sent;
+    uint32_t spill_msgs;  // messages that are out once the spill is, the rest of a relay batch may finish several
+    dst_zerocopy *zerocopy;  // -Z only, sends the kernel hasn't finished with yet - like spill, kept with the slot
+    uint32_t prev_mask;
+    timer_node timer;  // stall deadline, only armed while the socket is full with data still queued
+    int active_idx;  // position in the owning shard's active set
+
+    dst_policy policy;
+    uint32_t hwm;  // max ring bytes held back before the policy applies, ignored when blocking
+    dst_policy policy_req;  // requested by a control line, the shard holds it to what the operator allows
+    uint32_t hwm_req;
+    bool policy_requested;
+    uint64_t drops;  // messages dropped by the policy
+    uint64_t drop_bytes;
+    uint64_t bytes_out;
+
+    int pipe[2];  // splice mode only (see splice.h), -1 otherwise
+    uint32_t piped;  // bytes tee'd into the pipe not yet spliced out to the socket
+    uint32_t piped_msgs;
+    uint32_t piped_stamp_us;
+    uint64_t batch_seq;  // last batch of the source pipe this destination has been given
+
+    uint64_t replay_seq;  // requested by a control line, DST_NO_REPLAY if none outstanding
+    uint64_t replay;  // next journal offset to send, while replaying
+    bool replaying;  // out of the live fan-out until the replay catches up with it
+
+    int group;  // filter group in the owning shard, 0 for everything
+    ctmp_filter filter_req;  // requested by a control line, picked up by the shard
+    bool filter_requested;
+
+    bool relay;  // sent batches in envelopes rather than bare messages
+    bool relay_requested;  // by a control line, picked up by the shard
+    uint32_t relay_seq;  // next batch
+
+    char ctl[DST_CTL_LEN];  // partial control line read from the destination
+    uint32_t ctl_len;
+} __attribute__((aligned(CACHE_LINE))) dst_client;  // the fields fan-out touches all sit in the first line
+
+static inline frame_desc *dst_lane_at(dst_client *dst, int lane, uint32_t idx) {
+    return lane == DST_LANE_PRIO ? &dst->q->prio[idx & (DST_PRIO_LEN - 1)] : &dst->q->queue[idx & (DST_QUEUE_LEN - 1)];
+}
+
+static inline uint32_t dst_lane_len(const dst_client *dst, int lane) {
+    return dst->head[lane] - dst->tail[lane];
+}
+
+static inline uint32_t dst_lane_space(const dst_client *dst, int lane) {
+    return (lane == DST_LANE_PRIO ? DST_PRIO_LEN : DST_QUEUE_LEN) - dst_lane_len(dst, lane);
+}
+
+static inline bool dst_queued(const dst_client *dst) {
+    return dst_lane_len(dst, DST_LANE_NORMAL) > 0 || dst_lane_len(dst, DST_LANE_PRIO) > 0;
+}
+
+static inline bool dst_pending(const dst_client *dst) {
+    return dst_queued(dst) || dst->spill_len > 0 || dst->piped > 0;
+}
+
+/**
+ * @brief Ring offset of the next byte to write from the front of a non-empty lane
+ */
+static inline uint64_t dst_lane_front(const dst_client *dst, int lane) {
+    uint32_t t = dst->tail[lane];
+    const frame_desc *desc = lane == DST_LANE_PRIO ? &dst->q->prio[t & (DST_PRIO_LEN - 1)]
+                                                   : &dst->q->queue[t & (DST_QUEUE_LEN - 1)];
+    return desc->offset + (lane == dst->sending ? dst->sent : 0);
+}
+
+/**
+ * @brief Lane whose front message is oldest in the ring, -1 if both are empty
+ */
+static inline int dst_oldest_lane(const dst_client *dst) {
+    if (dst_lane_len(dst, DST_LANE_PRIO) == 0) {
+        return dst_lane_len(dst, DST_LANE_NORMAL) > 0 ? DST_LANE_NORMAL : -1;
+    }
+    if (dst_lane_len(dst, DST_LANE_NORMAL) == 0) {
+        return DST_LANE_PRIO;
+    }
+    return dst_lane_front(dst, DST_LANE_PRIO) < dst_lane_front(dst, DST_LANE_NORMAL) ? DST_LANE_PRIO
+                                                                                     : DST_LANE_NORMAL;
+}
+
+/**
+ * @brief Oldest ring offset this destination still needs, or drained if it has nothing queued or in flight
+ */
+static inline uint64_t dst_oldest(const dst_client *dst, uint64_t drained) {
+    int lane = dst_oldest_lane(dst);
+    uint64_t oldest = lane >= 0 ? dst_lane_front(dst, lane) : drained;
+    return dst->zerocopy != NULL && dst->zerocopy->oldest < oldest ? dst->zerocopy->oldest : oldest;
+}
+
+static inline void dst_enqueue(dst_client *dst, int lane, const frame_desc *desc) {
+    *dst_lane_at(dst, lane, dst->head[lane]++) = *desc;
+}
+
+/**
+ * @brief One sendmsg worth of a destination's queue, planned by dst_plan_write and retired by dst_finish_write - so
+ * the write itself can be batched with other destinations' (see ev_io_batch)
+ */
+typedef struct {
+    struct iovec iov[DST_MAX_IOV];
+    uint8_t lanes[DST_MAX_BATCH];  // lane of each message gathered, in the order they are written
+    int iovcnt;
+    int msgs;
+    relay_header envelope;
+    bool sealing;  // envelope goes first
+    bool zerocopy;
+    uint64_t planned;  // bytes gathered from the ring
+    uint64_t oldest;  // lowest ring offset gathered from
+    size_t len;  // bytes in iov
+    struct msghdr msg;
+    int flags;
+} dst_write;
+
+void set_non_block(int fd);
+void set_busy_poll(int fd, int usec);
+void close_src_client(ev_loop *loop, src_client *src);
+void close_dst_client(ev_loop *loop, dst_client *dst);
+ssize_t flush_dst_client(dst_client *dst, const bcast_ring *ring, egress_metrics *metrics);
+void dst_plan_write(dst_client *dst, const bcast_ring *ring, dst_write *w);
+ssize_t dst_finish_write(dst_client *dst, dst_write *w, ssize_t res, egress_metrics *metrics);
+int spill_dst_front(dst_client *dst, const bcast_ring *ring);
+int read_dst_control(dst_client *dst);
+int dst_parse_policy(const char *spec, dst_policy *policy, uint32_t *hwm);
+const char *dst_policy_name(dst_policy policy);
+
+#endif //CLIENT_H
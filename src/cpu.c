@@ -0,0 +1,74 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#define _GNU_SOURCE  // pthread_setaffinity_np, CPU_SET
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "cpu.h"
+
+/**
+ * @brief Parses a comma separated list of CPUs and ranges, e.g. "2,4-6"
+ *
+ * @param arg list to parse
+ * @param cpus set to the CPUs in the order given
+ * @param max entries cpus has room for
+ * @return int - number of CPUs, -1 if the list isn't valid or is too long
+ */
+int cpu_parse_list(const char *arg, int *cpus, int max) {
+    int count = 0;
+
+    while (*arg != '\0') {
+        char *end;
+        long first = strtol(arg, &end, 10);
+        long last = first;
+        if (end == arg || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+
+        if (*end == '-') {
+            const char *from = end + 1;
+            last = strtol(from, &end, 10);
+            if (end == from || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (count == max) {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        arg = end;
+    }
+
+    return count > 0 ? count : -1;
+}
+
+/**
+ * @brief Restricts a thread to a single CPU
+ *
+ * @return int - 0 on success, -1 on failure
+ */
+int cpu_pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: Failed to pin thread to CPU %d: %s\n", cpu, strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <pthread.h>
+
+#define CPU_MAX_PINNED 65  // the main thread and one per worker
+
+int cpu_parse_list(const char *arg, int *cpus, int max);
+int cpu_pin_thread(pthread_t thread, int cpu);
+
+#endif //CPU_H
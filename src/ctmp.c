@@ -6,6 +6,9 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "ctmp.h"
 
 /**
@@ -64,6 +67,109 @@ int is_header_valid(const ctmp_header *header) {
     return 1;
 }
 
+/*
+ * Checksum kernels
+ *
+ * The one's complement sum is byte order independent (RFC 1071), so rather than assembling big-endian words one at a
+ * time we sum native words as wide as the CPU allows, fold, and only convert to network order at the very end.
+ * Partial sums are kept unfolded in 64 bits so they can be combined (header + payload, or successive reads) freely.
+ */
+
+#define CSUM_BLOCK 16384  // vector iterations before 32-bit lanes are spilled, well short of any lane overflowing
+
+/**
+ * @brief Sums native-order 16 bit words, an odd trailing byte is treated as the first byte of a zero padded word
+ *
+ * @param buffer bytes to sum, no alignment requirement
+ * @param len number of bytes
+ * @return uint64_t - unfolded sum
+ */
+static uint64_t sum_words(const uint8_t *buffer, size_t len) {
+    uint64_t sum = 0;
+
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (len >= 32) {
+        __m256i acc = zero;
+        size_t iterations = len / 32 < CSUM_BLOCK ? len / 32 : CSUM_BLOCK;
+
+        for (size_t i = 0; i < iterations; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)buffer);
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));  // widen words to 32 bits in-lane
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            buffer += 32;
+        }
+        len -= iterations * 32;
+
+        // spill the 8 32-bit lanes into the 64 bit total
+        __m256i wide = _mm256_add_epi64(_mm256_unpacklo_epi32(acc, zero), _mm256_unpackhi_epi32(acc, zero));
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes, wide);
+        sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    while (len >= 16) {
+        __m128i acc = zero;
+        size_t iterations = len / 16 < CSUM_BLOCK ? len / 16 : CSUM_BLOCK;
+
+        for (size_t i = 0; i < iterations; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)buffer);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            buffer += 16;
+        }
+        len -= iterations * 16;
+
+        __m128i wide = _mm_add_epi64(_mm_unpacklo_epi32(acc, zero), _mm_unpackhi_epi32(acc, zero));
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, wide);
+        sum += lanes[0] + lanes[1];
+    }
+#endif
+
+    // scalar fallback, and the tail left over by the vector loops - 32 bits at a time is still a valid word sum
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, buffer, sizeof(word));
+        sum += word;
+        buffer += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        uint16_t word;
+        memcpy(&word, buffer, sizeof(word));
+        sum += word;
+        buffer += 2;
+        len -= 2;
+    }
+
+    if (len) {  // pad last byte with 0, in memory order so it lands in the right half of the word either endianness
+        uint8_t pad[2] = {buffer[0], 0};
+        uint16_t word;
+        memcpy(&word, pad, sizeof(word));
+        sum += word;
+    }
+
+    return sum;
+}
+
+/**
+ * @brief Folds an unfolded sum down to 16 bits, still in native order
+ */
+static uint16_t fold_sum(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);  // in case previous fold generated another carry
+
+    return (uint16_t)sum;
+}
+
 /**
  * @brief Computes the 16 bit one's complement of the one's complement sum of all 16 bit words in the provider buffer
  * 
@@ -72,23 +178,67 @@ int is_header_valid(const ctmp_header *header) {
  * @return uint16_t the resulting checksum
  */
 uint16_t compute_checksum(const uint8_t *buffer, size_t len) {
-    uint32_t sum = 0;
+    return ~ntohs(fold_sum(sum_words(buffer, len)));  // words were summed in host order, flip to big-endian & invert
+}
 
-    // sum all 16-bit words
-    for (size_t i = 0; i + 1 < len; i += 2) {
-        sum += (buffer[i] << 8) | buffer[i + 1]; // big-endian word
+/**
+ * @brief Folds more payload bytes into a running checksum, so a sensitive message can be summed piece by piece as it
+ * arrives rather than all at once when complete. Chunks may be any length, odd ones included.
+ *
+ * @param state running checksum, zero initialised at the start of each message
+ * @param buffer next bytes of the payload
+ * @param len number of bytes
+ */
+void ctmp_csum_update(ctmp_csum *state, const uint8_t *buffer, size_t len) {
+    if (len == 0) {
+        return;
     }
 
-    // if odd length, pad last byte with 0
-    if (len & 1) {
-        sum += buffer[len - 1] << 8;
+    uint64_t partial = sum_words(buffer, len);
+
+    if (state->len & 1) {
+        // previous chunk ended mid-word, so this chunk's words are all one byte out - summing them as they are and
+        // byte swapping the folded result is equivalent (RFC 1071 again)
+        uint16_t folded = fold_sum(partial);
+        partial = (uint16_t)((folded << 8) | (folded >> 8));
     }
 
-    // fold carry bits into lower 16 bits
-    sum = (sum & 0xFFFF) + (sum >> 16);
-    sum += (sum >> 16);  // in case previous fold generated another carry
+    state->sum += partial;
+    state->len += len;
+}
+
+/**
+ * @brief Finishes a running checksum the way compute_checksum would have over the same bytes
+ *
+ * @param state running checksum
+ * @return uint16_t - the checksum, in host order
+ */
+uint16_t ctmp_csum_final(const ctmp_csum *state) {
+    return ~ntohs(fold_sum(state->sum));
+}
 
-    return ~sum;  // flip
+/**
+ * @brief Checks the checksum of a sensitive message given its header and a running sum of the whole payload.
+ * The checksum field is treated as 0xCC filled, as per spec, without having to copy the header to patch it.
+ *
+ * @param header CTMP header of the message
+ * @param payload_sum ctmp_csum that has had every byte of the payload folded in
+ * @return int - 1 if valid, 0 if not
+ */
+int is_valid_checksum_folded(const ctmp_header *header, const ctmp_csum *payload_sum) {
+    if (header->options != CTMP_OPTION_SENSITIVE) {
+        return 1;  // fine to go if not sensitive
+    }
+
+    // header is 4 words, the checksum one counts as 0xCCCC - same value in either byte order
+    uint16_t words[4];
+    memcpy(words, header, sizeof(words));
+    uint64_t sum = (uint64_t)words[0] + words[1] + 0xCCCC + words[3] + payload_sum->sum;
+
+    uint16_t calc = ~ntohs(fold_sum(sum));
+    uint16_t received = ntohs(header->checksum);  // convert received from big to little endian
+
+    return calc == received;
 }
 
 /**
@@ -104,17 +254,113 @@ int is_valid_checksum(const ctmp_header *header, const uint8_t *payload) {
         return 1;  // fine to go if not sensitive
     }
 
-    size_t total_len = sizeof(ctmp_header) + ntohs(header->length);
-    uint8_t buf[total_len];
-    
-    // copy header & payload
-    memcpy(buf, header, sizeof(ctmp_header));
-    memcpy(buf + sizeof(ctmp_header), payload, ntohs(header->length));
+    ctmp_csum payload_sum = {0};
+    ctmp_csum_update(&payload_sum, payload, ntohs(header->length));  // header is 8 bytes, so payload words line up
 
-    buf[4] = 0xCC; buf[5] = 0xCC; // as per spec, treat field as 0xCC filled
+    return is_valid_checksum_folded(header, &payload_sum);
+}
 
-    uint16_t calc = compute_checksum(buf, total_len);  // compute using the modified buffer
-    uint16_t received = ntohs(header->checksum);  // convert received from big to little endian
+/**
+ * @brief Advances the framer over the unconsumed bytes at the front of a stream
+ *
+ * @param framer parser state, zeroed for a fresh stream
+ * @param data first unconsumed byte, i.e. the start of the front frame
+ * @param avail number of bytes available from data onwards
+ * @return ctmp_status - CTMP_FRAME_READY once framer->frame_len bytes at data make up a complete, valid frame
+ */
+ctmp_status ctmp_framer_feed(ctmp_framer *framer, const uint8_t *data, size_t avail) {
+    if (framer->verified) {
+        return CTMP_FRAME_READY;  // still sat there from last time, e.g. the caller was held up by backpressure
+    }
 
-    return calc == received;
+    if (framer->frame_len == 0) {
+        if (avail < sizeof(ctmp_header)) {
+            return CTMP_NEED_MORE;
+        }
+
+        const ctmp_header *header = (const ctmp_header *) data;
+        if (!is_header_valid(header)) {
+            return CTMP_BAD_HEADER;
+        }
+
+        framer->frame_len = sizeof(ctmp_header) + ntohs(header->length);  // convert length to host order so we set len correctly
+    }
+
+    const ctmp_header *header = (const ctmp_header *) data;
+    size_t in_frame = avail < framer->frame_len ? avail : framer->frame_len;
+
+    if (header->options == CTMP_OPTION_SENSITIVE) {
+        // fold whatever payload turned up since last time, so it is summed while still hot from the read rather than
+        // all in one go once the whole message is in
+        size_t payload_in = in_frame - sizeof(ctmp_header);
+        ctmp_csum_update(&framer->csum, data + sizeof(ctmp_header) + framer->csum.len, payload_in - framer->csum.len);
+    }
+
+    if (in_frame < framer->frame_len) {
+        return CTMP_NEED_MORE;
+    }
+
+    if (!is_valid_checksum_folded(header, &framer->csum)) {  // only actually checks sensitive messages
+        return CTMP_BAD_CHECKSUM;
+    }
+
+    framer->verified = true;
+    return CTMP_FRAME_READY;
+}
+
+/**
+ * @brief Finds every complete frame at the front of a burst in two passes - first a walk over just the headers,
+ * checking magic and padding and recording where each frame lies, then the checksums of the sensitive ones. Any
+ * frames before a bad one are still returned, the same as feeding them to a ctmp_framer one by one would.
+ *
+ * @param scan filled in with the spans found, replacing whatever was there
+ * @param data first unconsumed byte, i.e. the start of the front frame, which no framer has started on
+ * @param avail number of bytes available from data onwards
+ * @return size_t - frames found, at most CTMP_SCAN_MAX
+ */
+size_t ctmp_scan_burst(ctmp_scan *scan, const uint8_t *data, size_t avail) {
+    size_t count = 0;
+    size_t off = 0;
+    uint8_t sensitive = 0;
+    ctmp_status stop = CTMP_NEED_MORE;
+
+    while (count < CTMP_SCAN_MAX && avail - off >= sizeof(ctmp_header)) {
+        const ctmp_header *header = (const ctmp_header *)(data + off);
+
+        // same checks as is_header_valid, folded together so the walk doesn't branch on each field
+        if ((header->magic ^ CTMP_MAGIC) | (header->options & ~CTMP_OPTION_SENSITIVE) | header->cpad) {
+            stop = CTMP_BAD_HEADER;
+            break;
+        }
+
+        size_t frame_len = sizeof(ctmp_header) + ntohs(header->length);
+        if (avail - off < frame_len) {
+            break;
+        }
+
+        ctmp_frame_span *span = &scan->spans[count++];
+        span->offset = off;
+        span->len = frame_len;
+        span->options = header->options;
+        sensitive |= header->options;
+        off += frame_len;
+    }
+
+    for (size_t k = 0; sensitive && k < count; k++) {
+        const ctmp_frame_span *span = &scan->spans[k];
+        const uint8_t *frame = data + span->offset;
+
+        if (span->options == CTMP_OPTION_SENSITIVE
+            && !is_valid_checksum((const ctmp_header *)frame, frame + sizeof(ctmp_header))) {
+            count = k;
+            stop = CTMP_BAD_CHECKSUM;
+            break;
+        }
+    }
+
+    scan->base = data;
+    scan->count = count;
+    scan->next = 0;
+    scan->stop = stop;
+    return count;
 }
@@ -2,6 +2,7 @@
 // Created by raven on 19/08/2025.
 //
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -86,9 +87,88 @@ typedef struct __attribute__((__packed__)) {
 
 int is_header_valid(const ctmp_header *header);
 
+/**
+ * @brief Running one's complement sum over a payload, for checksumming a message incrementally as it arrives
+ */
+typedef struct {
+    uint64_t sum;  // unfolded sum of host order words
+    size_t len;  // bytes folded in so far
+} ctmp_csum;
+
 uint16_t compute_checksum(const uint8_t *buffer, size_t len);
 
+void ctmp_csum_update(ctmp_csum *state, const uint8_t *buffer, size_t len);
+
+uint16_t ctmp_csum_final(const ctmp_csum *state);
+
 int is_valid_checksum(const ctmp_header *header, const uint8_t *payload);
 
+int is_valid_checksum_folded(const ctmp_header *header, const ctmp_csum *payload_sum);
+
+typedef enum {
+    CTMP_NEED_MORE = 0,  // front frame is incomplete (or not even a full header yet)
+    CTMP_FRAME_READY,  // front frame is complete and valid, frame_len bytes long
+    CTMP_BAD_HEADER,
+    CTMP_BAD_CHECKSUM
+} ctmp_status;
+
+/**
+ * @brief Streaming parser for a CTMP byte stream.
+ *
+ * The caller keeps the bytes (e.g. in a ring) and a cursor to the front of what hasn't been consumed yet, and
+ * feeds the framer a view starting at that cursor whenever more arrives. The framer only remembers what it has
+ * already established about the front frame - so the header is validated once, and a sensitive payload is summed
+ * as it arrives - and never copies or moves any of the bytes itself. Once a frame is taken the caller advances its
+ * cursor by frame_len and calls ctmp_framer_consume.
+ */
+typedef struct {
+    size_t frame_len;  // header + payload of the front frame, 0 until its header has been validated
+    bool verified;  // front frame is complete and passed its checksum (if any), don't recheck under backpressure
+    ctmp_csum csum;  // running checksum of the front frame's payload, if sensitive
+} ctmp_framer;
+
+ctmp_status ctmp_framer_feed(ctmp_framer *framer, const uint8_t *data, size_t avail);
+
+static inline void ctmp_framer_consume(ctmp_framer *framer) {
+    *framer = (ctmp_framer){0};
+}
+
+#define CTMP_SCAN_MAX 256  // frames taken from a burst per scan, any more are left for the next one
+
+/**
+ * @brief Where one complete, valid frame lies in a scanned burst
+ */
+typedef struct {
+    uint32_t offset;  // from the start of the burst
+    uint32_t len;  // header + payload
+    uint8_t options;
+} ctmp_frame_span;
+
+/**
+ * @brief Every complete frame in a read burst, found and validated up front by ctmp_scan_burst so the caller can
+ * publish them in one tight pass rather than interleaving parsing with fan-out.
+ *
+ * Only whole frames are scanned - one still arriving at the end of the burst is left to a ctmp_framer, which sums it
+ * a read at a time. stop is why the scan ended once the spans run out: CTMP_NEED_MORE if there's simply nothing more
+ * complete (or CTMP_SCAN_MAX were found), otherwise the frame after the last span is bad.
+ */
+typedef struct {
+    const uint8_t *base;  // start of the burst, stays valid for as long as the caller keeps the bytes
+    uint32_t count;
+    uint32_t next;  // first span not yet taken
+    ctmp_status stop;
+    ctmp_frame_span spans[CTMP_SCAN_MAX];
+} ctmp_scan;
+
+size_t ctmp_scan_burst(ctmp_scan *scan, const uint8_t *data, size_t avail);
+
+static inline bool ctmp_scan_pending(const ctmp_scan *scan) {
+    return scan->next < scan->count;
+}
+
+static inline void ctmp_scan_reset(ctmp_scan *scan) {
+    scan->count = scan->next = 0;
+}
+
 
 #endif //CTMP_H
\ No newline at end of file
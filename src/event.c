@@ -0,0 +1,140 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "event.h"
+
+#define EPOLL_BATCH 256  // max events pulled out of the kernel per epoll_wait
+
+typedef struct {
+    ev_loop base;
+    int epoll_fd;
+    struct epoll_event events[EPOLL_BATCH];
+} epoll_loop;
+
+static int epoll_loop_ctl(ev_loop *loop, int op, int fd, uint32_t events, void *ptr) {
+    struct epoll_event event = {.events = events, .data.ptr = ptr};
+
+    return epoll_ctl(((epoll_loop *)loop)->epoll_fd, op, fd, &event);
+}
+
+static int epoll_loop_add(ev_loop *loop, int fd, uint32_t events, void *ptr) {
+    return epoll_loop_ctl(loop, EPOLL_CTL_ADD, fd, events, ptr);
+}
+
+static int epoll_loop_mod(ev_loop *loop, int fd, uint32_t events, void *ptr) {
+    return epoll_loop_ctl(loop, EPOLL_CTL_MOD, fd, events, ptr);
+}
+
+static int epoll_loop_del(ev_loop *loop, int fd) {
+    return epoll_ctl(((epoll_loop *)loop)->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_loop_wait(ev_loop *loop, ev_event *events, int max_events, int timeout_ms) {
+    epoll_loop *el = (epoll_loop *)loop;
+
+    if (max_events > EPOLL_BATCH) {
+        max_events = EPOLL_BATCH;
+    }
+
+    int num_events = epoll_wait(el->epoll_fd, el->events, max_events, timeout_ms);
+
+    for (int i = 0; i < num_events; i++) {
+        events[i] = (ev_event){.events = el->events[i].events, .ptr = el->events[i].data.ptr};
+    }
+
+    return num_events;
+}
+
+static void epoll_loop_io_batch(ev_loop *loop, ev_io *ios, int n) {
+    (void)loop;
+
+    for (int i = 0; i < n; i++) {
+        ev_io *io = &ios[i];
+        io->res = io->send ? sendmsg(io->fd, io->msg, io->flags | MSG_DONTWAIT)
+                           : recvmsg(io->fd, io->msg, io->flags | MSG_DONTWAIT);
+        if (io->res < 0) {
+            io->res = -errno;
+        }
+    }
+}
+
+static void epoll_loop_destroy(ev_loop *loop) {
+    close(((epoll_loop *)loop)->epoll_fd);
+    free(loop);
+}
+
+static const ev_ops epoll_ops = {
+    .name = "epoll",
+    .add = epoll_loop_add,
+    .mod = epoll_loop_mod,
+    .del = epoll_loop_del,
+    .wait = epoll_loop_wait,
+    .io_batch = epoll_loop_io_batch,
+    .destroy = epoll_loop_destroy,
+};
+
+/**
+ * @brief Creates the default, epoll based, event loop
+ *
+ * @return ev_loop* - NULL on failure
+ */
+ev_loop *ev_create_epoll(void) {
+    epoll_loop *el = calloc(1, sizeof(*el));
+    if (el == NULL) {
+        return NULL;
+    }
+
+    el->epoll_fd = epoll_create1(0);
+    if (el->epoll_fd == -1) {
+        fprintf(stderr, "ERROR: Failed to create epoll instance: %s\n", strerror(errno));
+        free(el);
+        return NULL;
+    }
+
+    el->base.ops = &epoll_ops;
+    return &el->base;
+}
+
+/**
+ * @brief Creates an event loop of the requested kind, falling back to epoll if io_uring isn't usable on this kernel
+ *
+ * @param backend backend to try first
+ * @return ev_loop* - NULL only if no backend at all could be created
+ */
+ev_loop *ev_create(ev_backend backend) {
+    if (backend == EV_BACKEND_URING) {
+        ev_loop *loop = ev_create_uring();
+        if (loop != NULL) {
+            return loop;
+        }
+
+        fprintf(stderr, "io_uring event backend unavailable, falling back to epoll\n");
+    }
+
+    return ev_create_epoll();
+}
+
+/**
+ * @brief Maps a backend name given on the command line to its enum
+ *
+ * @return int - 0 on success, -1 if the name isn't recognised
+ */
+int ev_parse_backend(const char *name, ev_backend *backend) {
+    if (strcmp(name, "epoll") == 0) {
+        *backend = EV_BACKEND_EPOLL;
+    } else if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0) {
+        *backend = EV_BACKEND_URING;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
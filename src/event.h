@@ -0,0 +1,90 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>  // EPOLL* flags are the event mask for every backend (they match the poll(2) bits)
+
+typedef enum {
+    EV_BACKEND_EPOLL,
+    EV_BACKEND_URING
+} ev_backend;
+
+/**
+ * @brief A ready file descriptor, as reported back by ev_wait
+ */
+typedef struct {
+    uint32_t events;
+    void *ptr;
+} ev_event;
+
+/**
+ * @brief One non-blocking socket read or write, as part of a batch handed to ev_io_batch
+ */
+typedef struct {
+    int fd;
+    bool send;  // sendmsg, otherwise recvmsg
+    int flags;  // MSG_* flags, MSG_DONTWAIT is always added
+    struct msghdr *msg;
+    ssize_t res;  // set by ev_io_batch - bytes transferred, or -errno
+} ev_io;
+
+typedef struct ev_loop ev_loop;
+
+/**
+ * @brief Operations every event backend provides. Semantics follow level triggered epoll, i.e. a descriptor that is
+ * still ready keeps being reported on each wait until the condition is cleared or the interest mask changes.
+ */
+typedef struct {
+    const char *name;
+    int (*add)(ev_loop *loop, int fd, uint32_t events, void *ptr);
+    int (*mod)(ev_loop *loop, int fd, uint32_t events, void *ptr);
+    int (*del)(ev_loop *loop, int fd);
+    int (*wait)(ev_loop *loop, ev_event *events, int max_events, int timeout_ms);
+    void (*io_batch)(ev_loop *loop, ev_io *ios, int n);  // carries out every one of ios, in order
+    void (*destroy)(ev_loop *loop);
+} ev_ops;
+
+struct ev_loop {
+    const ev_ops *ops;
+};
+
+ev_loop *ev_create(ev_backend backend);
+ev_loop *ev_create_epoll(void);
+ev_loop *ev_create_uring(void);
+int ev_parse_backend(const char *name, ev_backend *backend);
+
+static inline int ev_add(ev_loop *loop, int fd, uint32_t events, void *ptr) {
+    return loop->ops->add(loop, fd, events, ptr);
+}
+
+static inline int ev_mod(ev_loop *loop, int fd, uint32_t events, void *ptr) {
+    return loop->ops->mod(loop, fd, events, ptr);
+}
+
+static inline int ev_del(ev_loop *loop, int fd) {
+    return loop->ops->del(loop, fd);
+}
+
+static inline int ev_wait(ev_loop *loop, ev_event *events, int max_events, int timeout_ms) {
+    return loop->ops->wait(loop, events, max_events, timeout_ms);
+}
+
+/**
+ * @brief Carries out a batch of socket reads/writes - one syscall each with epoll, one for the lot with io_uring
+ */
+static inline void ev_io_batch(ev_loop *loop, ev_io *ios, int n) {
+    loop->ops->io_batch(loop, ios, n);
+}
+
+static inline void ev_destroy(ev_loop *loop) {
+    loop->ops->destroy(loop);
+}
+
+#endif //EVENT_H
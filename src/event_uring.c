@@ -0,0 +1,531 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "event.h"
+
+#define URING_ENTRIES 256
+#define URING_IGNORE UINT64_MAX  // user_data for removals, their completions carry nothing we care about
+#define URING_IO_FD UINT32_MAX  // fd half of the user_data of an ev_io_batch op, the other half is its index
+#define URING_IO_CHUNK (URING_ENTRIES / 2)  // max ops of a batch in flight at once, so the CQ never overflows
+
+/**
+ * io_uring backend
+ *
+ * Interest is expressed as one-shot IORING_OP_POLL_ADD requests. Once a poll completes the descriptor is re-armed
+ * on the following wait, which gives the same level triggered behaviour the loop in main() relies on (e.g. the
+ * source read stopping at a full buffer, or backpressure being lifted with data already waiting).
+ *
+ * Interest changes never cost a syscall of their own, unlike EPOLL_CTL_MOD - they are just SQEs that ride along
+ * with the io_uring_enter that waits for the next batch of completions.
+ *
+ * user_data packs the fd with a generation, bumped whenever the registration changes, so completions from a poll
+ * that has since been replaced or removed (or from an fd number that has been reused) are simply dropped.
+ *
+ * The reads and writes themselves go through the same ring. ev_io_batch queues a batch of them as SENDMSG/RECVMSG
+ * requests and gets them all done with a single io_uring_enter, where epoll needs a syscall each - with MSG_DONTWAIT
+ * every one of them completes (or fails with EAGAIN) inline, so the readiness model above still holds. Poll
+ * completions that turn up while waiting on a batch are stashed for the next wait.
+ */
+
+typedef struct {
+    void *ptr;
+    uint32_t events;
+    uint32_t gen;
+    bool active;
+    bool armed;  // a poll request for this fd is in flight
+    bool queued;  // on the re-arm list for the next wait
+} uring_reg;
+
+typedef struct {
+    uint64_t user_data;
+    int32_t res;
+} uring_stashed;
+
+typedef struct {
+    ev_loop base;
+    int ring_fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_map;
+    size_t ring_map_len;
+    size_t sqes_len;
+
+    uring_reg *regs;  // indexed by fd
+    int nregs;
+
+    int *rearm;
+    int nrearm;
+    int rearm_cap;
+
+    uring_stashed *stash;  // poll completions reaped while waiting on an ev_io_batch, oldest first
+    int nstash;
+    int stash_cap;
+} uring_loop;
+
+static int uring_enter(uring_loop *ul, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                       size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, ul->ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_submit(uring_loop *ul) {
+    while (ul->to_submit > 0) {
+        int ret = uring_enter(ul, ul->to_submit, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ul->to_submit -= ret;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_loop *ul) {
+    unsigned tail = *ul->sq_tail;
+
+    if (tail - __atomic_load_n(ul->sq_head, __ATOMIC_ACQUIRE) == ul->sq_entries) {
+        uring_submit(ul);  // SQ full, push what we have to the kernel to make room
+    }
+
+    unsigned index = tail & *ul->sq_mask;
+    struct io_uring_sqe *sqe = &ul->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ul->sq_array[index] = index;
+    __atomic_store_n(ul->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ul->to_submit++;
+
+    return sqe;
+}
+
+static inline uint64_t uring_user_data(int fd, uint32_t gen) {
+    return ((uint64_t)gen << 32) | (uint32_t)fd;
+}
+
+static inline bool uring_is_io(uint64_t user_data) {
+    return user_data != URING_IGNORE && (uint32_t)user_data == URING_IO_FD;
+}
+
+static void uring_queue_poll(uring_loop *ul, int fd) {
+    uring_reg *reg = &ul->regs[fd];
+    struct io_uring_sqe *sqe = uring_get_sqe(ul);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = reg->events | EPOLLERR | EPOLLHUP;
+    sqe->user_data = uring_user_data(fd, reg->gen);
+
+    reg->armed = true;
+}
+
+static void uring_queue_remove(uring_loop *ul, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ul);
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(fd, ul->regs[fd].gen);
+    sqe->user_data = URING_IGNORE;
+
+    ul->regs[fd].armed = false;
+}
+
+static int uring_push_rearm(uring_loop *ul, int fd) {
+    if (ul->regs[fd].queued) {
+        return 0;
+    }
+
+    if (ul->nrearm == ul->rearm_cap) {
+        int cap = ul->rearm_cap ? ul->rearm_cap * 2 : 64;
+        int *rearm = realloc(ul->rearm, cap * sizeof(*rearm));
+        if (rearm == NULL) {
+            return -1;
+        }
+        ul->rearm = rearm;
+        ul->rearm_cap = cap;
+    }
+
+    ul->rearm[ul->nrearm++] = fd;
+    ul->regs[fd].queued = true;
+
+    return 0;
+}
+
+static int uring_loop_add(ev_loop *loop, int fd, uint32_t events, void *ptr) {
+    uring_loop *ul = (uring_loop *)loop;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (fd >= ul->nregs) {
+        int nregs = ul->nregs ? ul->nregs : 64;
+        while (nregs <= fd) {
+            nregs *= 2;
+        }
+
+        uring_reg *regs = realloc(ul->regs, nregs * sizeof(*regs));
+        if (regs == NULL) {
+            return -1;
+        }
+        memset(regs + ul->nregs, 0, (nregs - ul->nregs) * sizeof(*regs));
+
+        ul->regs = regs;
+        ul->nregs = nregs;
+    }
+
+    uring_reg *reg = &ul->regs[fd];
+    if (reg->active) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    reg->ptr = ptr;
+    reg->events = events;
+    reg->gen++;
+    reg->active = true;
+    reg->armed = false;
+
+    return uring_push_rearm(ul, fd);
+}
+
+static int uring_loop_mod(ev_loop *loop, int fd, uint32_t events, void *ptr) {
+    uring_loop *ul = (uring_loop *)loop;
+
+    if (fd < 0 || fd >= ul->nregs || !ul->regs[fd].active) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    uring_reg *reg = &ul->regs[fd];
+    reg->ptr = ptr;
+
+    if (reg->events == events) {
+        return 0;
+    }
+    reg->events = events;
+
+    if (reg->armed) {  // poll in flight is for the old mask, swap it out (both SQEs go with the next wait)
+        uring_queue_remove(ul, fd);
+        reg->gen++;
+    }
+
+    return uring_push_rearm(ul, fd);
+}
+
+static int uring_loop_del(ev_loop *loop, int fd) {
+    uring_loop *ul = (uring_loop *)loop;
+
+    if (fd < 0 || fd >= ul->nregs || !ul->regs[fd].active) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    uring_reg *reg = &ul->regs[fd];
+
+    if (reg->armed) {
+        uring_queue_remove(ul, fd);
+        uring_submit(ul);  // in-flight poll holds a reference to the socket, drop it now so close() is prompt
+    }
+
+    reg->active = false;
+    reg->gen++;
+
+    return 0;
+}
+
+/**
+ * @brief Turns a poll completion into an event, re-arming its fd for the next wait
+ *
+ * @return bool - true if event was filled in, false if the completion is stale or carries nothing
+ */
+static bool uring_poll_event(uring_loop *ul, uint64_t user_data, int32_t res, ev_event *event) {
+    if (user_data == URING_IGNORE || uring_is_io(user_data)) {
+        return false;  // an ev_io_batch op only outlives its batch if the batch was abandoned
+    }
+
+    int fd = (int)(uint32_t)user_data;
+    uint32_t gen = user_data >> 32;
+
+    if (fd >= ul->nregs) {
+        return false;
+    }
+
+    uring_reg *reg = &ul->regs[fd];
+    if (!reg->active || reg->gen != gen) {
+        return false;  // stale, registration was modified or removed after this poll was queued
+    }
+
+    reg->armed = false;
+    uring_push_rearm(ul, fd);
+
+    if (res == -ECANCELED) {
+        return false;
+    }
+
+    *event = (ev_event){.events = res < 0 ? EPOLLERR : (uint32_t)res, .ptr = reg->ptr};
+    return true;
+}
+
+static int uring_loop_wait(ev_loop *loop, ev_event *events, int max_events, int timeout_ms) {
+    uring_loop *ul = (uring_loop *)loop;
+
+    // re-arm everything that fired last time round (or was added/modified since)
+    for (int i = 0; i < ul->nrearm; i++) {
+        int fd = ul->rearm[i];
+        uring_reg *reg = &ul->regs[fd];
+
+        reg->queued = false;
+        if (reg->active && !reg->armed) {
+            uring_queue_poll(ul, fd);
+        }
+    }
+    ul->nrearm = 0;
+
+    unsigned head = *ul->cq_head;
+
+    if (ul->nstash == 0 && head == __atomic_load_n(ul->cq_tail, __ATOMIC_ACQUIRE)) {  // nothing waiting, block
+        struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+        struct io_uring_getevents_arg arg = {.sigmask = 0, .sigmask_sz = _NSIG / 8, .ts = (uint64_t)(uintptr_t)&ts};
+
+        int ret = uring_enter(ul, ul->to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (ret < 0) {
+            if (errno != ETIME) {
+                return -1;  // includes EINTR, which the caller treats as benign, same as for epoll_wait
+            }
+        } else {
+            ul->to_submit -= ret;
+        }
+    } else if (uring_submit(ul) < 0) {
+        return -1;
+    }
+
+    int num_events = 0;
+
+    int stashed = 0;
+    while (stashed < ul->nstash && num_events < max_events) {
+        const uring_stashed *st = &ul->stash[stashed++];
+        num_events += uring_poll_event(ul, st->user_data, st->res, &events[num_events]);
+    }
+    ul->nstash -= stashed;
+    memmove(ul->stash, ul->stash + stashed, ul->nstash * sizeof(*ul->stash));
+
+    unsigned tail = __atomic_load_n(ul->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && num_events < max_events) {
+        const struct io_uring_cqe *cqe = &ul->cqes[head & *ul->cq_mask];
+        head++;
+
+        num_events += uring_poll_event(ul, cqe->user_data, cqe->res, &events[num_events]);
+    }
+
+    __atomic_store_n(ul->cq_head, head, __ATOMIC_RELEASE);
+
+    return num_events;
+}
+
+static int uring_push_stash(uring_loop *ul, const struct io_uring_cqe *cqe) {
+    if (ul->nstash == ul->stash_cap) {
+        int cap = ul->stash_cap ? ul->stash_cap * 2 : 64;
+        uring_stashed *stash = realloc(ul->stash, cap * sizeof(*stash));
+        if (stash == NULL) {
+            return -1;
+        }
+        ul->stash = stash;
+        ul->stash_cap = cap;
+    }
+
+    ul->stash[ul->nstash++] = (uring_stashed){.user_data = cqe->user_data, .res = cqe->res};
+    return 0;
+}
+
+/**
+ * @brief Takes back the ops of a batch the kernel never picked up, turning them into no-ops, and carries them out
+ * with plain syscalls instead - their msghdrs won't outlive the batch
+ *
+ * @return int - ops taken back
+ */
+static int uring_reclaim_unsubmitted(uring_loop *ul, ev_io *ios) {
+    int reclaimed = 0;
+
+    for (unsigned k = __atomic_load_n(ul->sq_head, __ATOMIC_ACQUIRE); k != *ul->sq_tail; k++) {
+        struct io_uring_sqe *sqe = &ul->sqes[ul->sq_array[k & *ul->sq_mask]];
+        if (!uring_is_io(sqe->user_data)) {
+            continue;
+        }
+
+        ev_io *io = &ios[sqe->user_data >> 32];
+        io->res = io->send ? sendmsg(io->fd, io->msg, io->flags | MSG_DONTWAIT)
+                           : recvmsg(io->fd, io->msg, io->flags | MSG_DONTWAIT);
+        if (io->res < 0) {
+            io->res = -errno;
+        }
+
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = URING_IGNORE;
+        reclaimed++;
+    }
+
+    return reclaimed;
+}
+
+/**
+ * @brief Queues up to URING_IO_CHUNK ops as SENDMSG/RECVMSG requests and waits for every one of them to complete,
+ * stashing any poll completions reaped along the way
+ */
+static void uring_io_chunk(uring_loop *ul, ev_io *ios, int n) {
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ul);
+
+        sqe->opcode = ios[i].send ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+        sqe->fd = ios[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)ios[i].msg;
+        sqe->len = 1;
+        sqe->msg_flags = ios[i].flags | MSG_DONTWAIT;
+        sqe->user_data = ((uint64_t)i << 32) | URING_IO_FD;
+        ios[i].res = -EIO;  // only left as is if the op gets lost
+    }
+
+    int pending = n;
+    if (uring_submit(ul) < 0) {
+        fprintf(stderr, "io_uring_enter failed to submit %d ops, doing them directly: %s\n", n, strerror(errno));
+        pending -= uring_reclaim_unsubmitted(ul, ios);
+    }
+
+    while (pending > 0) {
+        unsigned head = *ul->cq_head;
+        unsigned tail = __atomic_load_n(ul->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (uring_enter(ul, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                fprintf(stderr, "Lost track of %d io_uring ops: %s\n", pending, strerror(errno));
+                return;
+            }
+            continue;
+        }
+
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ul->cqes[head & *ul->cq_mask];
+
+            if (uring_is_io(cqe->user_data)) {
+                ios[cqe->user_data >> 32].res = cqe->res;
+                pending--;
+            } else if (cqe->user_data != URING_IGNORE && uring_push_stash(ul, cqe) < 0) {
+                fprintf(stderr, "Dropped an io_uring poll completion, out of memory\n");
+            }
+        }
+
+        __atomic_store_n(ul->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void uring_loop_io_batch(ev_loop *loop, ev_io *ios, int n) {
+    uring_loop *ul = (uring_loop *)loop;
+
+    for (int i = 0; i < n; i += URING_IO_CHUNK) {
+        uring_io_chunk(ul, ios + i, n - i < URING_IO_CHUNK ? n - i : URING_IO_CHUNK);
+    }
+}
+
+static void uring_loop_destroy(ev_loop *loop) {
+    uring_loop *ul = (uring_loop *)loop;
+
+    munmap(ul->sqes, ul->sqes_len);
+    munmap(ul->ring_map, ul->ring_map_len);
+    close(ul->ring_fd);
+    free(ul->regs);
+    free(ul->rearm);
+    free(ul->stash);
+    free(ul);
+}
+
+static const ev_ops uring_ops = {
+    .name = "io_uring",
+    .add = uring_loop_add,
+    .mod = uring_loop_mod,
+    .del = uring_loop_del,
+    .wait = uring_loop_wait,
+    .io_batch = uring_loop_io_batch,
+    .destroy = uring_loop_destroy,
+};
+
+/**
+ * @brief Creates an io_uring backed event loop, requires a kernel with single mmap rings and EXT_ARG waits (5.11+)
+ *
+ * @return ev_loop* - NULL if io_uring isn't available or is too old
+ */
+ev_loop *ev_create_uring(void) {
+    struct io_uring_params params = {0};
+
+    int ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd < 0) {
+        fprintf(stderr, "ERROR: io_uring_setup failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "ERROR: io_uring on this kernel lacks single mmap/EXT_ARG support\n");
+        close(ring_fd);
+        return NULL;
+    }
+
+    uring_loop *ul = calloc(1, sizeof(*ul));
+    if (ul == NULL) {
+        close(ring_fd);
+        return NULL;
+    }
+    ul->ring_fd = ring_fd;
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ul->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+    ul->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ul->ring_map = mmap(NULL, ul->ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                        IORING_OFF_SQ_RING);
+    ul->sqes = mmap(NULL, ul->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    if (ul->ring_map == MAP_FAILED || ul->sqes == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Failed to map io_uring rings: %s\n", strerror(errno));
+        if (ul->ring_map != MAP_FAILED) munmap(ul->ring_map, ul->ring_map_len);
+        if (ul->sqes != MAP_FAILED) munmap(ul->sqes, ul->sqes_len);
+        close(ring_fd);
+        free(ul);
+        return NULL;
+    }
+
+    uint8_t *map = ul->ring_map;
+    ul->sq_head = (unsigned *)(map + params.sq_off.head);
+    ul->sq_tail = (unsigned *)(map + params.sq_off.tail);
+    ul->sq_mask = (unsigned *)(map + params.sq_off.ring_mask);
+    ul->sq_array = (unsigned *)(map + params.sq_off.array);
+    ul->sq_entries = params.sq_entries;
+
+    ul->cq_head = (unsigned *)(map + params.cq_off.head);
+    ul->cq_tail = (unsigned *)(map + params.cq_off.tail);
+    ul->cq_mask = (unsigned *)(map + params.cq_off.ring_mask);
+    ul->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+    ul->base.ops = &uring_ops;
+    return &ul->base;
+}
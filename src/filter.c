@@ -0,0 +1,137 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+static const ctmp_filter filter_all = {.max_len = UINT16_MAX};
+
+static bool filter_equal(const ctmp_filter *a, const ctmp_filter *b) {
+    return a->options_mask == b->options_mask && a->options_value == b->options_value && a->min_len == b->min_len
+           && a->max_len == b->max_len && a->prefix_len == b->prefix_len
+           && memcmp(a->prefix, b->prefix, a->prefix_len) == 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Parses "min-max" where either side may be left out
+ */
+static int parse_range(const char *value, size_t len, uint16_t *min, uint16_t *max) {
+    const char *dash = memchr(value, '-', len);
+    if (dash == NULL) {
+        return -1;
+    }
+
+    char *end;
+    if (dash > value) {
+        unsigned long lo = strtoul(value, &end, 10);
+        if (end != dash || lo > UINT16_MAX) return -1;
+        *min = lo;
+    }
+    if (dash + 1 < value + len) {
+        unsigned long hi = strtoul(dash + 1, &end, 10);
+        if (end != value + len || hi > UINT16_MAX) return -1;
+        *max = hi;
+    }
+
+    return *min <= *max ? 0 : -1;
+}
+
+static int parse_prefix(const char *value, size_t len, ctmp_filter *filter) {
+    if (len == 0 || len % 2 != 0 || len / 2 > FILTER_PREFIX_MAX) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < len; i += 2) {
+        int hi = hex_value(value[i]);
+        int lo = hex_value(value[i + 1]);
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+        filter->prefix[i / 2] = (uint8_t)(hi << 4 | lo);
+    }
+
+    filter->prefix_len = len / 2;
+    return 0;
+}
+
+/**
+ * @brief Parses a comma separated filter - "all", "sensitive" or "normal", "len=min-max" (payload bytes, either end
+ * optional) and "prefix=<hex>" (up to FILTER_PREFIX_MAX bytes the payload has to start with)
+ *
+ * @param spec e.g. "sensitive,len=-1024"
+ * @param filter set on success
+ * @return int - 0 on success, -1 if any term isn't valid
+ */
+int filter_parse(const char *spec, ctmp_filter *filter) {
+    ctmp_filter parsed = filter_all;
+
+    while (*spec != '\0') {
+        const char *comma = strchr(spec, ',');
+        size_t term_len = comma != NULL ? (size_t)(comma - spec) : strlen(spec);
+
+        if (term_len == 3 && strncmp(spec, "all", 3) == 0) {
+            parsed = filter_all;
+        } else if (term_len == 9 && strncmp(spec, "sensitive", 9) == 0) {
+            parsed.options_mask = parsed.options_value = CTMP_OPTION_SENSITIVE;
+        } else if (term_len == 6 && strncmp(spec, "normal", 6) == 0) {
+            parsed.options_mask = CTMP_OPTION_SENSITIVE;
+            parsed.options_value = 0;
+        } else if (term_len > 4 && strncmp(spec, "len=", 4) == 0) {
+            if (parse_range(spec + 4, term_len - 4, &parsed.min_len, &parsed.max_len) < 0) return -1;
+        } else if (term_len > 7 && strncmp(spec, "prefix=", 7) == 0) {
+            if (parse_prefix(spec + 7, term_len - 7, &parsed) < 0) return -1;
+        } else {
+            return -1;
+        }
+
+        spec += term_len + (comma != NULL);
+    }
+
+    *filter = parsed;
+    return 0;
+}
+
+/**
+ * @brief Finds the group for a filter, creating it if no other destination in the shard uses the same one
+ *
+ * @return int - group index (0 if it lets everything through), -1 if every group is taken
+ */
+int filter_table_acquire(filter_table *table, const ctmp_filter *filter) {
+    if (filter_equal(filter, &filter_all)) {
+        return 0;
+    }
+
+    int free_group = -1;
+    for (int g = 1; g < FILTER_GROUPS; g++) {
+        if (table->refs[g] == 0) {
+            if (free_group == -1) free_group = g;
+        } else if (filter_equal(&table->filters[g], filter)) {
+            table->refs[g]++;
+            return g;
+        }
+    }
+
+    if (free_group != -1) {
+        table->filters[free_group] = *filter;
+        table->refs[free_group] = 1;
+        table->in_use |= 1ull << free_group;
+    }
+
+    return free_group;
+}
+
+void filter_table_release(filter_table *table, int group) {
+    if (group != 0 && --table->refs[group] == 0) {
+        table->in_use &= ~(1ull << group);
+    }
+}
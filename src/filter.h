@@ -0,0 +1,72 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "ctmp.h"
+
+#define FILTER_PREFIX_MAX 16  // payload bytes a prefix match may cover
+#define FILTER_GROUPS 64  // distinct filters per shard, so a frame's matches fit in one uint64_t - group 0 is "all"
+
+/**
+ * @brief What a destination wants to receive, set with a "filter=" control line, e.g.
+ * "filter=sensitive,len=0-1024,prefix=cafe". Every term has to match, and "filter=all" goes back to everything.
+ */
+typedef struct {
+    uint8_t options_mask;  // bits of the options byte that have to equal options_value
+    uint8_t options_value;
+    uint16_t min_len;  // payload length range, inclusive
+    uint16_t max_len;
+    uint8_t prefix_len;
+    uint8_t prefix[FILTER_PREFIX_MAX];
+} ctmp_filter;
+
+/**
+ * @brief The distinct filters in use in a shard. Destinations with the same filter share a group, so each frame is
+ * tested once per group rather than once per destination.
+ */
+typedef struct {
+    ctmp_filter filters[FILTER_GROUPS];
+    uint32_t refs[FILTER_GROUPS];
+    uint64_t in_use;  // bit per group with destinations in it, never includes group 0
+} filter_table;
+
+int filter_parse(const char *spec, ctmp_filter *filter);
+
+int filter_table_acquire(filter_table *table, const ctmp_filter *filter);
+void filter_table_release(filter_table *table, int group);
+
+static inline bool filter_match(const ctmp_filter *filter, const uint8_t *msg, uint32_t len) {
+    uint32_t payload_len = len - sizeof(ctmp_header);
+
+    return (((const ctmp_header *)msg)->options & filter->options_mask) == filter->options_value
+           && payload_len >= filter->min_len && payload_len <= filter->max_len
+           && payload_len >= filter->prefix_len
+           && memcmp(msg + sizeof(ctmp_header), filter->prefix, filter->prefix_len) == 0;
+}
+
+/**
+ * @brief Tests a message against every group in use
+ *
+ * @return uint64_t - bit g set if group g wants it, bit 0 (no filter) always set
+ */
+static inline uint64_t filter_table_eval(const filter_table *table, const uint8_t *msg, uint32_t len) {
+    uint64_t match = 1;
+
+    for (uint64_t groups = table->in_use; groups != 0; groups &= groups - 1) {
+        int g = __builtin_ctzll(groups);
+        if (filter_match(&table->filters[g], msg, len)) {
+            match |= 1ull << g;
+        }
+    }
+
+    return match;
+}
+
+#endif //FILTER_H
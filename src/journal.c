@@ -0,0 +1,217 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "journal.h"
+
+/**
+ * @brief Splits a -j argument of the form path[:bytes] in place
+ *
+ * @param spec argument, cut short at the colon if there is one
+ * @param size set to the journal size, rounded up to whole pages
+ * @return int - 0 on success, -1 if the size is invalid or too small
+ */
+int journal_parse_spec(char *spec, uint64_t *size) {
+    *size = JOURNAL_DEFAULT_SIZE;
+
+    char *colon = strrchr(spec, ':');
+    if (colon != NULL) {
+        char *end;
+        unsigned long long bytes = strtoull(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || bytes < JOURNAL_MIN_SIZE) {
+            return -1;
+        }
+
+        *colon = '\0';
+        *size = bytes;
+    }
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    *size = (*size + page - 1) / page * page;
+    return spec[0] != '\0' ? 0 : -1;
+}
+
+/**
+ * @brief Creates (or truncates) the journal file and maps it
+ *
+ * @param j journal to open
+ * @param path file to keep it in
+ * @param size bytes, a multiple of the page size
+ * @return int - 0 on success, -1 on failure
+ */
+int journal_open(journal *j, const char *path, uint64_t size) {
+    *j = (journal){.fd = -1, .size = size};
+
+    j->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (j->fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open journal '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // allocate the lot up front, a full disk later on would otherwise be a SIGBUS mid-write
+    int err = posix_fallocate(j->fd, 0, size);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: Failed to allocate %lu byte journal '%s': %s\n", (unsigned long)size, path,
+                strerror(err));
+        journal_close(j);
+        return -1;
+    }
+
+    j->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+    j->index = malloc(JOURNAL_INDEX * sizeof(uint64_t));
+    if (j->data == MAP_FAILED || j->index == NULL) {
+        fprintf(stderr, "ERROR: Failed to map journal '%s': %s\n", path, strerror(errno));
+        if (j->data == MAP_FAILED) {
+            j->data = NULL;
+        }
+        journal_close(j);
+        return -1;
+    }
+
+    return 0;
+}
+
+void journal_close(journal *j) {
+    if (j->data != NULL) {
+        munmap(j->data, j->size);
+    }
+    if (j->fd != -1) {
+        close(j->fd);
+    }
+    free(j->index);
+    *j = (journal){.fd = -1};
+}
+
+/**
+ * @brief Appends a message, must be called before it is published to the broadcast ring so that anything a shard
+ * has fanned out is already in the journal
+ *
+ * @param j journal to append to
+ * @param seq the message's frame number in the broadcast ring
+ * @param offset the message's offset in the broadcast ring
+ * @param msg complete CTMP message
+ * @param len header + payload
+ */
+void journal_append(journal *j, uint64_t seq, uint64_t offset, const uint8_t *msg, size_t len) {
+    uint64_t at = offset % j->size;
+    size_t first = len < j->size - at ? len : j->size - at;
+
+    memcpy(j->data + at, msg, first);
+    memcpy(j->data, msg + first, len - first);  // wrapped
+
+    j->index[seq & (JOURNAL_INDEX - 1)] = offset;
+    __atomic_store_n(&j->head, offset + len, __ATOMIC_RELEASE);
+    __atomic_store_n(&j->next_seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finds where a replay from message seq starts, moving seq up to the oldest message still retained if it
+ * has already been dropped
+ *
+ * @param j journal to look in
+ * @param seq requested sequence number, updated to where the replay will actually start
+ * @param offset set to the message's offset
+ * @return bool - false if seq is past everything journaled so far
+ */
+bool journal_locate(const journal *j, uint64_t *seq, uint64_t *offset) {
+    uint64_t next = __atomic_load_n(&j->next_seq, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&j->head, __ATOMIC_ACQUIRE);
+
+    if (*seq >= next) {
+        return false;
+    }
+
+    // the older half of the index may be reused under us at any moment, and the oldest quarter of the file is slack
+    uint64_t lo = next > JOURNAL_INDEX / 2 ? next - JOURNAL_INDEX / 2 : 0;
+    uint64_t keep = j->size - j->size / 4;
+    uint64_t oldest = head > keep ? head - keep : 0;
+
+    // offsets only go up with seq, so binary search for the first message starting in the retained window
+    uint64_t hi = next - 1;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (j->index[mid & (JOURNAL_INDEX - 1)] < oldest) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (*seq < lo) {
+        *seq = lo;
+    }
+    *offset = j->index[*seq & (JOURNAL_INDEX - 1)];
+    return true;
+}
+
+/**
+ * @brief How close behind a replay the producer may get before it's cut off. Pages already sent stay referenced from
+ * the socket buffer (rather than copied) until they're acknowledged, so that has to be at least as much as the socket
+ * may be holding - its send buffer, as it is now, since autotuning only grows it - and never less than an eighth of
+ * the journal.
+ */
+static uint64_t journal_margin(const journal *j, int fd) {
+    int sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+
+    return (uint64_t)sndbuf > j->size / 8 ? (uint64_t)sndbuf : j->size / 8;
+}
+
+/**
+ * @brief Sends a destination as much of the journal between pos and end as its socket will take
+ *
+ * @param j journal to send from
+ * @param fd destination socket
+ * @param pos next offset to send, advanced by what was sent
+ * @param end offset to stop at
+ * @return ssize_t - bytes sent (0 if the socket was already full), -1 on a write error or if the replay was lapped
+ */
+ssize_t journal_send(const journal *j, int fd, uint64_t *pos, uint64_t end) {
+    ssize_t total = 0;
+    uint64_t margin = journal_margin(j, fd);
+    uint64_t limit = margin < j->size ? j->size - margin : 0;
+
+    while (*pos < end) {
+        // the producer has to stay clear of everything the socket may still reference, not just ahead of pos
+        uint64_t head = __atomic_load_n(&j->head, __ATOMIC_ACQUIRE);
+        if (head > limit && *pos < head - limit) {
+            fprintf(stderr, "Replay to destination on fd %d fell out of the journal (%lu byte send buffer)\n", fd,
+                    (unsigned long)margin);
+            return -1;
+        }
+
+        uint64_t at = *pos % j->size;
+        size_t len = end - *pos < j->size - at ? end - *pos : j->size - at;  // split at the wrap
+
+        off_t file_off = at;
+        ssize_t count = sendfile(fd, j->fd, &file_off, len);
+        if (count <= 0) {
+            if (count == 0) {
+                return total;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error replaying to destination on fd %d: %s\n", fd, strerror(errno));
+                return -1;
+            }
+
+            return total;  // socket full, wait for EPOLLOUT
+        }
+
+        *pos += count;
+        total += count;
+    }
+
+    return total;
+}
@@ -0,0 +1,48 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JOURNAL_DEFAULT_SIZE (1ull << 28)  // 256 MiB
+#define JOURNAL_MIN_SIZE (1ull << 26)  // so the slack left behind replays isn't mostly taken up by socket buffers
+#define JOURNAL_INDEX (1 << 20)  // sequence number -> offset entries, must be a power of two
+
+/**
+ * @brief Append-only journal of every published message (-j), so a destination that (re)connects can catch up on
+ * what it missed with a "replay=N" control line.
+ *
+ * The file is mapped and written as a ring of size bytes, at the same absolute offsets the messages have in the
+ * broadcast ring, and messages are numbered the same as the ring's frames - so where a shard has fanned out to is
+ * also exactly where a replay has to stop for the destination to rejoin the live feed.
+ *
+ * Replays are sent straight from the file with sendfile. The producer never waits for them: only the newest 3/4 of
+ * the file (and half the index) is offered for replay, leaving slack for replays in progress to fall behind in. One
+ * that falls more than 7/8 of the file behind is cut off rather than sent data that is being overwritten - the last
+ * eighth, or its send buffer if that is bigger, because pages already sent may still be referenced from the socket.
+ */
+typedef struct {
+    int fd;
+    uint8_t *data;  // size bytes, MAP_SHARED
+    uint64_t size;
+    uint64_t *index;  // offset of message seq at index[seq & (JOURNAL_INDEX - 1)]
+
+    uint64_t head;  // atomic, one past the newest byte written
+    uint64_t next_seq;  // atomic, sequence number of the next message
+} journal;
+
+int journal_parse_spec(char *spec, uint64_t *size);
+int journal_open(journal *j, const char *path, uint64_t size);
+void journal_close(journal *j);
+
+void journal_append(journal *j, uint64_t seq, uint64_t offset, const uint8_t *msg, size_t len);
+bool journal_locate(const journal *j, uint64_t *seq, uint64_t *offset);
+ssize_t journal_send(const journal *j, int fd, uint64_t *pos, uint64_t end);
+
+#endif //JOURNAL_H
@@ -4,10 +4,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "listener.h"
 
 /**
@@ -68,3 +73,128 @@ int init_tcp_listener(const char *ip, int port, int queue) {
 
     return listen_fd;
 }
+
+/**
+ * @brief Initialises an AF_UNIX stream listener at path, replacing whatever socket a previous run left there
+ *
+ * @param path filesystem path to bind to
+ * @param queue max pending connections in backlog
+ * @return int - file descriptor for listener socket
+ */
+int init_unix_listener(const char *path, int queue) {
+    struct sockaddr_un listen_addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(listen_addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(listen_addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Unix socket failed for %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // there's no SO_REUSEADDR for these, a stale socket file has to go - but never anything that isn't a socket
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    if (bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
+        fprintf(stderr, "Bind failed for %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(listen_fd, queue) < 0) {
+        fprintf(stderr, "Trying to listen on %s failed!", path);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Proxy is listening on %s%s\n", UNIX_PREFIX, path);
+
+    return listen_fd;
+}
+
+/**
+ * @brief Path of a unix:/path endpoint
+ *
+ * @return const char* - NULL if it's a TCP port instead
+ */
+const char *endpoint_unix_path(const char *endpoint) {
+    size_t prefix = strlen(UNIX_PREFIX);
+    return strncmp(endpoint, UNIX_PREFIX, prefix) == 0 ? endpoint + prefix : NULL;
+}
+
+/**
+ * @brief Initialises a listener for an endpoint given on the command line - unix:/path for an AF_UNIX stream socket,
+ * otherwise a TCP port on ip
+ *
+ * @param ip address TCP listeners bind to
+ * @param endpoint port number or unix:/path
+ * @param queue max pending connections in backlog
+ * @return int - file descriptor for listener socket
+ */
+int init_listener(const char *ip, const char *endpoint, int queue) {
+    const char *path = endpoint_unix_path(endpoint);
+    if (path != NULL) {
+        return init_unix_listener(path, queue);
+    }
+
+    return init_tcp_listener(ip, atoi(endpoint), queue);
+}
+
+/**
+ * @brief Describes an accepted peer for logging, ip:port for TCP and the socket path (if the peer bound one) for
+ * AF_UNIX
+ */
+void format_peer(const struct sockaddr_storage *addr, socklen_t addr_len, char *buf, size_t len) {
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, ip_str, sizeof(ip_str));
+        snprintf(buf, len, "%s:%d", ip_str, ntohs(in->sin_port));
+    } else if (addr->ss_family == AF_UNIX && addr_len > offsetof(struct sockaddr_un, sun_path)
+               && ((const struct sockaddr_un *)addr)->sun_path[0] != '\0') {
+        snprintf(buf, len, "%s%s", UNIX_PREFIX, ((const struct sockaddr_un *)addr)->sun_path);
+    } else {
+        snprintf(buf, len, "a local socket");  // unnamed, which is how unix sockets usually connect
+    }
+}
+
+/**
+ * @brief Receives one handoff from a connection to the handoff listener - a single role byte (HANDOFF_SRC or
+ * HANDOFF_DST) with up to HANDOFF_MAX_FDS already connected descriptors attached to it as SCM_RIGHTS
+ *
+ * @param fd handoff connection
+ * @param role set to the role byte
+ * @param fds set to the descriptors received, HANDOFF_MAX_FDS entries
+ * @return int - descriptors received, 0 if there is nothing (more) to read yet, -1 once the connection is done
+ */
+int recv_handoff(int fd, char *role, int *fds) {
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = role, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+
+    while (true) {
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t count = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        if (count <= 0) {
+            return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+                return num_fds;
+            }
+        }
+        // a role byte with nothing attached hands nothing over
+    }
+}
@@ -5,6 +5,23 @@
 #ifndef LISTENER_H
 #define LISTENER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define UNIX_PREFIX "unix:"  // endpoint given as unix:/path/to/socket rather than a TCP port
+#define PEER_STR_LEN 128  // enough for ip:port or a unix socket path
+#define HANDOFF_MAX_FDS 16  // descriptors accepted with a single handoff byte
+#define HANDOFF_MAX_CONNS 16  // handoff connections at once
+#define HANDOFF_SRC 's'
+#define HANDOFF_DST 'd'
+
 int init_tcp_listener(const char *ip, int port, int queue);
+int init_unix_listener(const char *path, int queue);
+int init_listener(const char *ip, const char *endpoint, int queue);
+const char *endpoint_unix_path(const char *endpoint);
+
+void format_peer(const struct sockaddr_storage *addr, socklen_t addr_len, char *buf, size_t len);
+int recv_handoff(int fd, char *role, int *fds);
 
-#endif //LISTENER_H
\ No newline at end of file
+#endif //LISTENER_H
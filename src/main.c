@@ -10,19 +10,674 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <sys/epoll.h>
 #include <signal.h>
 #include <time.h>
 #include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include "main.h"
 #include "ctmp.h"
 #include "listener.h"
 #include "client.h"
+#include "ring.h"
+#include "event.h"
+#include "shard.h"
+#include "metrics.h"
+#include "splice.h"
+#include "journal.h"
+#include "pool.h"
+#include "mcast.h"
+#include "cpu.h"
+#include "sockmap.h"
+#include "relay.h"
 
 
 volatile bool on_state = true;
-src_client src = {.fd = -1};  // file descriptor -1 indicates no connection
-dst_client dsts[MAX_DSTS];  // MAX_DSTS set in main.h - reject dsts in excess of this
+src_client sources[MAX_SRCS];  // file descriptor -1 indicates no connection
+int max_srcs = 1;  // -n, any more are rejected
+int rr_next = 0;  // source whose round-robin turn is next (or in progress)
+bool rr_credited = false;  // rr_next has already had its quantum for this turn, it was cut short by backpressure
+bool src_paused = false;  // sources are paused waiting on room in the ring
+bcast_ring ring;  // every message is written here once, dsts just queue descriptors into it
+shard shards[MAX_WORKERS];  // each owns a share of the max_dsts (-m, MAX_DSTS in main.h by default) dsts - reject dsts in excess of this
+int num_shards = 1;
+ingress_metrics ingress;  // only written from this thread, read by the admin socket
+splice_src zc = {.pipe = {-1, -1}, .devnull = -1};  // only set up in splice mode (-z)
+bool spliced = false;
+journal msg_journal = {.fd = -1};  // only opened with -j
+chunk_pool dst_pool;  // destination queues, -M bytes of them
+mcast_egress mcast = {.fd = -1, .listen_fd = -1};  // only with -u
+sockmap_fwd kfwd = {.src_map = -1, .dst_fd = -1};  // only with -k
+relay_uplink uplink = {.fd = -1};  // only used with -R
+bool relay_enabled = false;
+int busy_poll_us = -1;  // -b, SO_BUSY_POLL budget for sources and destinations, -1 if not busy polling
+int handoff_conns[HANDOFF_MAX_CONNS] = {[0 ... HANDOFF_MAX_CONNS - 1] = -1};  // connections to the -x listener
+
+/**
+ * @brief Moves the ring tail up to whatever the slowest shard still needs, so its space can be reused
+ */
+static void reclaim_ring(void) {
+    uint64_t tail = ring.head;
+    uint64_t frame_tail = ring.frame_head;
+
+    for (int s = 0; s < num_shards; s++) {
+        if (!shards[s].threaded) {
+            shard_publish_released(&shards[s]);  // same thread, so can just bring it up to date here and now
+        }
+
+        uint64_t released = __atomic_load_n(&shards[s].released, __ATOMIC_SEQ_CST);
+        uint64_t released_frame = __atomic_load_n(&shards[s].released_frame, __ATOMIC_SEQ_CST);
+
+        if (released < tail) tail = released;
+        if (released_frame < frame_tail) frame_tail = released_frame;
+    }
+
+    if (mcast.fd != -1 && mcast.frame_cursor < ring.frame_head) {  // still has to multicast these
+        uint64_t released = ring_frame(&ring, mcast.frame_cursor)->offset;
+
+        if (released < tail) tail = released;
+        if (mcast.frame_cursor < frame_tail) frame_tail = mcast.frame_cursor;
+    }
+
+    ring.tail = tail;
+    ring.frame_tail = frame_tail;
+}
+
+/**
+ * @brief Checks for room in the ring for the next message, only walking the shards when it looks full
+ *
+ * @param len length of the message to publish
+ * @return bool - true if it can be published, false if the source needs to be paused (backpressure)
+ */
+static bool ring_reserve(size_t len) {
+    if (ring_has_space(&ring, len)) {
+        return true;
+    }
+
+    reclaim_ring();
+    if (ring_has_space(&ring, len) || ring.wake_fd == -1) {
+        return ring_has_space(&ring, len);
+    }
+
+    // workers publish asynchronously, so flag that we're waiting and check once more, otherwise a worker could
+    // release everything between the check above and the flag going up, and never wake us
+    __atomic_store_n(&ring.waiting, 1, __ATOMIC_SEQ_CST);
+    reclaim_ring();
+
+    return ring_has_space(&ring, len);
+}
+
+/**
+ * @brief Picks the least loaded shard for a new destination
+ *
+ * @param fd accepted destination socket
+ * @return int - shard index the destination went to, -1 if every shard is full
+ */
+static int assign_dst(int fd) {
+    int order[MAX_WORKERS];
+    for (int s = 0; s < num_shards; s++) {
+        order[s] = s;
+    }
+
+    // insertion sort by load, num_shards is tiny
+    for (int s = 1; s < num_shards; s++) {
+        for (int k = s; k > 0 && __atomic_load_n(&shards[order[k]].num_dsts, __ATOMIC_RELAXED)
+                                  < __atomic_load_n(&shards[order[k - 1]].num_dsts, __ATOMIC_RELAXED); k--) {
+            int tmp = order[k];
+            order[k] = order[k - 1];
+            order[k - 1] = tmp;
+        }
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+        if (shard_assign_dst(&shards[order[s]], fd)) {
+            return order[s];
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Pauses (drops EPOLLIN) or resumes every source, keeping track of how long they have spent paused
+ *
+ * @param loop loop the sources are registered with
+ * @param backpressure whether there's currently no room for the next message
+ */
+static void set_src_backpressure(ev_loop *loop, bool backpressure) {
+    uint32_t new_mask = backpressure ? EPOLLRDHUP : (EPOLLIN | EPOLLRDHUP);
+    bool connected = false;
+
+    for (int k = 0; k < max_srcs; k++) {
+        src_client *src = &sources[k];
+        if (src->fd == -1) {
+            continue;
+        }
+
+        connected = true;
+        if (new_mask != src->prev_mask) {
+            ev_mod(loop, src->fd, new_mask, src);
+            src->prev_mask = new_mask;
+        }
+    }
+
+    // time spent paused, only looks at the clock when the state actually flips
+    src_paused = connected && backpressure;
+    if (src_paused != (ingress.paused_since_us != 0)) {
+        uint64_t now = metrics_now_us();
+        if (src_paused) {
+            metric_add(&ingress.paused_since_us, now);
+        } else {
+            metric_add(&ingress.backpressure_us, now - ingress.paused_since_us);
+            __atomic_store_n(&ingress.paused_since_us, 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Splice mode's take on publish_src - moves validated messages from the source socket into the source pipe
+ * without them passing through userspace, pausing the source when the pipe is full
+ *
+ * @param loop loop the source is registered with
+ * @return bool - true if at least one whole message went into the pipe
+ */
+static bool publish_src_spliced(ev_loop *loop) {
+    src_client *src = &sources[0];  // only ever one source in splice mode
+    if (src->fd == -1) {
+        return false;
+    }
+
+    uint32_t msgs = 0;
+    splice_result result = splice_pull(&zc, src->fd, &ingress, &msgs);
+
+    switch (result) {
+        case SPLICE_BAD_HEADER:
+            fprintf(stderr, "Invalid header from src on fd %d, closing connection...\n", src->fd);
+            metric_add(&ingress.header_failures, 1);
+            break;
+        case SPLICE_BAD_CHECKSUM:
+            fprintf(stderr, "Invalid checksum from src on fd %d\nClosing connection to src...", src->fd);
+            metric_add(&ingress.checksum_failures, 1);
+            break;
+        case SPLICE_EOF:
+            printf("Source client on fd %d disconnected\nCleaning up...\n", src->fd);
+            break;
+        case SPLICE_ERROR:
+            fprintf(stderr, "Error reading from source on fd %d: %s\nClosing source connection...\n", src->fd,
+                    strerror(errno));
+            break;
+        default:
+            break;
+    }
+
+    if (result >= SPLICE_EOF) {
+        close_src_client(loop, src);
+        splice_src_reset(&zc);
+    }
+
+    set_src_backpressure(loop, result == SPLICE_FULL);
+    return msgs > 0;
+}
+
+typedef enum {
+    SRC_TURN_IDLE,  // no complete message waiting (or the source was closed)
+    SRC_TURN_MORE,  // credit used up with messages still waiting
+    SRC_TURN_BLOCKED  // the ring is full
+} src_turn;
+
+/**
+ * @brief Makes sure a relayed source has a batch open to take messages from, checking the next one as a whole
+ * once it has all arrived and stepping over its envelope
+ *
+ * @param loop loop the source is registered with
+ * @param src relayed source, batched
+ * @return bool - true if there's a message at rd to publish, false if the batch isn't all here yet (or was bad and
+ * the source closed)
+ */
+static bool open_relay_batch(ev_loop *loop, src_client *src) {
+    if (src->relay.left > 0) {
+        return true;
+    }
+
+    relay_status status = relay_framer_feed(&src->relay, src_rd_ptr(src), src_buffered(src));
+    if (status == RELAY_NEED_MORE) {
+        return false;
+    }
+
+    if (status != RELAY_BATCH_READY) {
+        static const char *const reasons[] = {
+            [RELAY_BAD_HEADER] = "invalid envelope",
+            [RELAY_BAD_SEQ] = "out of sequence",
+            [RELAY_BAD_CHECKSUM] = "invalid checksum",
+            [RELAY_BAD_BODY] = "messages don't fill it",
+        };
+
+        fprintf(stderr, "Relay batch from src on fd %d rejected (%s), closing connection...\n", src->fd,
+                reasons[status]);
+        metric_add(status == RELAY_BAD_CHECKSUM ? &ingress.checksum_failures : &ingress.header_failures, 1);
+        close_src_client(loop, src);
+        return false;
+    }
+
+    src->rd += sizeof(relay_header);
+    relay_framer_open(&src->relay);
+    metric_add(&ingress.relay_batches, 1);
+    return true;
+}
+
+/**
+ * @brief Finds the next message to publish from a source sending plain CTMP - the next span of the last scan, or once
+ * those run out a fresh scan of everything buffered from rd, so a burst of small messages is validated in one go
+ * before any of it is published. A message still arriving is left to the framer, which picks up where it left off,
+ * so its header is only validated once and only the payload that arrived since last time is summed.
+ *
+ * @param loop loop the source is registered with
+ * @param src source whose turn it is
+ * @param msg set to the message, contiguous however the buffer wraps
+ * @param len set to its length
+ * @return bool - true if there's a complete message to publish, false if not (or it was bad and the source closed)
+ */
+static bool next_src_frame(ev_loop *loop, src_client *src, const uint8_t **msg, size_t *len) {
+    ctmp_scan *scan = &src->scan;
+
+    if (!ctmp_scan_pending(scan) && src->framer.frame_len == 0) {
+        ctmp_scan_burst(scan, src_rd_ptr(src), src_buffered(src));
+    }
+
+    if (ctmp_scan_pending(scan)) {
+        const ctmp_frame_span *span = &scan->spans[scan->next];
+        *msg = scan->base + span->offset;
+        *len = span->len;
+        return true;
+    }
+
+    ctmp_status status = scan->stop;
+    if (status == CTMP_NEED_MORE) {
+        status = ctmp_framer_feed(&src->framer, src_rd_ptr(src), src_buffered(src));
+        ctmp_scan_reset(scan);  // the framer has the front message now, don't scan from under it
+    }
+
+    if (status == CTMP_FRAME_READY) {
+        *msg = src_rd_ptr(src);
+        *len = src->framer.frame_len;
+        return true;
+    }
+
+    if (status == CTMP_BAD_HEADER) {
+        fprintf(stderr, "Invalid header from src on fd %d, closing connection...\n", src->fd);
+        metric_add(&ingress.header_failures, 1);
+
+        close_src_client(loop, src);
+    } else if (status == CTMP_BAD_CHECKSUM) {
+        fprintf(stderr, "Invalid checksum from src on fd %d\nClosing connection to src...", src->fd);
+        metric_add(&ingress.checksum_failures, 1);
+
+        close_src_client(loop, src);  // usual thing of kill the connection if it's not trustworthy
+                                           // in a sense it *could* be argued that this is something that
+                                           // can reasonably be recovered from (after dropping), but at this
+                                           // point, why waste time and power if the src cannot honour the
+                                           // protocol and contract of trust?
+    }
+
+    return false;
+}
+
+/**
+ * @brief Validates complete messages sitting in a source's buffer and publishes them to the broadcast ring, for as
+ * long as its round-robin credit lasts
+ *
+ * @param loop loop the source is registered with
+ * @param src source whose turn it is
+ * @param stamp_us read time of everything published in this pass, taken on first use
+ * @return src_turn - why the turn ended
+ */
+static src_turn publish_src_turn(ev_loop *loop, src_client *src, uint32_t *stamp_us) {
+    while (src->fd != -1) {
+        // plain messages until the first envelope, what the other proxy sent before it saw the relay line
+        if (src->relayed && !src->relay.batched && src->framer.frame_len == 0 && src_buffered(src) > 0) {
+            src->relay.batched = *src_rd_ptr(src) == RELAY_MAGIC;
+        }
+
+        const uint8_t *msg;
+        size_t full_msg_len;
+        if (src->relay.batched) {
+            if (!open_relay_batch(loop, src)) {
+                break;
+            }
+
+            msg = src_rd_ptr(src);
+            full_msg_len = relay_frame_len(msg);  // checked along with the rest of the batch
+        } else if (!next_src_frame(loop, src, &msg, &full_msg_len)) {
+            break;
+        }
+
+        if (full_msg_len > src->deficit) {
+            return SRC_TURN_MORE;  // keeps its credit, and adds to it next turn
+        }
+
+        // check for backpressure - only walk the shards to move the tail up when the ring looks full
+        if (!ring_reserve(full_msg_len)) {
+            return SRC_TURN_BLOCKED;  // don't consume more data from src to stop overflows
+        }
+
+        // no bp --> message goes into the ring once, shards queue a descriptor per dst
+        // src buffer is mirrored too, so the message is contiguous at rd even if it wrapped - no compaction needed
+        if (*stamp_us == 0) {
+            *stamp_us = (uint32_t)metrics_now_us();  // once per pass, everything in it was read at the same time
+        }
+        if (msg_journal.data != NULL) {
+            // must go in before the shards can see the message, a replay runs up to whatever they have fanned out
+            journal_append(&msg_journal, ring.frame_head, ring.head, msg, full_msg_len);
+        }
+        ring_publish(&ring, msg, full_msg_len, *stamp_us);
+        metric_add(&ingress.msgs_in, 1);
+        metric_add(&ingress.bytes_in, full_msg_len);
+
+        src->deficit -= full_msg_len;
+        src->rd += full_msg_len;
+        if (src->relay.batched) {
+            src->relay.left -= full_msg_len;
+        } else if (ctmp_scan_pending(&src->scan)) {
+            src->scan.next++;
+        } else {
+            ctmp_framer_consume(&src->framer);
+        }
+    }
+
+    src->deficit = 0;  // credit doesn't build up while there's nothing to spend it on
+    return SRC_TURN_IDLE;
+}
+
+/**
+ * @brief Publishes the complete messages the sources have buffered to the broadcast ring, taking turns between them,
+ * and pauses every source (drops EPOLLIN) once the ring has no room for the next one. The turn in progress when that
+ * happens carries on from where it left off once there's room again.
+ *
+ * @param loop loop the sources are registered with
+ * @return bool - true if at least one message was published
+ */
+static bool publish_src(ev_loop *loop) {
+    if (spliced) {
+        return publish_src_spliced(loop);
+    }
+
+    bool backpressure = false;
+    uint64_t published = ring.frame_head;
+    uint32_t stamp_us = 0;
+
+    // keep going round until every source in a row has had nothing (left) to publish
+    for (int idle = 0; idle < max_srcs;) {
+        src_client *src = &sources[rr_next];
+
+        if (!rr_credited) {
+            src->deficit += SRC_QUANTUM;
+            rr_credited = true;
+        }
+
+        src_turn turn = publish_src_turn(loop, src, &stamp_us);
+        if (turn == SRC_TURN_BLOCKED) {
+            backpressure = true;
+            break;
+        }
+
+        idle = turn == SRC_TURN_IDLE ? idle + 1 : 0;
+        rr_next = (rr_next + 1) % max_srcs;
+        rr_credited = false;
+    }
+
+    set_src_backpressure(loop, backpressure);  // add/remove bp
+
+    return ring.frame_head != published;
+}
+
+/**
+ * @brief Gets newly published frames moving - the inline shard fans out and flushes right here (also picking up
+ * any destination that has drained enough to take more), workers just get woken if they're idle, and with -u they
+ * are multicast from here too
+ *
+ * @param loop main event loop
+ * @param published whether anything new was published since the last call
+ */
+static void fan_out(ev_loop *loop, bool published) {
+    mcast_pump(&mcast, loop, &ring);
+
+    for (int s = 0; s < num_shards; s++) {
+        if (shards[s].threaded) {
+            if (published) {
+                shard_notify(&shards[s]);
+            }
+        } else {
+            shard_pump(&shards[s]);
+        }
+    }
+}
+
+/**
+ * @brief Publishes what the source has buffered and fans it out - with the inline shard, flushing can free up ring
+ * space for a paused source, so go round again until the source has nothing more it can publish
+ *
+ * @param loop loop the source is registered with
+ */
+static void run_pipeline(ev_loop *loop) {
+    bool progress;
+    do {
+        uint64_t retired = zc.retired;
+        progress = publish_src(loop);
+        fan_out(loop, progress);
+
+        // in splice mode room is only made when a batch is retired by the pump, so a paused source needs another go
+        progress = progress || (zc.retired != retired && src_paused);
+    } while (progress && !shards[0].threaded);
+}
+
+/**
+ * @brief Reads whatever the sources that became readable have waiting, all of them in one ev_io_batch. A single read
+ * either fills the free space of a source's buffer or finds the socket drained, and with the level triggered
+ * semantics of the loop a source that still has more is simply reported again.
+ *
+ * @param loop loop the sources are registered with
+ * @param ready sources reported readable, each at most once
+ * @param n how many
+ */
+static void read_srcs(ev_loop *loop, src_client **ready, int n) {
+    struct iovec iov[MAX_SRCS];
+    struct msghdr msgs[MAX_SRCS];
+    ev_io ios[MAX_SRCS];
+    int m = 0;
+
+    for (int k = 0; k < n; k++) {
+        src_client *src = ready[k];
+        if (src->fd == -1 || src_buffered(src) == BUFFER_SIZE) {
+            continue;  // closed earlier in this same batch, or waiting for what it has to be published
+        }
+
+        iov[m] = (struct iovec){.iov_base = src->read_buffer + (src->wr & (BUFFER_SIZE - 1)),  // mirrored, so the
+                                .iov_len = BUFFER_SIZE - src_buffered(src)};  // free space is contiguous
+        msgs[m] = (struct msghdr){.msg_iov = &iov[m], .msg_iovlen = 1};
+        ios[m] = (ev_io){.fd = src->fd, .msg = &msgs[m]};
+        ready[m++] = src;
+    }
+
+    ev_io_batch(loop, ios, m);
+
+    for (int k = 0; k < m; k++) {
+        src_client *src = ready[k];
+        ssize_t count = ios[k].res;
+
+        if (count < 0) {
+            if (count == -EAGAIN || count == -EWOULDBLOCK) {
+                continue;  // nothing more to read right now
+            }
+
+            fprintf(stderr, "Error reading from source on fd %d: %s\nClosing source connection...\n", src->fd,
+                    strerror((int)-count));
+            close_src_client(loop, src);
+            continue;
+        }
+
+        if (count == 0) {
+            printf("Source client on fd %d disconnected\nCleaning up...\n", src->fd);
+            close_src_client(loop, src);
+            continue;
+        }
+
+        src->wr += count;
+        if (kfwd.src_map != -1) {
+            kfwd.consumed += count;  // passed up by the verdict, so has to go the long way round
+        }
+    }
+}
+
+/**
+ * @brief Takes on a connected source socket, from the source listener, a handoff or the relay uplink
+ *
+ * @param loop loop to register it with
+ * @param src_fd connected socket
+ * @param peer description of where it came from, for logging
+ * @param relayed whether it's the relay uplink, which sends batches
+ */
+static void adopt_src(ev_loop *loop, int src_fd, const char *peer, bool relayed) {
+    src_client *src = NULL;
+    for (int k = 0; k < max_srcs && src == NULL; k++) {
+        if (sources[k].fd == -1) {
+            src = &sources[k];
+        }
+    }
+
+    if (src == NULL) {
+        fprintf(stderr, "Rejecting attempted source connection on fd %d from %s (already have %d connected sources)\n",
+                src_fd, peer, max_srcs);
+        close(src_fd);
+        return;
+    }
+
+    if (kfwd.src_map != -1 && !kfwd.fallback && sockmap_add_src(&kfwd, src_fd) < 0) {
+        close(src_fd);
+        return;
+    }
+
+    set_non_block(src_fd);
+    set_busy_poll(src_fd, busy_poll_us);
+
+    // joins paused if the others are, it'll be resumed along with them
+    uint32_t mask = src_paused ? EPOLLRDHUP : (EPOLLIN | EPOLLRDHUP);
+    ev_add(loop, src_fd, mask, src);
+    src->fd = src_fd;
+    src->rd = src->wr = 0;
+    ctmp_framer_consume(&src->framer);
+    ctmp_scan_reset(&src->scan);
+    src->relayed = relayed;
+    src->relay = (relay_framer){0};
+    src->prev_mask = mask;
+    src->deficit = 0;
+    metric_add(&ingress.sources_accepted, 1);
+
+    printf("Accepted new %ssource client on fd %d from %s\n", relayed ? "relay " : "", src_fd, peer);
+}
+
+/**
+ * @brief Takes on a connected destination socket, from the destination listener or a handoff
+ *
+ * @param loop loop to register it with, if forwarding in the kernel (otherwise its shard's is used)
+ * @param dst_fd connected socket
+ * @param peer description of where it came from, for logging
+ */
+static void adopt_dst(ev_loop *loop, int dst_fd, const char *peer) {
+    set_non_block(dst_fd);
+    set_busy_poll(dst_fd, busy_poll_us);
+
+    // forwarding in the kernel, the destination is only a redirect target - all that's left here is noticing it close
+    if (kfwd.src_map != -1 && !kfwd.fallback) {
+        if (kfwd.dst_fd == -1 && sockmap_set_dst(&kfwd, dst_fd) == 0) {
+            ev_add(loop, dst_fd, EPOLLIN | EPOLLRDHUP, &kfwd.dst_fd);
+            printf("Accepted new destination client on fd %d, in-kernel from %s\n", dst_fd, peer);
+            return;
+        }
+
+        // a second destination, which a redirect can't reach - everything goes the userspace way round from now on
+        sockmap_fallback(&kfwd);
+        printf("Destination on fd %d from %s is one more than in-kernel forwarding can reach, forwarding in "
+               "userspace\n", dst_fd, peer);
+    }
+
+    int s = assign_dst(dst_fd);
+    if (s != -1) {
+        printf("Accepted new destination client on fd %d, shard %d from %s\n", dst_fd, s, peer);
+    } else {
+        fprintf(stderr,
+                "Rejecting attempted destination connection on fd %d from %s (max allowed destinations reached)\n",
+                dst_fd, peer);
+        close(dst_fd);
+    }
+}
+
+/**
+ * @brief Reads whatever handoffs are waiting on a handoff connection, adopting each descriptor as a source or
+ * destination according to the role byte it came with
+ *
+ * @param loop loop sources are registered with
+ * @param conn_fd handoff connection, closed (and set to -1) once the other end is done with it
+ */
+static void handle_handoff(ev_loop *loop, int *conn_fd) {
+    char role;
+    int fds[HANDOFF_MAX_FDS];
+    int num_fds;
+
+    while ((num_fds = recv_handoff(*conn_fd, &role, fds)) > 0) {
+        for (int k = 0; k < num_fds; k++) {
+            if (role == HANDOFF_SRC) {
+                adopt_src(loop, fds[k], "a handoff", false);
+            } else if (role == HANDOFF_DST) {
+                adopt_dst(loop, fds[k], "a handoff");
+            } else {
+                fprintf(stderr, "Ignoring handed off fd %d with unknown role '%c'\n", fds[k], role);
+                close(fds[k]);
+            }
+        }
+    }
+
+    if (num_fds < 0) {
+        ev_del(loop, *conn_fd);
+        close(*conn_fd);
+        *conn_fd = -1;
+    }
+}
+
+/**
+ * @brief Raises the soft open file limit as far as needed for max_dsts destinations (plus a few for the listeners,
+ * source and event loops), so a large -m isn't silently capped by the usual default of 1024
+ *
+ * @param max_dsts destinations that may be connected at once
+ */
+static void raise_fd_limit(int max_dsts) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return;
+    }
+
+    rlim_t wanted = (rlim_t)max_dsts + 64 + 2 * MAX_WORKERS;
+    if (limit.rlim_cur >= wanted) {
+        return;
+    }
+
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < wanted) {
+        fprintf(stderr, "Open file limit of %lu may not be enough for %d destinations\n",
+                (unsigned long)limit.rlim_cur, max_dsts);
+    }
+}
+
+/**
+ * @brief Whether the relay uplink is connected, as one of the sources
+ */
+static bool relay_linked(void) {
+    for (int k = 0; k < max_srcs; k++) {
+        if (sources[k].fd != -1 && sources[k].relayed) {
+            return true;
+        }
+    }
+    return false;
+}
 
 /**
  * @brief Cleanly handles shutdown
@@ -38,58 +693,373 @@ int main(int argc, char **argv) {
     signal(SIGINT, int_handler); // handle ctrl-c
 
     char *ip = "127.0.0.1";
-    int src_port = SRC_PORT;
-    int dst_port = DST_PORT;
+    const char *src_endpoint = SRC_PORT;
+    const char *dst_endpoint = DST_PORT;
+    const char *handoff_path = NULL;
+    ev_backend backend = EV_BACKEND_EPOLL;
+    int workers = 0;
+    int max_dsts = MAX_DSTS;
+    dst_policy policy = DST_POLICY_BLOCK;
+    uint32_t hwm = DST_DEFAULT_HWM;
+    int admin_port = 0;
+    char *journal_path = NULL;
+    uint64_t journal_size = JOURNAL_DEFAULT_SIZE;
+    int prio_guard = -1;  // DST_PRIO_GUARD unless given
+    uint64_t pool_budget = 0;  // enough for every destination up to POOL_DEFAULT_BUDGET unless given
+    bool pool_huge = false;
+    struct sockaddr_in mcast_group;
+    uint32_t mcast_datagram = 0;  // 0 unless multicasting
+    int cpus[CPU_MAX_PINNED];  // main thread first, then each worker in turn
+    int num_cpus = 0;
+    bool kernel_fwd = false;
+    uint32_t zerocopy_min = 0;  // -Z, 0 unless sending with MSG_ZEROCOPY
 
     int opt;
-    while ((opt = getopt(argc, argv, "i:s:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "i:s:d:e:w:m:p:a:zj:n:g:M:Hu:x:b:c:kZ:R:")) != -1) {
         switch (opt) {
             case 'i':
                 ip = optarg;
                 break;
             case 's':
-                src_port = atoi(optarg);
+                src_endpoint = optarg;
                 break;
             case 'd':
-                dst_port = atoi(optarg);
+                dst_endpoint = optarg;
+                break;
+            case 'x':
+                handoff_path = endpoint_unix_path(optarg) != NULL ? endpoint_unix_path(optarg) : optarg;
+                break;
+            case 'e':
+                if (ev_parse_backend(optarg, &backend) == 0) {
+                    break;
+                }
+                fprintf(stderr, "Unknown event backend '%s' (expected epoll or uring)\n", optarg);
+                exit(EXIT_FAILURE);
+            case 'w':
+                workers = atoi(optarg);
+                if (workers >= 0 && workers <= MAX_WORKERS) {
+                    break;
+                }
+                fprintf(stderr, "Worker count must be between 0 and %d\n", MAX_WORKERS);
+                exit(EXIT_FAILURE);
+            case 'm':
+                max_dsts = atoi(optarg);
+                if (max_dsts > 0) {
+                    break;
+                }
+                fprintf(stderr, "Max destinations must be at least 1\n");
+                exit(EXIT_FAILURE);
+            case 'p':
+                if (dst_parse_policy(optarg, &policy, &hwm) == 0) {
+                    break;
+                }
+                fprintf(stderr, "Invalid policy '%s' (expected block, drop-oldest, drop-newest or disconnect, "
+                                "optionally followed by :hwm_bytes between %d and %d)\n",
+                        optarg, (int)sizeof(ctmp_header) + UINT16_MAX, RING_SIZE / 2);
+                exit(EXIT_FAILURE);
+            case 'a':
+                admin_port = atoi(optarg);
                 break;
+            case 'z':
+                spliced = true;
+                break;
+            case 'b':
+                busy_poll_us = atoi(optarg);
+                if (busy_poll_us >= 0) {
+                    break;
+                }
+                fprintf(stderr, "Busy poll budget must be 0 or more microseconds\n");
+                exit(EXIT_FAILURE);
+            case 'Z': {
+                long bytes = atol(optarg);
+                if (bytes > 0 && bytes <= (long)(sizeof(ctmp_header) + UINT16_MAX)) {
+                    zerocopy_min = bytes;
+                    break;
+                }
+                fprintf(stderr, "Zero-copy threshold must be between 1 and %zu bytes\n",
+                        sizeof(ctmp_header) + UINT16_MAX);
+                exit(EXIT_FAILURE);
+            }
+            case 'c':
+                num_cpus = cpu_parse_list(optarg, cpus, CPU_MAX_PINNED);
+                if (num_cpus > 0) {
+                    break;
+                }
+                fprintf(stderr, "Invalid CPU list '%s' (expected e.g. 2 or 2,4-6, at most %d CPUs)\n", optarg,
+                        CPU_MAX_PINNED);
+                exit(EXIT_FAILURE);
+            case 'n':
+                max_srcs = atoi(optarg);
+                if (max_srcs > 0 && max_srcs <= MAX_SRCS) {
+                    break;
+                }
+                fprintf(stderr, "Max sources must be between 1 and %d\n", MAX_SRCS);
+                exit(EXIT_FAILURE);
+            case 'j':
+                journal_path = optarg;
+                if (journal_parse_spec(journal_path, &journal_size) == 0) {
+                    break;
+                }
+                fprintf(stderr, "Invalid journal '%s' (expected path[:bytes], at least %llu bytes)\n", optarg,
+                        JOURNAL_MIN_SIZE);
+                exit(EXIT_FAILURE);
+            case 'g':
+                prio_guard = atoi(optarg);
+                if (prio_guard >= 0 && prio_guard <= UINT8_MAX) {
+                    break;
+                }
+                fprintf(stderr, "Priority guard must be between 0 (no priority lane) and %d\n", UINT8_MAX);
+                exit(EXIT_FAILURE);
+            case 'M':
+                pool_budget = strtoull(optarg, NULL, 10);
+                if (pool_budget >= sizeof(dst_queues)) {
+                    break;
+                }
+                fprintf(stderr, "Memory budget must be at least %zu bytes, one destination's queues\n",
+                        sizeof(dst_queues));
+                exit(EXIT_FAILURE);
+            case 'H':
+                pool_huge = true;
+                break;
+            case 'k':
+                kernel_fwd = true;
+                break;
+            case 'R':
+                if (relay_parse_spec(optarg, &uplink) == 0) {
+                    relay_enabled = true;
+                    break;
+                }
+                fprintf(stderr, "Invalid relay uplink '%s' (expected ip:port or unix:path of another proxy's "
+                                "destination listener)\n", optarg);
+                exit(EXIT_FAILURE);
+            case 'u':
+                if (mcast_parse_spec(optarg, &mcast_group, &mcast_datagram) == 0) {
+                    break;
+                }
+                fprintf(stderr, "Invalid multicast group '%s' (expected group:port[:datagram_bytes], a multicast "
+                                "address and between %d and %d bytes)\n",
+                        optarg, MCAST_MIN_DATAGRAM, MCAST_MAX_DATAGRAM);
+                exit(EXIT_FAILURE);
             default:
-                fprintf(stderr, "Usage: %s [-i ip_address] [-s src_port] [-d dst_port]\n", argv[0]);
+                fprintf(stderr,
+                        "Usage: %s [-i ip_address] [-s src_port|unix:path] [-d dst_port|unix:path] [-e epoll|uring] [-w workers] [-m max_dsts] "
+                        "[-p policy[:hwm]] [-a admin_port] [-z] [-j journal[:bytes]] [-n max_srcs] "
+                        "[-g prio_guard] [-M budget_bytes] [-H] "
+                        "[-u group:port[:datagram]] [-x handoff_path] [-b busy_poll_us] [-c cpu_list] [-k] "
+                        "[-Z zerocopy_bytes] [-R upstream_ip:port|unix:path]\n",
+                        argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
-    for (int i = 0; i < MAX_DSTS; i++) {
-        dsts[i].fd = -1; // initialise each destination
+    // splice mode hands out batches in lockstep from a single pipe, so only the one inline shard and blocking
+    if (spliced && workers > 0) {
+        fprintf(stderr, "Splice mode (-z) can't be combined with worker threads (-w)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spliced && policy != DST_POLICY_BLOCK) {
+        fprintf(stderr, "Splice mode (-z) only supports the block policy, not %s\n", dst_policy_name(policy));
+        exit(EXIT_FAILURE);
     }
 
-    int src_listen_fd = init_tcp_listener(ip, src_port, 128);  // listen on :33333 or other specified port
+    if (spliced && max_srcs > 1) {
+        fprintf(stderr, "Splice mode (-z) only takes a single source (-n), messages are spliced in as they arrive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spliced && journal_path != NULL) {
+        fprintf(stderr, "Splice mode (-z) can't keep a journal (-j), messages never pass through userspace\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spliced && prio_guard >= 0) {
+        fprintf(stderr, "Splice mode (-z) has no priority lane (-g), batches are tee'd out whole in arrival order\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spliced && mcast_datagram > 0) {
+        fprintf(stderr, "Splice mode (-z) can't multicast (-u), messages never pass through userspace\n");
+        exit(EXIT_FAILURE);
+    }
+    if (mcast_datagram > 0 && journal_path == NULL) {
+        fprintf(stderr, "Multicast (-u) needs a journal (-j) to answer retransmit requests from\n");
+        exit(EXIT_FAILURE);
+    }
+    if (kernel_fwd && (spliced || journal_path != NULL || mcast_datagram > 0)) {
+        fprintf(stderr, "In-kernel forwarding (-k) can't be combined with -z, -j or -u, most messages never reach "
+                        "userspace\n");
+        exit(EXIT_FAILURE);
+    }
+    if (kernel_fwd && max_srcs > 1) {
+        fprintf(stderr, "In-kernel forwarding (-k) takes a single source (-n 1)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (kernel_fwd && policy != DST_POLICY_BLOCK) {
+        fprintf(stderr, "In-kernel forwarding (-k) has no slow-consumer policy (-p), the kernel queues for the "
+                        "destination\n");
+        exit(EXIT_FAILURE);
+    }
+    if (kernel_fwd && (endpoint_unix_path(src_endpoint) != NULL || endpoint_unix_path(dst_endpoint) != NULL
+                       || handoff_path != NULL)) {
+        fprintf(stderr, "In-kernel forwarding (-k) needs TCP sources and destinations, not unix sockets (-s unix:, "
+                        "-d unix:, -x)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (relay_enabled && (spliced || kernel_fwd)) {
+        fprintf(stderr, "A relay uplink (-R) sends batches that have to be unpacked in userspace, so can't be "
+                        "combined with -z or -k\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spliced && zerocopy_min > 0) {
+        fprintf(stderr, "Splice mode (-z) already sends without copying, it has no use for -Z\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spliced && (pool_budget > 0 || pool_huge)) {
+        fprintf(stderr, "Splice mode (-z) has no buffer pool (-M, -H), destinations queue in their pipes\n");
+        exit(EXIT_FAILURE);
+    }
+
+    raise_fd_limit(max_dsts * (spliced ? 3 : 1) + max_srcs);  // a pipe per destination in splice mode
+
+    if (spliced) {
+        if (splice_src_init(&zc) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        signal(SIGPIPE, SIG_IGN);  // splicing to a socket has no MSG_NOSIGNAL
+    }
+
+    if (journal_path != NULL) {
+        if (journal_open(&msg_journal, journal_path, journal_size) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        signal(SIGPIPE, SIG_IGN);  // nor does sendfile
+    }
+
+    // pinned before anything big is allocated, so it is first touched from the CPU that will be using it
+    if (num_cpus > 0 && cpu_pin_thread(pthread_self(), cpus[0]) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (ring_init(&ring) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (kernel_fwd) {
+        if (sockmap_open(&kfwd) == 0) {
+            printf("Forwarding in the kernel, through a sockmap\n");
+        } else {
+            fprintf(stderr, "WARNING: In-kernel forwarding unavailable, forwarding in userspace instead\n");
+        }
+    }
+
+    // a destination only holds queues while it has something queued, so the budget needn't cover all of them
+    uint64_t pool_chunks = pool_budget / sizeof(dst_queues);
+    if (pool_budget == 0) {
+        pool_chunks = POOL_DEFAULT_BUDGET / sizeof(dst_queues);
+        if ((uint64_t)max_dsts < pool_chunks) pool_chunks = max_dsts;
+    }
+    if (pool_chunks > UINT32_MAX) {
+        pool_chunks = UINT32_MAX;
+    }
+    if (pool_init(&dst_pool, sizeof(dst_queues), pool_chunks, pool_huge) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Buffer pool of %u destination queues (%zu bytes each) on %s pages\n", dst_pool.count, sizeof(dst_queues),
+           dst_pool.huge ? "huge" : "ordinary");
+
+    for (int k = 0; k < max_srcs; k++) {
+        sources[k].fd = -1;
+        sources[k].read_buffer = ring_map_mirrored(BUFFER_SIZE);  // only address space until a source uses it
+        if (sources[k].read_buffer == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int src_listen_fd = init_listener(ip, src_endpoint, 128);  // listen on :33333 or other specified port/unix socket
     // prev assumption doesn't work given we could get flooded with *bad* src connections - ie don't want kernel to reject legit src
-    // similar problem for small MAX_DSTS
-    int dst_listen_fd = init_tcp_listener(ip, dst_port, 128);  // listen on :44444
+    // similar problem for small max_dsts
+    int dst_listen_fd = init_listener(ip, dst_endpoint, 128);  // listen on :44444
     set_non_block(src_listen_fd);  // changed to non-blocking so we can poll rather than waiting and doing things sequentially
     set_non_block(dst_listen_fd);
 
-    int epoll_fd = epoll_create1(0);  // file descriptor for polling
-    if (epoll_fd == -1) {
-        fprintf(stderr, "ERROR: Failed to create epoll instance: %s\n", strerror(errno));
+    int handoff_listen_fd = -1;  // only with -x
+    if (handoff_path != NULL) {
+        handoff_listen_fd = init_unix_listener(handoff_path, HANDOFF_MAX_CONNS);
+        set_non_block(handoff_listen_fd);
+    }
+
+    int admin_listen_fd = -1;  // metrics, only if asked for
+    if (admin_port > 0) {
+        admin_listen_fd = init_tcp_listener(ip, admin_port, ADMIN_MAX_CONNS);
+        set_non_block(admin_listen_fd);
+    }
+
+    ev_loop *loop = ev_create(backend);  // epoll by default, io_uring if asked for and the kernel supports it
+    if (loop == NULL) {
+        fprintf(stderr, "ERROR: Failed to create event loop\n");
         exit(EXIT_FAILURE);
     }
 
-    struct epoll_event event, events[MAX_DSTS + 3];  // capacity for MAX_DSTS destinations, 1 source, plus the 2 listeners
-    event.events = EPOLLIN;  // initially only care about reading - with no read we have no write
+    if (mcast_datagram > 0 && mcast_open(&mcast, loop, ip, &mcast_group, mcast_datagram, &msg_journal, &ring) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    event.data.ptr = &src_listen_fd;  // register src listener socket with epoll - fd readable -> incoming connection
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src_listen_fd, &event);
+    // 0 workers --> a single shard driven inline on this thread, otherwise each worker shard has its own thread & loop
+    num_shards = workers > 0 ? workers : 1;
+    for (int s = 0; s < num_shards; s++) {
+        int per_shard = (max_dsts + num_shards - 1) / num_shards;
+        if (shard_init(&shards[s], s, per_shard, &ring, workers > 0 ? NULL : loop, backend) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        shards[s].policy = policy;
+        shards[s].hwm = hwm;
+        shards[s].prio_guard = prio_guard >= 0 ? prio_guard : DST_PRIO_GUARD;
+        shards[s].pool = &dst_pool;
+        shards[s].busy_poll = busy_poll_us >= 0;
+        shards[s].zerocopy_min = zerocopy_min;
+        shards[s].cpu = workers > 0 && s + 1 < num_cpus ? cpus[s + 1] : -1;
+        shards[s].zc = spliced ? &zc : NULL;
+        shards[s].journal = journal_path != NULL ? &msg_journal : NULL;
+    }
 
-    event.data.ptr = &dst_listen_fd;  // same with dst
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dst_listen_fd, &event);
+    if (workers > 0) {
+        ring.wake_fd = eventfd(0, EFD_NONBLOCK);  // lets workers wake us once they free up space for a stalled source
+        if (ring.wake_fd == -1) {
+            fprintf(stderr, "ERROR: Failed to create eventfd: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        ev_add(loop, ring.wake_fd, EPOLLIN, &ring.wake_fd);
 
-    printf("Proxy started, waiting for events...\n");
+        for (int s = 0; s < num_shards; s++) {
+            if (shard_start(&shards[s]) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (kfwd.src_map != -1) {
+        int inject_fd = dup(kfwd.inject_fd);  // the shard closes its copy along with its other destinations
+        set_non_block(inject_fd);
+        assign_dst(inject_fd);
+    }
+
+    ev_event events[SHARD_EVENTS];  // anything beyond this is just picked up on the next wait
+    src_client *readable[MAX_SRCS];
+    int num_readable = 0;
+
+    // initially only care about reading - with no read we have no write
+    ev_add(loop, src_listen_fd, EPOLLIN, &src_listen_fd);  // register src listener socket - fd readable -> incoming connection
+    ev_add(loop, dst_listen_fd, EPOLLIN, &dst_listen_fd);  // same with dst
+    if (handoff_listen_fd != -1) {
+        ev_add(loop, handoff_listen_fd, EPOLLIN, &handoff_listen_fd);
+    }
+    if (admin_listen_fd != -1) {
+        ev_add(loop, admin_listen_fd, EPOLLIN, &admin_listen_fd);
+    }
+
+    printf("Proxy started using %s, waiting for events...\n", loop->ops->name);
 
     while (on_state) {
-        int num_events = epoll_wait(epoll_fd, events, MAX_DSTS + 3, 20);  // wait for new events, block for up to a reasonable time
-                                                                        // don't infinitely block so int_handler has an effect consistently
+        // wait for new events, block for up to a reasonable time - or not at all, spinning instead, when busy polling
+        // don't infinitely block so int_handler has an effect consistently
+        int num_events = ev_wait(loop, events, SHARD_EVENTS, busy_poll_us >= 0 ? 0 : 20);
 
         if (num_events < 0 && errno != EINTR) {
             fprintf(stderr, "Unrecoverable error whilst polling: %s\n", strerror(errno));
@@ -97,12 +1067,12 @@ int main(int argc, char **argv) {
         }
 
         for (int i = 0; i < num_events; i++) {
-            void *curr_fd_ptr = events[i].data.ptr;
+            void *curr_fd_ptr = events[i].ptr;
 
             // events for connections the src listener needs to handle
             if (curr_fd_ptr == &src_listen_fd) {
                 while (true) {
-                    struct sockaddr_in peer_addr;
+                    struct sockaddr_storage peer_addr;
                     socklen_t addr_len = sizeof(peer_addr);
 
                     int src_fd = accept(src_listen_fd, (struct sockaddr*)&peer_addr, &addr_len);
@@ -117,34 +1087,15 @@ int main(int argc, char **argv) {
                         break;  // so we don't spin forever on errors
                     }
 
-                    char ip_str[INET_ADDRSTRLEN];
-                    inet_ntop(AF_INET, &peer_addr.sin_addr, ip_str, sizeof(ip_str));
-                    uint16_t port = ntohs(peer_addr.sin_port);
-
-                    if (src.fd != -1) {
-                        fprintf(stderr, "Rejecting attempted source connection on fd %d from %s:%d (already have a connected source)\n", src_fd, ip_str, port);
-
-                        close(src_fd);
-
-                    } else {
-
-                        set_non_block(src_fd);
-
-                        event = (struct epoll_event){0};
-                        event.events = EPOLLIN;
-                        event.data.ptr = &src;
-
-                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src_fd, &event);
-                        src = (src_client){.fd = src_fd};
-
-                        printf("Accepted new source client on fd %d from %s:%d\n", src_fd, ip_str, port);
-                    }
+                    char peer[PEER_STR_LEN];
+                    format_peer(&peer_addr, addr_len, peer, sizeof(peer));
+                    adopt_src(loop, src_fd, peer, false);
                 }
             
             // events for connections the dst listener needs to handle    
             } else if (curr_fd_ptr == &dst_listen_fd) {
                 while (true) {
-                    struct sockaddr_in peer_addr;
+                    struct sockaddr_storage peer_addr;
                     socklen_t addr_len = sizeof(peer_addr);
 
                     int dst_fd = accept(dst_listen_fd, (struct sockaddr*)&peer_addr, &addr_len);
@@ -157,241 +1108,178 @@ int main(int argc, char **argv) {
                         break;
                     }
                     
-                    char ip_str[INET_ADDRSTRLEN];
-                    inet_ntop(AF_INET, &peer_addr.sin_addr, ip_str, sizeof(ip_str));
-                    uint16_t port = ntohs(peer_addr.sin_port);
-
-                    int j;
-                    for (j = 0; j < MAX_DSTS; j++) {
-                        if (dsts[j].fd == -1) {
-                            set_non_block(dst_fd);
-                            event = (struct epoll_event){0};
-
-                            event.events = EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-                            event.data.ptr = &dsts[j];
-
-                            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dst_fd, &event);
-
-                            dsts[j] = (dst_client){.fd = dst_fd, .last_active = time(NULL)};  // unsure if there's an edge case of dsts getting dc'ed from this when it's not their fault
-                            
-                            printf("Accepted new destination client on fd %d, slot %d from %s:%d\n", dsts[j].fd, j, ip_str, port);
-                            break;
+                    char peer[PEER_STR_LEN];
+                    format_peer(&peer_addr, addr_len, peer, sizeof(peer));
+                    adopt_dst(loop, dst_fd, peer);
+                }
+            // processes handing over already connected sockets
+            } else if (curr_fd_ptr == &handoff_listen_fd) {
+                int conn_fd;
+                while ((conn_fd = accept(handoff_listen_fd, NULL, NULL)) >= 0) {
+                    int *slot = NULL;
+                    for (int k = 0; k < HANDOFF_MAX_CONNS && slot == NULL; k++) {
+                        if (handoff_conns[k] == -1) {
+                            slot = &handoff_conns[k];
                         }
                     }
 
-                    if (j == MAX_DSTS) {
-                        fprintf(
-                            stderr,
-                            "Rejecting attempted destination connection on fd %d from %s:%d (max allowed destinations reached)\n",
-                            dst_fd, ip_str, port);
-                        close(dst_fd);
+                    if (slot == NULL) {
+                        fprintf(stderr, "Rejecting handoff connection on fd %d (already have %d)\n", conn_fd,
+                                HANDOFF_MAX_CONNS);
+                        close(conn_fd);
+                        continue;
                     }
+
+                    set_non_block(conn_fd);
+                    *slot = conn_fd;
+                    ev_add(loop, conn_fd, EPOLLIN | EPOLLRDHUP, slot);
+                    handle_handoff(loop, slot);  // the first handoff may well have arrived with the connection
+                }
+            } else if ((int *)curr_fd_ptr >= handoff_conns && (int *)curr_fd_ptr < handoff_conns + HANDOFF_MAX_CONNS) {
+                if (*(int *)curr_fd_ptr != -1) {
+                    handle_handoff(loop, curr_fd_ptr);
                 }
             // incoming data from src    
-            } else if (curr_fd_ptr == &src && src.fd != -1) {
-                if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
-                    bool cleanup = false;
-
-                    while (src.bytes_in < BUFFER_SIZE) {  // drain buffer to reduce wakeups
-                        ssize_t count = read(
-                            src.fd,
-                            src.read_buffer + src.bytes_in,
-                            BUFFER_SIZE - src.bytes_in);
-
-                        if (count < 0) {
-                            if (errno != EAGAIN && errno != EWOULDBLOCK) {  // ie unrecoverable state, not that we just don't have more data to read right now
-                                fprintf(stderr, "Error reading from source on fd %d: %s\nClosing source connection...\n",
-                                        src.fd, strerror(errno));
-                                cleanup = true;
-                                break;
-                            }
-
-                            break; // drained
-                        }
-
-                        if (count == 0) {
-                            printf("Source client on fd %d disconnected\nCleaning up...\n", src.fd);
-                            cleanup = true;
-                            break;
-                        }
+            } else if ((src_client *)curr_fd_ptr >= sources && (src_client *)curr_fd_ptr < sources + max_srcs) {
+                src_client *src = curr_fd_ptr;
+                if (src->fd == -1) {
+                    continue;  // closed earlier in this same batch
+                }
 
-                        src.bytes_in += count;
+                if (!spliced && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {  // splice mode pulls in publish_src
+                    bool seen = false;
+                    for (int k = 0; k < num_readable && !seen; k++) {
+                        seen = readable[k] == src;
                     }
-
-                    if (cleanup) {  // todo: refactor out
-                        close_src_client(epoll_fd, &src);
+                    if (!seen) {
+                        readable[num_readable++] = src;  // read together with the rest once the batch is through
                     }
+                    continue;
                 }
 
-            // outgoing data to dsts    
-            } else {
-                dst_client *dst = events[i].data.ptr;
-                bool cleanup = false;
-
-                if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {  // errored, hang up, half-close (close via peer, ie not writable)
-                    int soerr = 0;
-                    socklen_t len = sizeof(soerr);
-                    getsockopt(dst->fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
-                    fprintf(stderr, "Destination on fd %d hung or disconnected (Status: %s)\nCleaning up...\n", dst->fd,
-                            strerror(soerr));
-                    cleanup = true;
-
-                } else if (events[i].events & EPOLLOUT) {
-                    while (dst->bytes_out != dst->bytes_left) {  // drain all that we can, to reduce wakeups needed - level triggered
-                        ssize_t count = write(dst->fd, dst->write_buffer + dst->bytes_out,
-                                              dst->bytes_left - dst->bytes_out);
-
-                        if (count < 0) {
-                            if (errno != EAGAIN && errno != EWOULDBLOCK) {  // actual error that isn't just no data currently
-                                fprintf(
-                                    stderr,
-                                    "Error writing to destination on fd %d: %s\nClosing destination connection...\n",
-                                    dst->fd, strerror(errno));
-                                cleanup = true;
-                                break;
-                            }
-
-                            break; // drained
-                        }
-
-                        dst->bytes_out += count;
-                    }
+            // producer woken up by a worker that freed space in the ring
+            } else if (curr_fd_ptr == &ring.wake_fd) {
+                uint64_t count;
+                if (read(ring.wake_fd, &count, sizeof(count)) < 0) {
+                    // EAGAIN, nothing to clear
                 }
 
-                if (cleanup) {  // clean-up dsts that are in an unrecoverable state
-                    close_dst_client(epoll_fd, dst);
-
-                } else {
-                    if (dst->bytes_out == dst->bytes_left) {
-                        dst->bytes_out = 0;
-                        dst->bytes_left = 0;
-                    }
-
-                    if (dst->bytes_left > 0) {
-                        if (!(dst->prev_mask & EPOLLOUT)) { // only want to set EPOLLOUT on mask change
-                            struct epoll_event ev = {0};
+            // metrics scrapes, answered straight off the counters
+            } else if (curr_fd_ptr == &admin_listen_fd) {
+                metrics_admin_accept(loop, admin_listen_fd);
+                continue;
+            } else if (metrics_admin_owns(curr_fd_ptr)) {
+                metrics_admin_handle(loop, &events[i], &ingress, shards, num_shards);
+                continue;
+
+            // the in-kernel destination, only ever read to notice it go
+            } else if (curr_fd_ptr == &kfwd.dst_fd) {
+                char discard[DST_CTL_LEN];
+                ssize_t count;
+                while ((count = read(kfwd.dst_fd, discard, sizeof(discard))) > 0) {
+                    // control lines aren't supported in this mode, there's nothing here to act on them
+                }
 
-                            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
-                            ev.data.ptr = dst;
+                if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    printf("Destination client on fd %d disconnected\n", kfwd.dst_fd);
+                    ev_del(loop, kfwd.dst_fd);
+                    sockmap_drop_dst(&kfwd);
+                }
 
-                            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, dst->fd, &ev);
-                            dst->prev_mask |= EPOLLOUT;
-                        }
-                    } else {
-                        // remove EPOLLOUT so we don't get redundant wake-ups
-                        if (dst->prev_mask & EPOLLOUT) {
-                            dst->last_active = time(NULL);
-                            struct epoll_event ev = {0};
+            // relay uplink finished connecting (or failed to)
+            } else if (relay_uplink_owns(&uplink, curr_fd_ptr)) {
+                int up_fd = relay_uplink_handle(&uplink, loop);
+                if (up_fd != -1) {
+                    adopt_src(loop, up_fd, uplink.peer, true);
+                }
 
-                            ev.events = EPOLLIN | EPOLLRDHUP;
-                            ev.data.ptr = dst;
+            // multicast socket writable again, or retransmit requests
+            } else if (mcast_owns(&mcast, curr_fd_ptr)) {
+                mcast_handle(&mcast, loop, &events[i], &ring);
 
-                            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, dst->fd, &ev);
-                            dst->prev_mask &= ~EPOLLOUT;
-                        }
-                    }
-                }
+            // outgoing data to dsts (only seen here when the single shard shares this loop)
+            } else {
+                shard_handle_event(&shards[0], &events[i]);
             }
             
-            // enqueue
-            if (src.fd != -1) {
-                bool backpressure = false;
-                while (src.bytes_in >= sizeof(ctmp_header)) {
-                    ctmp_header *header = (ctmp_header *) src.read_buffer;
-
-                    if (!is_header_valid(header)) {
-                        fprintf(stderr, "Invalid header from src on fd %d, closing connection...\n", src.fd);
-                        
-                        close_src_client(epoll_fd, &src);
-                        
-                        break;
-                    }
-
-                    size_t full_msg_len = sizeof(ctmp_header) + ntohs(header->length);  // convert length to host order so we set len correctly
-
-                    if (src.bytes_in >= full_msg_len) { // checksum check is best here, can only do after accumulating full message
-                        if (header->options == CTMP_OPTION_SENSITIVE) {  // don't bother triggering any checksum check if flag isn't set
-                            if (!is_valid_checksum(header, (uint8_t *)(src.read_buffer + sizeof(ctmp_header)))) {
-                                fprintf(stderr, "Invalid checksum from src on fd %d\nClosing connection to src...", src.fd);
-
-                                close_src_client(epoll_fd, &src);  // usual thing of kill the connection if it's not trustworthy
-                                                                    // in a sense it *could* be argued that this is something that
-                                                                    // can reasonably be recovered from (after dropping), but at this
-                                                                    // point, why waste time and power if the src cannot honour the
-                                                                    // protocol and contract of trust?
-
-                                break;  // must break or it *will* segfault
-                            }
-                        }
-
-                        // check for backpressure
-                        for (int j = 0; j < MAX_DSTS; j++) {
-                            if (dsts[j].fd != -1 && (BUFFER_SIZE - dsts[j].bytes_left < full_msg_len)) {
-                                backpressure = true;
-                                break;
-                            }
-                        }
-                        if (backpressure) break;  // don't consume more data from src to stop overflows
-
-                        // no bp --> no break --> we want to broadcast to each of the dsts
-                        for (int j = 0; j < MAX_DSTS; j++) {
-                            if (dsts[j].fd != -1) {
-                                memcpy(dsts[j].write_buffer + dsts[j].bytes_left, src.read_buffer, full_msg_len);
-                                dsts[j].bytes_left += full_msg_len;
-
-                                uint32_t new_mask = EPOLLIN | EPOLLOUT;
-                                if (new_mask != dsts[j].prev_mask) {
-                                    event = (struct epoll_event){0};
+            run_pipeline(loop);  // enqueue, then fan out
+        }
 
-                                    event.events = new_mask;
-                                    event.data.ptr = &dsts[j];
+        if (num_readable > 0) {
+            read_srcs(loop, readable, num_readable);
+            num_readable = 0;
+            run_pipeline(loop);
+        }
 
-                                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, dsts[j].fd, &event);
-                                    dsts[j].prev_mask = new_mask;
-                                }
-                            }
-                        }
+        mcast_tick(&mcast);
 
-                        memmove(src.read_buffer, src.read_buffer + full_msg_len, src.bytes_in - full_msg_len);
-                        src.bytes_in -= full_msg_len;
-                    } else {
-                        break;
-                    }
-                }
-                // add/remove bp
-                uint32_t new_mask = backpressure ? EPOLLRDHUP : (EPOLLIN | EPOLLRDHUP);
-                if (new_mask != src.prev_mask) {
-                    event = (struct epoll_event){0};
+        if (relay_enabled) {
+            relay_uplink_tick(&uplink, loop, relay_linked());
+        }
 
-                    event.events = new_mask;
-                    event.data.ptr = &src;
+        if (kfwd.src_map != -1 && !kfwd.fallback && kfwd.acked != kfwd.consumed) {
+            reclaim_ring();
+            sockmap_ack(&kfwd, sources[0].fd, ring.tail == ring.head && src_buffered(&sources[0]) == 0);
+        }
 
-                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, src.fd, &event);
-                    src.prev_mask = new_mask;
-                }
-            }
+        if (!shards[0].threaded) {
+            shard_tick(&shards[0]);  // check for dead dst clients, and remove them if they've exceeded the timeout
 
-            // check for dead dst clients, and remove them if they've exceeded the timeout
-            // could also do for src, but less pertinent given single src
-            time_t now = time(NULL);
-            for (int l = 0; l < MAX_DSTS; l++) {
-                if (dsts[l].fd != -1 && dsts[l].bytes_left > 0) {
-                    if (now - dsts[l].last_active > CLIENT_TIMEOUT) {  // clean-up timed out clients - abstract out to its own method
-                        close_dst_client(epoll_fd, &dsts[l]);
-                    }
-                }
+            if (src_paused) {
+                run_pipeline(loop);  // a timed out dst may have been what held the source back, nothing else would wake it
             }
         }
     }
 
     // close connections
+    for (int s = 0; s < num_shards; s++) {
+        shard_stop(&shards[s]);
+        shard_free(&shards[s]);  // closes each remaining dst
+    }
+
+    mcast_close(&mcast, loop);
+    relay_uplink_close(&uplink, loop);
+    sockmap_close(&kfwd);
     close(src_listen_fd);
     close(dst_listen_fd);
-    close(epoll_fd);
-    close(src.fd);
+    if (handoff_listen_fd != -1) {
+        close(handoff_listen_fd);
+        unlink(handoff_path);
+    }
+    for (int k = 0; k < HANDOFF_MAX_CONNS; k++) {
+        if (handoff_conns[k] != -1) {
+            close(handoff_conns[k]);
+        }
+    }
+    // unix sockets leave their path behind, tidy up after ourselves
+    if (endpoint_unix_path(src_endpoint) != NULL) {
+        unlink(endpoint_unix_path(src_endpoint));
+    }
+    if (endpoint_unix_path(dst_endpoint) != NULL) {
+        unlink(endpoint_unix_path(dst_endpoint));
+    }
+    if (admin_listen_fd != -1) {
+        metrics_admin_close_all(loop);
+        close(admin_listen_fd);
+    }
+    for (int k = 0; k < max_srcs; k++) {
+        if (sources[k].fd != -1) {
+            close(sources[k].fd);
+        }
+    }
+    if (ring.wake_fd != -1) {
+        close(ring.wake_fd);
+    }
+    ev_destroy(loop);
 
-    for (int j = 0; j < MAX_DSTS; j++) {
-        close(dsts[j].fd);
+    ring_free(&ring);
+    pool_free(&dst_pool);
+    if (spliced) {
+        splice_src_free(&zc);
+    }
+    journal_close(&msg_journal);
+    for (int k = 0; k < max_srcs; k++) {
+        ring_unmap_mirrored(sources[k].read_buffer, BUFFER_SIZE);
     }
 
     printf("Proxy exiting...\n");
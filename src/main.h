@@ -5,10 +5,11 @@
 #ifndef MAIN_H
 #define MAIN_H
 
-#define SRC_PORT 33333
-#define DST_PORT 44444
+#define SRC_PORT "33333"
+#define DST_PORT "44444"
 
 #define MAX_DSTS 50
+#define MAX_SRCS 64
 
 ssize_t readn(int fd, void *buffer, ssize_t expected_bytes);
 ssize_t writen(int fd, const void *buffer, ssize_t expected_bytes);
@@ -0,0 +1,492 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "mcast.h"
+#include "client.h"
+#include "listener.h"
+
+/**
+ * @brief Parses a -u argument of the form group:port[:datagram_bytes]
+ *
+ * @param arg argument
+ * @param group set to the multicast group and port
+ * @param datagram set to the max datagram size, MCAST_DEFAULT_DATAGRAM if not given
+ * @return int - 0 on success, -1 if the group isn't a multicast address or a number is out of range
+ */
+int mcast_parse_spec(const char *arg, struct sockaddr_in *group, uint32_t *datagram) {
+    *group = (struct sockaddr_in){.sin_family = AF_INET};
+    *datagram = MCAST_DEFAULT_DATAGRAM;
+
+    char spec[64];
+    if (snprintf(spec, sizeof(spec), "%s", arg) >= (int)sizeof(spec)) {
+        return -1;
+    }
+
+    char *port = strchr(spec, ':');
+    if (port == NULL) {
+        return -1;
+    }
+    *port++ = '\0';
+
+    char *size = strchr(port, ':');
+    if (size != NULL) {
+        *size++ = '\0';
+        char *end;
+        unsigned long bytes = strtoul(size, &end, 10);
+        if (end == size || *end != '\0' || bytes < MCAST_MIN_DATAGRAM || bytes > MCAST_MAX_DATAGRAM) {
+            return -1;
+        }
+        *datagram = bytes;
+    }
+
+    int port_num = atoi(port);
+    if (inet_pton(AF_INET, spec, &group->sin_addr) <= 0 || !IN_MULTICAST(ntohl(group->sin_addr.s_addr))
+        || port_num <= 0 || port_num > UINT16_MAX) {
+        return -1;
+    }
+    group->sin_port = htons(port_num);
+
+    return 0;
+}
+
+/**
+ * @brief Creates the multicast socket, sending out of the interface with address ip, and the retransmit listener on
+ * ip at the group's port
+ *
+ * @param m egress to set up
+ * @param loop main event loop
+ * @param ip interface address, the same one the proxy listens on
+ * @param group multicast group and port
+ * @param datagram max bytes per datagram
+ * @param j journal retransmits are sent from
+ * @param ring broadcast ring, sending starts from whatever is published next
+ * @return int - 0 on success, -1 on failure
+ */
+int mcast_open(mcast_egress *m, ev_loop *loop, const char *ip, const struct sockaddr_in *group, uint32_t datagram,
+               const journal *j, const bcast_ring *ring) {
+    *m = (mcast_egress){.group = *group, .datagram = datagram, .journal = j, .listen_fd = -1,
+                        .frame_cursor = ring_published(ring), .last_sent = time(NULL)};
+    for (int k = 0; k < MCAST_MAX_CONNS; k++) {
+        m->conns[k].fd = -1;
+    }
+
+    m->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m->fd == -1) {
+        fprintf(stderr, "ERROR: Failed to create multicast socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct in_addr iface;
+    unsigned char ttl = 1;  // stays on the LAN
+    unsigned char loop_back = 1;  // subscribers on this host get it too
+    int sndbuf = RING_SIZE;
+    if (inet_pton(AF_INET, ip, &iface) <= 0
+        || setsockopt(m->fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0
+        || setsockopt(m->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+        || setsockopt(m->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop_back, sizeof(loop_back)) < 0) {
+        fprintf(stderr, "ERROR: Failed to set up multicast out of %s: %s\n", ip, strerror(errno));
+        close(m->fd);
+        m->fd = -1;
+        return -1;
+    }
+    setsockopt(m->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));  // capped by wmem_max, best effort
+
+    m->listen_fd = init_tcp_listener(ip, ntohs(group->sin_port), MCAST_MAX_CONNS);
+    set_non_block(m->listen_fd);
+    ev_add(loop, m->listen_fd, EPOLLIN, &m->listen_fd);
+
+    char group_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &group->sin_addr, group_str, sizeof(group_str));
+    printf("Multicasting to %s:%d in datagrams of up to %u bytes, retransmits on %s:%d\n", group_str,
+           ntohs(group->sin_port), datagram, ip, ntohs(group->sin_port));
+    return 0;
+}
+
+static void conn_close(ev_loop *loop, mcast_conn *c) {
+    ev_del(loop, c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+void mcast_close(mcast_egress *m, ev_loop *loop) {
+    if (m->fd == -1) {
+        return;
+    }
+
+    printf("Multicast egress sent %lu datagrams, answered %lu retransmit requests\n", (unsigned long)m->datagrams,
+           (unsigned long)m->resends);
+
+    for (int k = 0; k < MCAST_MAX_CONNS; k++) {
+        if (m->conns[k].fd != -1) {
+            conn_close(loop, &m->conns[k]);
+        }
+    }
+    ev_del(loop, m->listen_fd);
+    close(m->listen_fd);
+    if (m->blocked) {
+        ev_del(loop, m->fd);
+    }
+    close(m->fd);
+    m->fd = m->listen_fd = -1;
+}
+
+/**
+ * @brief Packs the next datagram, starting from frame *f (*frag bytes into it)
+ *
+ * @param iov filled with the header followed by the messages, MCAST_MAX_IOV entries
+ * @param hdr header to fill in, iov[0] points at it
+ * @param f advanced past every message that went in whole (or whose last fragment this is)
+ * @param frag advanced through a message being fragmented, back to 0 once it is done
+ * @return int - iovecs used
+ */
+static int mcast_pack(const mcast_egress *m, const bcast_ring *ring, uint64_t published, struct iovec *iov,
+                      mcast_header *hdr, uint64_t *f, uint32_t *frag) {
+    uint32_t cap = m->datagram - sizeof(mcast_header);
+    const frame_desc *desc = ring_frame(ring, *f);
+    int iovcnt = 1;
+
+    *hdr = (mcast_header){.seq = htobe64(*f)};
+    iov[0] = (struct iovec){.iov_base = hdr, .iov_len = sizeof(*hdr)};
+
+    if (desc->len > cap) {  // too big for a datagram of its own, send it in pieces
+        uint32_t len = desc->len - *frag < cap ? desc->len - *frag : cap;
+        iov[iovcnt++] = (struct iovec){.iov_base = ring_ptr(ring, desc->offset + *frag), .iov_len = len};
+        hdr->frag_off = htonl(*frag);
+
+        *frag += len;
+        if (*frag == desc->len) {
+            *frag = 0;
+            (*f)++;
+        }
+        return iovcnt;
+    }
+
+    uint32_t used = 0;
+    uint16_t count = 0;
+    for (; *f < published; (*f)++) {
+        desc = ring_frame(ring, *f);
+        if (desc->len > cap - used) {
+            break;  // also stops at one that needs fragmenting, it starts a datagram of its own
+        }
+
+        uint8_t *base = ring_ptr(ring, desc->offset);
+        if (iovcnt > 1 && (uint8_t *)iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len == base) {
+            iov[iovcnt - 1].iov_len += desc->len;  // back to back in the ring
+        } else if (iovcnt < MCAST_MAX_IOV) {
+            iov[iovcnt++] = (struct iovec){.iov_base = base, .iov_len = desc->len};
+        } else {
+            break;
+        }
+
+        used += desc->len;
+        count++;
+    }
+
+    hdr->count = htons(count);
+    return iovcnt;
+}
+
+/**
+ * @brief Sends everything published since the last call, MCAST_BATCH datagrams per sendmmsg, until caught up or the
+ * socket buffer is full - in which case the rest waits for EPOLLOUT, and holds its place in the ring meanwhile
+ *
+ * @param m multicast egress
+ * @param loop main event loop
+ * @param ring broadcast ring
+ * @return bool - true if anything was sent, so ring space may have been released
+ */
+bool mcast_pump(mcast_egress *m, ev_loop *loop, const bcast_ring *ring) {
+    if (m->fd == -1 || m->blocked) {
+        return false;
+    }
+
+    uint64_t published = ring_published(ring);
+    bool sent_any = false;
+
+    while (m->frame_cursor < published) {
+        struct mmsghdr msgs[MCAST_BATCH];
+        struct iovec iov[MCAST_BATCH][MCAST_MAX_IOV];
+        mcast_header hdrs[MCAST_BATCH];
+        uint64_t end_frame[MCAST_BATCH];  // where the cursor is once datagram n has gone
+        uint32_t end_frag[MCAST_BATCH];
+
+        uint64_t f = m->frame_cursor;
+        uint32_t frag = m->frag_off;
+        int n = 0;
+        while (n < MCAST_BATCH && f < published) {
+            int iovcnt = mcast_pack(m, ring, published, iov[n], &hdrs[n], &f, &frag);
+            msgs[n] = (struct mmsghdr){.msg_hdr = {.msg_name = &m->group, .msg_namelen = sizeof(m->group),
+                                                   .msg_iov = iov[n], .msg_iovlen = iovcnt}};
+            end_frame[n] = f;
+            end_frag[n] = frag;
+            n++;
+        }
+
+        int sent = sendmmsg(m->fd, msgs, n, 0);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+                // multicast is best effort anyway, subscribers can get whatever this was from the journal
+                fprintf(stderr, "Error sending to multicast group: %s, dropping %d datagrams\n", strerror(errno), n);
+                sent = n;
+            } else {
+                sent = 0;
+            }
+        }
+
+        if (sent > 0) {
+            m->frame_cursor = end_frame[sent - 1];
+            m->frag_off = end_frag[sent - 1];
+            m->datagrams += sent;
+            m->last_sent = time(NULL);
+            sent_any = true;
+        }
+
+        if (sent < n) {
+            m->blocked = true;
+            ev_add(loop, m->fd, EPOLLOUT, &m->fd);
+            break;
+        }
+    }
+
+    return sent_any;
+}
+
+/**
+ * @brief Sends a heartbeat if there has been nothing to send for MCAST_HEARTBEAT seconds
+ */
+void mcast_tick(mcast_egress *m) {
+    time_t now = time(NULL);
+    if (m->fd == -1 || m->blocked || now - m->last_sent < MCAST_HEARTBEAT) {
+        return;
+    }
+
+    mcast_header hdr = {.seq = htobe64(m->frame_cursor), .frag_off = htonl(MCAST_HEARTBEAT_OFF)};
+    sendto(m->fd, &hdr, sizeof(hdr), 0, (struct sockaddr *)&m->group, sizeof(m->group));  // next one will do
+    m->last_sent = now;
+}
+
+bool mcast_owns(const mcast_egress *m, const void *ptr) {
+    const mcast_conn *c = ptr;
+    return m->fd != -1 && (ptr == &m->fd || ptr == &m->listen_fd || (c >= m->conns && c < m->conns + MCAST_MAX_CONNS));
+}
+
+static void accept_conns(mcast_egress *m, ev_loop *loop) {
+    while (true) {
+        int fd = accept(m->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Failed to accept retransmit connection: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        mcast_conn *c = NULL;
+        for (int k = 0; k < MCAST_MAX_CONNS && c == NULL; k++) {
+            if (m->conns[k].fd == -1) {
+                c = &m->conns[k];
+            }
+        }
+
+        if (c == NULL) {
+            close(fd);  // too many at once, the subscriber can retry
+            continue;
+        }
+
+        set_non_block(fd);
+        *c = (mcast_conn){.fd = fd};
+        ev_add(loop, fd, EPOLLIN | EPOLLRDHUP, c);
+    }
+}
+
+/**
+ * @brief Parses a decimal sequence number, digits only
+ *
+ * @return const char* - first character after it, NULL if there are no digits or it doesn't fit in 64 bits
+ */
+static const char *parse_seq(const char *s, uint64_t *seq) {
+    if (*s < '0' || *s > '9') {
+        return NULL;
+    }
+
+    uint64_t value = 0;
+    for (; *s >= '0' && *s <= '9'; s++) {
+        uint64_t digit = *s - '0';
+        if (value > (UINT64_MAX - digit) / 10) {
+            return NULL;
+        }
+        value = value * 10 + digit;
+    }
+
+    *seq = value;
+    return s;
+}
+
+/**
+ * @brief Parses a retransmit request line, "resend=<first>-<last>" or "resend=<first>" for everything from first on
+ *
+ * @param line the line without its newline, a trailing carriage return is allowed
+ * @param first set on success
+ * @param last set on success, MCAST_RESEND_ALL if no end was given
+ * @return int - 0 on success, -1 if it isn't a valid request
+ */
+int mcast_parse_resend(const char *line, uint64_t *first, uint64_t *last) {
+    if (strncmp(line, "resend=", 7) != 0) {
+        return -1;
+    }
+
+    uint64_t from;
+    uint64_t to = MCAST_RESEND_ALL;
+    const char *end = parse_seq(line + 7, &from);
+    if (end != NULL && *end == '-') {
+        end = parse_seq(end + 1, &to);
+        if (end != NULL && (to < from || to >= MCAST_RESEND_ALL)) {
+            return -1;
+        }
+    }
+
+    if (end == NULL || (*end != '\0' && strcmp(end, "\r") != 0)) {
+        return -1;
+    }
+
+    *first = from;
+    *last = to;
+    return 0;
+}
+
+/**
+ * @brief Starts answering the request in the first complete line of c's buffer, if there is one
+ *
+ * @return bool - false if the line isn't a valid request
+ */
+static bool start_resend(mcast_egress *m, mcast_conn *c) {
+    char *nl = memchr(c->ctl, '\n', c->ctl_len);
+    if (nl == NULL) {
+        return c->ctl_len < MCAST_CTL_LEN;
+    }
+    *nl = '\0';
+
+    uint64_t first;
+    uint64_t last;
+    if (mcast_parse_resend(c->ctl, &first, &last) < 0) {
+        fprintf(stderr, "Invalid retransmit request '%s' on fd %d\n", c->ctl, c->fd);
+        return false;
+    }
+
+    uint32_t line_len = nl + 1 - c->ctl;
+    memmove(c->ctl, nl + 1, c->ctl_len - line_len);
+    c->ctl_len -= line_len;
+
+    // anything older than the journal still holds is gone, the reply says where it actually starts
+    uint64_t from = first;
+    uint64_t stop = last + 1;
+    c->pos = c->end = 0;
+    if (journal_locate(m->journal, &from, &c->pos) && from <= last) {
+        if (!journal_locate(m->journal, &stop, &c->end) || stop != last + 1) {
+            c->end = __atomic_load_n(&m->journal->head, __ATOMIC_ACQUIRE);
+        }
+    } else {
+        from = first;
+        c->pos = c->end = 0;
+    }
+
+    c->reply = (mcast_resend_header){.seq = htobe64(from), .len = htobe64(c->end - c->pos)};
+    c->reply_sent = 0;
+    c->sending = true;
+    m->resends++;
+    return true;
+}
+
+/**
+ * @brief Sends as much of the reply in progress as the socket will take
+ *
+ * @return bool - false on a write error, or if the journal was lapped underneath it
+ */
+static bool send_resend(mcast_egress *m, mcast_conn *c) {
+    while (c->reply_sent < sizeof(c->reply)) {
+        // held back for the messages to follow, otherwise Nagle sits on them until the header is acked
+        int more = c->pos < c->end ? MSG_MORE : 0;
+        ssize_t count = send(c->fd, (char *)&c->reply + c->reply_sent, sizeof(c->reply) - c->reply_sent,
+                             MSG_NOSIGNAL | more);
+        if (count < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->reply_sent += count;
+    }
+
+    if (journal_send(m->journal, c->fd, &c->pos, c->end) < 0) {
+        return false;
+    }
+
+    c->sending = c->pos < c->end;
+    return true;
+}
+
+/**
+ * @brief Handles an event for anything multicast egress owns - the socket becoming writable again, the retransmit
+ * listener, or a retransmit connection
+ *
+ * @param m multicast egress
+ * @param loop main event loop
+ * @param event event for one of mcast_owns' pointers
+ * @param ring broadcast ring, for picking up where a full socket left off
+ */
+void mcast_handle(mcast_egress *m, ev_loop *loop, const ev_event *event, const bcast_ring *ring) {
+    if (event->ptr == &m->fd) {
+        m->blocked = false;
+        ev_del(loop, m->fd);
+        mcast_pump(m, loop, ring);
+        return;
+    }
+
+    if (event->ptr == &m->listen_fd) {
+        accept_conns(m, loop);
+        return;
+    }
+
+    mcast_conn *c = event->ptr;
+    if (c->fd == -1) {
+        return;
+    }
+
+    bool ok = true;
+    if (!c->sending && (event->events & (EPOLLIN | EPOLLRDHUP))) {
+        ssize_t count = read(c->fd, c->ctl + c->ctl_len, MCAST_CTL_LEN - c->ctl_len);
+        if (count <= 0) {
+            ok = count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        } else {
+            c->ctl_len += count;
+        }
+    }
+
+    // one request at a time, further ones wait in the buffer until the reply has all gone
+    while (ok) {
+        if (c->sending) {
+            ok = send_resend(m, c);
+            if (c->sending) {
+                break;
+            }
+        }
+
+        ok = ok && start_resend(m, c);
+        if (!c->sending) {
+            break;
+        }
+    }
+
+    if (!ok) {
+        conn_close(loop, c);
+        return;
+    }
+
+    ev_mod(loop, c->fd, c->sending ? EPOLLOUT | EPOLLRDHUP : EPOLLIN | EPOLLRDHUP, c);
+}
@@ -0,0 +1,103 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "event.h"
+#include "journal.h"
+#include "ring.h"
+
+#define MCAST_DEFAULT_DATAGRAM 1472  // fits a 1500 byte Ethernet MTU once the IP and UDP headers are added
+#define MCAST_MIN_DATAGRAM 256
+#define MCAST_MAX_DATAGRAM 65507  // largest UDP payload over IPv4
+#define MCAST_BATCH 64  // datagrams per sendmmsg
+#define MCAST_MAX_IOV 16  // iovecs per datagram, the header and runs of messages adjacent in the ring
+#define MCAST_HEARTBEAT 1  // seconds without anything to send before a heartbeat goes out instead
+#define MCAST_HEARTBEAT_OFF UINT32_MAX  // frag_off of a heartbeat
+#define MCAST_MAX_CONNS 16  // retransmit connections at once
+#define MCAST_CTL_LEN 64  // max length of a retransmit request line, including the newline
+#define MCAST_RESEND_ALL (UINT64_MAX - 1)  // last of a retransmit request that leaves it open ended
+
+/**
+ * @brief Leads every datagram, all fields in network byte order
+ *
+ * A datagram holds count whole CTMP messages, numbered from seq on. A message too big for a datagram of its own is
+ * sent as a run of fragments instead (count 0), each frag_off bytes into message seq. A heartbeat (count 0,
+ * frag_off MCAST_HEARTBEAT_OFF) just says seq is the next message to come, so a receiver can notice it lost the tail
+ * of a burst without waiting for more traffic.
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t seq;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t frag_off;
+} mcast_header;
+
+/**
+ * @brief Reply to a retransmit request, followed by len bytes of whole CTMP messages starting at message seq -
+ * network byte order, and len is 0 if none of the range is still journaled
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t seq;
+    uint64_t len;
+} mcast_resend_header;
+
+/**
+ * @brief A retransmit connection - requests are "resend=<first>-<last>\n" (or just "resend=<first>\n"), answered
+ * one at a time straight from the journal
+ */
+typedef struct {
+    int fd;
+    char ctl[MCAST_CTL_LEN];
+    uint32_t ctl_len;
+    mcast_resend_header reply;
+    uint32_t reply_sent;  // sizeof(reply) once it has all gone
+    uint64_t pos;  // journal offset of the next byte to send
+    uint64_t end;
+    bool sending;
+} mcast_conn;
+
+/**
+ * @brief Multicast egress (-u) - every published message is packed into UDP datagrams sent once to a multicast group,
+ * however many subscribers have joined it, rather than written once per TCP destination.
+ *
+ * It runs on the producer's thread as one more consumer of the broadcast ring, next to the shards. Datagrams are
+ * never retried: a subscriber that sees a gap in the sequence numbers asks for the missing messages over TCP, on the
+ * same port number as the group, and is sent them from the journal (-j).
+ */
+typedef struct {
+    int fd;  // UDP socket, -1 if not enabled
+    struct sockaddr_in group;
+    uint32_t datagram;  // max bytes per datagram, header included
+    uint64_t frame_cursor;  // next frame to send
+    uint32_t frag_off;  // how much of frame_cursor has already gone out, while it is being fragmented
+    bool blocked;  // socket buffer full, waiting on EPOLLOUT
+    time_t last_sent;
+
+    int listen_fd;  // retransmit listener
+    mcast_conn conns[MCAST_MAX_CONNS];
+    const journal *journal;
+
+    uint64_t datagrams;
+    uint64_t resends;
+} mcast_egress;
+
+int mcast_parse_spec(const char *arg, struct sockaddr_in *group, uint32_t *datagram);
+int mcast_parse_resend(const char *line, uint64_t *first, uint64_t *last);
+int mcast_open(mcast_egress *m, ev_loop *loop, const char *ip, const struct sockaddr_in *group, uint32_t datagram,
+               const journal *j, const bcast_ring *ring);
+void mcast_close(mcast_egress *m, ev_loop *loop);
+
+bool mcast_pump(mcast_egress *m, ev_loop *loop, const bcast_ring *ring);
+void mcast_tick(mcast_egress *m);
+
+bool mcast_owns(const mcast_egress *m, const void *ptr);
+void mcast_handle(mcast_egress *m, ev_loop *loop, const ev_event *event, const bcast_ring *ring);
+
+#endif //MCAST_H
@@ -0,0 +1,314 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "metrics.h"
+#include "shard.h"
+
+#define LAT_EXPORT_MAX 24  // exported histogram buckets are powers of two of microseconds, up to ~16s
+
+static int admin_conns[ADMIN_MAX_CONNS] = {[0 ... ADMIN_MAX_CONNS - 1] = -1};
+
+/**
+ * @brief Growable text buffer the exposition is rendered into
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} text_buf;
+
+static void text_printf(text_buf *buf, const char *fmt, ...) {
+    while (true) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+            return;
+        }
+
+        if ((size_t)n < buf->cap - buf->len) {
+            buf->len += n;
+            return;
+        }
+
+        size_t cap = buf->cap ? buf->cap * 2 : 16384;
+        while (cap - buf->len <= (size_t)n) {
+            cap *= 2;
+        }
+
+        char *data = realloc(buf->data, cap);
+        if (data == NULL) {
+            return;  // scrape just comes out truncated
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+}
+
+static void text_family(text_buf *buf, const char *name, const char *type, const char *help) {
+    text_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Upper bound of a latency bucket in microseconds
+ */
+static uint64_t lat_bucket_ceiling(int bucket) {
+    if (bucket < (1 << LAT_SUB_BITS)) {
+        return bucket;
+    }
+
+    int shift = (bucket >> LAT_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1u << LAT_SUB_BITS) - 1);
+    return ((((uint64_t)1 << LAT_SUB_BITS) | sub) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static double lat_quantile(const uint64_t *counts, uint64_t total, double q) {
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) {
+            return lat_bucket_ceiling(b) / 1e6;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Renders every metric in the Prometheus text exposition format
+ */
+static void render(text_buf *buf, const ingress_metrics *in, const shard *shards, int num_shards) {
+    uint64_t paused_since = metric_load(&in->paused_since_us);
+    uint64_t backpressure = metric_load(&in->backpressure_us);
+    if (paused_since != 0) {
+        backpressure += metrics_now_us() - paused_since;  // include the pause still going on
+    }
+
+    text_family(buf, "ctmp_messages_in_total", "counter", "Messages read from the sources and published.");
+    text_printf(buf, "ctmp_messages_in_total %lu\n", metric_load(&in->msgs_in));
+    text_family(buf, "ctmp_bytes_in_total", "counter", "Bytes of published messages, headers included.");
+    text_printf(buf, "ctmp_bytes_in_total %lu\n", metric_load(&in->bytes_in));
+    text_family(buf, "ctmp_header_failures_total", "counter", "Sources disconnected for an invalid header.");
+    text_printf(buf, "ctmp_header_failures_total %lu\n", metric_load(&in->header_failures));
+    text_family(buf, "ctmp_checksum_failures_total", "counter", "Sources disconnected for an invalid checksum.");
+    text_printf(buf, "ctmp_checksum_failures_total %lu\n", metric_load(&in->checksum_failures));
+    text_family(buf, "ctmp_sources_accepted_total", "counter", "Source connections accepted.");
+    text_printf(buf, "ctmp_sources_accepted_total %lu\n", metric_load(&in->sources_accepted));
+    text_family(buf, "ctmp_relay_batches_in_total", "counter", "Batches taken from a relay uplink (-R).");
+    text_printf(buf, "ctmp_relay_batches_in_total %lu\n", metric_load(&in->relay_batches));
+    text_family(buf, "ctmp_backpressure_seconds_total", "counter", "Time the sources have spent paused on a full ring.");
+    text_printf(buf, "ctmp_backpressure_seconds_total %.6f\n", backpressure / 1e6);
+
+    text_family(buf, "ctmp_destinations", "gauge", "Connected destinations.");
+    for (int s = 0; s < num_shards; s++) {
+        text_printf(buf, "ctmp_destinations{shard=\"%d\"} %d\n", s,
+                    __atomic_load_n(&shards[s].num_dsts, __ATOMIC_RELAXED));
+    }
+
+    const chunk_pool *pool = shards[0].pool;
+    text_family(buf, "ctmp_pool_chunks", "gauge", "Destination queue chunks in the buffer pool (-M).");
+    text_printf(buf, "ctmp_pool_chunks %u\n", pool->count);
+    text_family(buf, "ctmp_pool_chunks_free", "gauge", "Chunks not currently borrowed by a destination.");
+    text_printf(buf, "ctmp_pool_chunks_free %u\n", __atomic_load_n(&pool->available, __ATOMIC_RELAXED));
+
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } shard_counters[] = {
+        {"ctmp_messages_out_total", "Messages fully written to a destination, per delivery.",
+         offsetof(egress_metrics, msgs_out)},
+        {"ctmp_bytes_out_total", "Bytes written to destinations.", offsetof(egress_metrics, bytes_out)},
+        {"ctmp_zerocopy_bytes_total", "Bytes written to destinations with MSG_ZEROCOPY (-Z).",
+         offsetof(egress_metrics, zerocopy_bytes)},
+        {"ctmp_relay_batches_out_total", "Batches sent to relay destinations.",
+         offsetof(egress_metrics, relay_batches)},
+        {"ctmp_dropped_messages_total", "Messages dropped by a slow-consumer policy.", offsetof(egress_metrics, drops)},
+        {"ctmp_destination_timeouts_total", "Destinations closed for stalling.", offsetof(egress_metrics, timeouts)},
+    };
+
+    for (size_t c = 0; c < sizeof(shard_counters) / sizeof(shard_counters[0]); c++) {
+        text_family(buf, shard_counters[c].name, "counter", shard_counters[c].help);
+        for (int s = 0; s < num_shards; s++) {
+            const uint64_t *counter = (const uint64_t *)((const char *)&shards[s].metrics + shard_counters[c].offset);
+            text_printf(buf, "%s{shard=\"%d\"} %lu\n", shard_counters[c].name, s, metric_load(counter));
+        }
+    }
+
+    // destinations may come and go while this runs - slots never move or get freed, so the worst case is a series
+    // that is a moment stale
+    static const char *const dst_families[][3] = {
+        {"ctmp_dst_queue_depth", "gauge", "Messages queued for a destination."},
+        {"ctmp_dst_bytes_out_total", "counter", "Bytes written to a destination."},
+        {"ctmp_dst_dropped_messages_total", "counter", "Messages dropped for a destination by its policy."},
+    };
+
+    for (int f = 0; f < 3; f++) {
+        text_family(buf, dst_families[f][0], dst_families[f][1], dst_families[f][2]);
+
+        for (int s = 0; s < num_shards; s++) {
+            int num_active = __atomic_load_n(&shards[s].num_active, __ATOMIC_RELAXED);
+
+            for (int j = 0; j < num_active; j++) {
+                const dst_client *dst = __atomic_load_n(&shards[s].active[j], __ATOMIC_RELAXED);
+                int fd = __atomic_load_n(&dst->fd, __ATOMIC_RELAXED);
+                if (fd == -1) {
+                    continue;
+                }
+
+                uint64_t value;
+                if (f == 0) {
+                    value = 0;
+                    for (int l = 0; l < DST_LANES; l++) {
+                        value += __atomic_load_n(&dst->head[l], __ATOMIC_RELAXED)
+                                 - __atomic_load_n(&dst->tail[l], __ATOMIC_RELAXED);
+                    }
+                } else {
+                    value = metric_load(f == 1 ? &dst->bytes_out : &dst->drops);
+                }
+
+                text_printf(buf, "%s{shard=\"%d\",fd=\"%d\",policy=\"%s\"} %lu\n", dst_families[f][0], s, fd,
+                            dst_policy_name(dst->policy), value);
+            }
+        }
+    }
+
+    // latency is merged across shards, exported both as a coarse cumulative histogram and as quantiles from the
+    // full resolution one
+    static uint64_t counts[LAT_BUCKETS];  // only ever touched from the main thread
+    uint64_t total = 0, sum_us = 0;
+    memset(counts, 0, sizeof(counts));
+    for (int s = 0; s < num_shards; s++) {
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            counts[b] += metric_load(&shards[s].metrics.latency.counts[b]);
+        }
+        sum_us += metric_load(&shards[s].metrics.latency.sum_us);
+    }
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        total += counts[b];
+    }
+
+    text_family(buf, "ctmp_latency_seconds", "histogram", "Time from a message being read to being written out.");
+    uint64_t cumulative = 0;
+    int b = 0;
+    for (int e = 0; e <= LAT_EXPORT_MAX; e++) {
+        uint64_t le = (uint64_t)1 << e;
+        for (; b < LAT_BUCKETS && lat_bucket_ceiling(b) < le; b++) {
+            cumulative += counts[b];
+        }
+        text_printf(buf, "ctmp_latency_seconds_bucket{le=\"%g\"} %lu\n", le / 1e6, cumulative);
+    }
+    text_printf(buf, "ctmp_latency_seconds_bucket{le=\"+Inf\"} %lu\n", total);
+    text_printf(buf, "ctmp_latency_seconds_sum %.6f\n", sum_us / 1e6);
+    text_printf(buf, "ctmp_latency_seconds_count %lu\n", total);
+
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    text_family(buf, "ctmp_latency_quantile_seconds", "gauge", "Latency quantiles, bucket upper bounds.");
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        text_printf(buf, "ctmp_latency_quantile_seconds{quantile=\"%g\"} %.6f\n", quantiles[q],
+                    lat_quantile(counts, total, quantiles[q]));
+    }
+}
+
+bool metrics_admin_owns(const void *ptr) {
+    const int *conn = ptr;
+    return conn >= admin_conns && conn < admin_conns + ADMIN_MAX_CONNS;
+}
+
+/**
+ * @brief Accepts pending scrapes on the admin listener, each is answered once its request arrives
+ *
+ * @param loop main event loop
+ * @param listen_fd admin listener
+ */
+void metrics_admin_accept(ev_loop *loop, int listen_fd) {
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Failed to accept admin connection: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        int slot = 0;
+        while (slot < ADMIN_MAX_CONNS && admin_conns[slot] != -1) {
+            slot++;
+        }
+
+        if (slot == ADMIN_MAX_CONNS) {
+            close(fd);  // too many scrapes at once, let the scraper retry
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        admin_conns[slot] = fd;
+        ev_add(loop, fd, EPOLLIN | EPOLLRDHUP, &admin_conns[slot]);
+    }
+}
+
+static void admin_close(ev_loop *loop, int *conn) {
+    ev_del(loop, *conn);
+    close(*conn);
+    *conn = -1;
+}
+
+/**
+ * @brief Answers a scrape as soon as the request shows up. Whatever was asked for, the reply is the full exposition
+ * over HTTP/1.0 - so curl, a Prometheus scraper, or just nc, all work.
+ */
+void metrics_admin_handle(ev_loop *loop, const ev_event *event, const ingress_metrics *in,
+                          const shard *shards, int num_shards) {
+    int *conn = event->ptr;
+    if (*conn == -1) {
+        return;
+    }
+
+    char request[4096];
+    if (read(*conn, request, sizeof(request)) <= 0) {
+        admin_close(loop, conn);
+        return;
+    }
+
+    text_buf body = {0};
+    render(&body, in, shards, num_shards);
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                              body.len);
+
+    // the scrape is small and the socket fresh, so it all goes in one go unless the scraper is misbehaving - in
+    // which case it just gets a short response rather than holding up the loop
+    struct iovec iov[2] = {{.iov_base = header, .iov_len = header_len}, {.iov_base = body.data, .iov_len = body.len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    if (sendmsg(*conn, &msg, MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "Failed to write metrics to admin connection: %s\n", strerror(errno));
+    }
+
+    free(body.data);
+    shutdown(*conn, SHUT_WR);
+    admin_close(loop, conn);
+}
+
+void metrics_admin_close_all(ev_loop *loop) {
+    for (int slot = 0; slot < ADMIN_MAX_CONNS; slot++) {
+        if (admin_conns[slot] != -1) {
+            admin_close(loop, &admin_conns[slot]);
+        }
+    }
+}
@@ -0,0 +1,100 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "event.h"
+
+#define LAT_SUB_BITS 4  // log-linear, 16 sub-buckets per power of two - within ~6% of the true value
+#define LAT_BUCKETS (32 << LAT_SUB_BITS)  // microseconds, 2^32 us (~71 minutes) is the most a 32 bit stamp can show
+#define ADMIN_MAX_CONNS 8  // concurrent scrapes
+
+/**
+ * @brief HDR style latency histogram in microseconds
+ *
+ * Every counter in this file has exactly one writer (the main thread, or the thread running a shard), so updates are
+ * plain relaxed stores rather than locked adds - on x86 no more than an ordinary increment. The admin socket reads
+ * them from the main thread with relaxed loads, which may see a scrape that is a moment out of date, never a torn one.
+ */
+typedef struct {
+    uint64_t counts[LAT_BUCKETS];
+    uint64_t sum_us;
+} lat_hist;
+
+/**
+ * @brief What the producer (main thread) sees of the source
+ */
+typedef struct {
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t header_failures;
+    uint64_t checksum_failures;
+    uint64_t sources_accepted;
+    uint64_t relay_batches;  // taken from a relay uplink (-R), their messages are in msgs_in as usual
+    uint64_t backpressure_us;  // total time the sources have spent paused on a full ring
+    uint64_t paused_since_us;  // when the current pause started, 0 if not paused
+} ingress_metrics;
+
+/**
+ * @brief What one shard has written out, summed over its destinations
+ */
+typedef struct {
+    uint64_t msgs_out;  // message deliveries, so one message to 3 destinations counts 3
+    uint64_t bytes_out;
+    uint64_t zerocopy_bytes;  // of bytes_out, sent with MSG_ZEROCOPY (-Z)
+    uint64_t relay_batches;  // envelopes sent to relay destinations
+    uint64_t drops;
+    uint64_t timeouts;
+    lat_hist latency;  // ingress (read from the source) to egress (fully handed to a destination's socket)
+} egress_metrics;
+
+static inline void metric_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);  // single writer, so no need for a locked add
+}
+
+static inline uint64_t metric_load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Monotonic time in microseconds
+ */
+static inline uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline int lat_bucket(uint32_t us) {
+    if (us < (1u << LAT_SUB_BITS)) {
+        return (int)us;
+    }
+
+    int shift = 31 - __builtin_clz(us) - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) + (int)((us >> shift) & ((1u << LAT_SUB_BITS) - 1));
+}
+
+static inline void lat_record_n(lat_hist *hist, uint32_t us, uint32_t n) {
+    metric_add(&hist->counts[lat_bucket(us)], n);
+    metric_add(&hist->sum_us, (uint64_t)us * n);
+}
+
+static inline void lat_record(lat_hist *hist, uint32_t us) {
+    lat_record_n(hist, us, 1);
+}
+
+struct shard;
+
+bool metrics_admin_owns(const void *ptr);
+void metrics_admin_accept(ev_loop *loop, int listen_fd);
+void metrics_admin_handle(ev_loop *loop, const ev_event *event, const ingress_metrics *in,
+                          const struct shard *shards, int num_shards);
+void metrics_admin_close_all(ev_loop *loop);
+
+#endif //METRICS_H
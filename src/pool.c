@@ -0,0 +1,103 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+/**
+ * @brief Maps and populates count chunks of chunk_size bytes, so borrowing one later never page faults
+ *
+ * @param pool pool to set up
+ * @param chunk_size bytes per chunk, a multiple of the cache line size
+ * @param count chunks, at least one
+ * @param huge try to back the pool with hugepages, falling back to ordinary pages (with a warning) if there aren't
+ * enough reserved
+ * @return int - 0 on success, -1 on failure
+ */
+int pool_init(chunk_pool *pool, size_t chunk_size, uint32_t count, bool huge) {
+    *pool = (chunk_pool){.chunk_size = chunk_size, .count = count, .available = count};
+    size_t bytes = chunk_size * count;
+
+    pool->base = MAP_FAILED;
+    if (huge) {
+        pool->map_size = (bytes + POOL_HUGE_PAGE - 1) / POOL_HUGE_PAGE * POOL_HUGE_PAGE;
+        pool->base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (pool->base == MAP_FAILED) {
+            fprintf(stderr, "WARNING: No hugepages for the %zu byte buffer pool (%s), using ordinary pages\n",
+                    pool->map_size, strerror(errno));
+        }
+    }
+
+    pool->huge = pool->base != MAP_FAILED;
+    if (!pool->huge) {
+        pool->map_size = bytes;
+        pool->base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    }
+
+    pool->next = malloc(count * sizeof(uint32_t));
+    if (pool->base == MAP_FAILED || pool->next == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate %zu byte buffer pool: %s\n", bytes, strerror(errno));
+        if (pool->base == MAP_FAILED) {
+            pool->base = NULL;
+        }
+        pool_free(pool);
+        return -1;
+    }
+
+    // chunk i links to chunk i + 1, so they are handed out from the start of the region first
+    for (uint32_t i = 0; i < count; i++) {
+        pool->next[i] = i + 2 <= count ? i + 2 : 0;
+    }
+    pool->top = 1;
+
+    return 0;
+}
+
+void pool_free(chunk_pool *pool) {
+    if (pool->base != NULL) {
+        munmap(pool->base, pool->map_size);
+    }
+    free(pool->next);
+    *pool = (chunk_pool){0};
+}
+
+/**
+ * @brief Borrows a chunk
+ *
+ * @return void* - NULL if the pool is exhausted
+ */
+void *pool_get(chunk_pool *pool) {
+    uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+    uint64_t new_top;
+
+    do {
+        uint32_t idx = (uint32_t)top;
+        if (idx == 0) {
+            return NULL;
+        }
+        new_top = ((top >> 32) + 1) << 32 | __atomic_load_n(&pool->next[idx - 1], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->top, &top, new_top, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    __atomic_sub_fetch(&pool->available, 1, __ATOMIC_RELAXED);
+    return pool->base + ((uint32_t)top - 1) * pool->chunk_size;
+}
+
+void pool_put(chunk_pool *pool, void *chunk) {
+    uint32_t idx = ((uint8_t *)chunk - pool->base) / pool->chunk_size;
+    uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+    uint64_t new_top;
+
+    do {
+        __atomic_store_n(&pool->next[idx], (uint32_t)top, __ATOMIC_RELAXED);
+        new_top = ((top >> 32) + 1) << 32 | (idx + 1);
+    } while (!__atomic_compare_exchange_n(&pool->top, &top, new_top, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_add_fetch(&pool->available, 1, __ATOMIC_RELAXED);
+}
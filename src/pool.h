@@ -0,0 +1,39 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_DEFAULT_BUDGET (1u << 24)  // 16 MiB of chunks unless -M says otherwise
+#define POOL_HUGE_PAGE (1u << 21)
+
+/**
+ * @brief Fixed-size chunks carved out of one region mapped (and populated) up front, shared by every shard
+ *
+ * The free list is a lock-free stack of chunk indices. Its top carries a tag bumped on every change alongside the
+ * index, so a pop racing with a pop and push of the same chunk fails its compare-and-swap rather than corrupting the
+ * list. Chunks are never unmapped while the pool is in use, so reading a link that is already stale is harmless.
+ */
+typedef struct {
+    uint8_t *base;
+    size_t map_size;
+    size_t chunk_size;
+    uint32_t count;
+    uint32_t *next;  // free list links, index + 1 of the next free chunk, 0 at the end
+    uint64_t top;  // atomic, tag << 32 | index + 1 of the first free chunk, 0 index when empty
+    uint32_t available;  // atomic, free chunks, only for metrics and logging
+    bool huge;  // backed by hugepages
+} chunk_pool;
+
+int pool_init(chunk_pool *pool, size_t chunk_size, uint32_t count, bool huge);
+void pool_free(chunk_pool *pool);
+
+void *pool_get(chunk_pool *pool);
+void pool_put(chunk_pool *pool, void *chunk);
+
+#endif //POOL_H
@@ -0,0 +1,237 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include "relay.h"
+
+/**
+ * @brief Fills in the envelope for a batch about to be sent, checksumming it where it lies rather than gathering it
+ *
+ * @param header envelope to fill
+ * @param seq batch number on the link
+ * @param msgs whole messages in the batch
+ * @param iov the batch, as it is about to be written
+ * @param iovcnt number of iovecs
+ * @param len total bytes in iov, at most RELAY_MAX_BODY
+ */
+void relay_seal(relay_header *header, uint32_t seq, uint16_t msgs, const struct iovec *iov, int iovcnt, size_t len) {
+    *header = (relay_header){.magic = RELAY_MAGIC, .msgs = htons(msgs), .len = htonl(len), .seq = htonl(seq)};
+
+    ctmp_csum sum = {0};
+    ctmp_csum_update(&sum, (const uint8_t *)header, sizeof(*header));  // checksum still 0
+    for (int k = 0; k < iovcnt; k++) {
+        ctmp_csum_update(&sum, iov[k].iov_base, iov[k].iov_len);  // odd lengths are fine, see ctmp_csum_update
+    }
+
+    header->checksum = htons(ctmp_csum_final(&sum));
+}
+
+/**
+ * @brief Advances the framer over the unconsumed bytes at the front of a relay link
+ *
+ * @param rf parser state, zeroed for a fresh link
+ * @param data first unconsumed byte, i.e. the start of the front batch's envelope
+ * @param avail number of bytes available from data onwards
+ * @return relay_status - RELAY_BATCH_READY once rf->frame_len bytes at data make up a complete, intact batch
+ */
+relay_status relay_framer_feed(relay_framer *rf, const uint8_t *data, size_t avail) {
+    if (rf->verified) {
+        return RELAY_BATCH_READY;
+    }
+
+    const relay_header *header = (const relay_header *)data;
+
+    if (rf->frame_len == 0) {
+        if (avail < sizeof(relay_header)) {
+            return RELAY_NEED_MORE;
+        }
+
+        uint32_t len = ntohl(header->len);
+        if (header->magic != RELAY_MAGIC || header->rpad != 0 || header->cpad != 0 || header->msgs == 0
+            || len < sizeof(ctmp_header) || len > RELAY_MAX_BODY) {
+            return RELAY_BAD_HEADER;
+        }
+
+        if (ntohl(header->seq) != rf->seq) {
+            return RELAY_BAD_SEQ;
+        }
+
+        relay_header blank = *header;
+        blank.checksum = 0;
+        ctmp_csum_update(&rf->csum, (const uint8_t *)&blank, sizeof(blank));
+        rf->frame_len = sizeof(relay_header) + len;
+    }
+
+    // csum.len counts the envelope too, so it is exactly where the body summed so far ends
+    size_t in_frame = avail < rf->frame_len ? avail : rf->frame_len;
+    ctmp_csum_update(&rf->csum, data + rf->csum.len, in_frame - rf->csum.len);
+
+    if (in_frame < rf->frame_len) {
+        return RELAY_NEED_MORE;
+    }
+
+    if (ctmp_csum_final(&rf->csum) != ntohs(header->checksum)) {
+        return RELAY_BAD_CHECKSUM;
+    }
+
+    // the sender vouches for every message, but they still have to tile the body or the stream loses its framing
+    size_t off = sizeof(relay_header);
+    uint32_t msgs = 0;
+    while (off < rf->frame_len) {
+        if (rf->frame_len - off < sizeof(ctmp_header)) {
+            return RELAY_BAD_BODY;
+        }
+
+        off += relay_frame_len(data + off);
+        msgs++;
+    }
+
+    if (off != rf->frame_len || msgs != ntohs(header->msgs)) {
+        return RELAY_BAD_BODY;
+    }
+
+    rf->verified = true;
+    return RELAY_BATCH_READY;
+}
+
+/**
+ * @brief Parses where to connect the uplink to, as given to -R
+ *
+ * @param arg ip:port, or unix:/path for a destination listener on a unix socket
+ * @param up uplink to set the address of
+ * @return int - 0 on success, -1 if it isn't a valid address
+ */
+int relay_parse_spec(const char *arg, relay_uplink *up) {
+    *up = (relay_uplink){.fd = -1};
+
+    const char *path = endpoint_unix_path(arg);
+    if (path != NULL) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&up->addr;
+        if (*path == '\0' || strlen(path) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        up->addr_len = sizeof(*un);
+    } else {
+        char spec[64];
+        if (snprintf(spec, sizeof(spec), "%s", arg) >= (int)sizeof(spec)) {
+            return -1;
+        }
+
+        char *port = strrchr(spec, ':');
+        if (port == NULL) {
+            return -1;
+        }
+        *port++ = '\0';
+
+        struct sockaddr_in *in = (struct sockaddr_in *)&up->addr;
+        int port_num = atoi(port);
+        if (inet_pton(AF_INET, spec, &in->sin_addr) <= 0 || port_num <= 0 || port_num > UINT16_MAX) {
+            return -1;
+        }
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port_num);
+        up->addr_len = sizeof(*in);
+    }
+
+    snprintf(up->peer, sizeof(up->peer), "%s", arg);
+    return 0;
+}
+
+static void relay_uplink_failed(relay_uplink *up, int err) {
+    if (!up->warned) {
+        fprintf(stderr, "Relay uplink to %s unavailable (%s), retrying every %d second(s)\n", up->peer, strerror(err),
+                RELAY_RETRY);
+        up->warned = true;
+    }
+}
+
+/**
+ * @brief Starts connecting the uplink if it's down and it has been long enough since the last attempt, called once per
+ * loop iteration
+ *
+ * @param up uplink, from relay_parse_spec
+ * @param loop loop to wait for the connection on
+ * @param linked whether a source connected through the uplink is still up
+ */
+void relay_uplink_tick(relay_uplink *up, ev_loop *loop, bool linked) {
+    if (linked || up->fd != -1) {
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (now < up->retry_at) {
+        return;
+    }
+    up->retry_at = now + RELAY_RETRY;
+
+    int fd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        relay_uplink_failed(up, errno);
+        return;
+    }
+
+    if (connect(fd, (const struct sockaddr *)&up->addr, up->addr_len) < 0 && errno != EINPROGRESS) {
+        relay_uplink_failed(up, errno);
+        close(fd);
+        return;
+    }
+
+    up->fd = fd;
+    ev_add(loop, fd, EPOLLOUT, up);  // writable once connected, either way
+}
+
+bool relay_uplink_owns(const relay_uplink *up, const void *ptr) {
+    return ptr == up;
+}
+
+/**
+ * @brief Finishes connecting the uplink and asks for batches
+ *
+ * @param up uplink with a connection in progress
+ * @param loop loop it was waiting on
+ * @return int - the connected socket, for the caller to take on as a source, -1 if the attempt failed
+ */
+int relay_uplink_handle(relay_uplink *up, ev_loop *loop) {
+    int fd = up->fd;
+    ev_del(loop, fd);
+    up->fd = -1;
+
+    int soerr = 0;
+    socklen_t len = sizeof(soerr);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0) {
+        soerr = errno;
+    }
+
+    // a fresh connection always has room for one control line
+    if (soerr == 0 && send(fd, RELAY_CTL, strlen(RELAY_CTL), MSG_NOSIGNAL) != (ssize_t)strlen(RELAY_CTL)) {
+        soerr = errno;
+    }
+
+    if (soerr != 0) {
+        relay_uplink_failed(up, soerr);
+        close(fd);
+        return -1;
+    }
+
+    up->warned = false;
+    return fd;
+}
+
+void relay_uplink_close(relay_uplink *up, ev_loop *loop) {
+    if (up->fd != -1) {
+        ev_del(loop, up->fd);
+        close(up->fd);
+        up->fd = -1;
+    }
+}
@@ -0,0 +1,103 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "ctmp.h"
+#include "event.h"
+#include "listener.h"
+
+#define RELAY_MAGIC 0xCD  // first byte of an envelope, never the first byte of a CTMP message
+#define RELAY_MAX_BODY (CTMP_HEADER_SIZE + UINT16_MAX)  // a batch never holds more than one max size message's worth
+#define RELAY_RETRY 1  // seconds between attempts to (re)connect the uplink
+#define RELAY_CTL "relay=on\n"  // sent up the uplink as soon as it connects
+
+/**
+ * @brief Leads every batch on a relay link, all fields in network byte order
+ *
+ * Followed by len bytes of msgs whole CTMP messages, each of which has already been validated by the proxy sending
+ * it. checksum is the same one's complement sum CTMP uses, taken over this header (checksum as 0) and the whole body,
+ * and seq counts batches on the link from 0, so a lost or repeated batch shows up as well as a corrupted one.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t magic;
+    uint8_t rpad;
+    uint16_t msgs;
+    uint32_t len;
+    uint32_t seq;
+    uint16_t checksum;
+    uint16_t cpad;
+} relay_header;
+
+typedef enum {
+    RELAY_NEED_MORE = 0,  // front batch is incomplete (or not even a full header yet)
+    RELAY_BATCH_READY,  // front batch is complete and intact, frame_len bytes long including the envelope
+    RELAY_BAD_HEADER,
+    RELAY_BAD_SEQ,
+    RELAY_BAD_CHECKSUM,
+    RELAY_BAD_BODY  // intact, but the messages in it don't add up to it
+} relay_status;
+
+/**
+ * @brief Streaming parser for the batches coming in on a relay link, the envelope counterpart of ctmp_framer
+ *
+ * The body is summed as it arrives, and once the batch is complete its messages are only walked to check they fill it
+ * exactly - none of their headers or checksums are looked at again. relay_framer_open then steps over the envelope,
+ * and the caller takes the messages one at a time with relay_frame_len until left reaches 0.
+ *
+ * A link may start with plain CTMP messages, the ones the upstream proxy sent before it read the relay line, so the
+ * caller treats the stream as such until batched is set by the first envelope.
+ */
+typedef struct {
+    size_t frame_len;  // envelope + body of the front batch, 0 until its header has been validated
+    bool verified;
+    ctmp_csum csum;  // running sum of the front batch, envelope first
+    uint32_t seq;  // batch expected next
+    uint32_t left;  // bytes of the opened batch still to be taken
+    bool batched;
+} relay_framer;
+
+void relay_seal(relay_header *header, uint32_t seq, uint16_t msgs, const struct iovec *iov, int iovcnt, size_t len);
+relay_status relay_framer_feed(relay_framer *rf, const uint8_t *data, size_t avail);
+
+static inline void relay_framer_open(relay_framer *rf) {
+    rf->left = rf->frame_len - sizeof(relay_header);
+    rf->seq++;
+    rf->frame_len = 0;
+    rf->verified = false;
+    rf->csum = (ctmp_csum){0};
+}
+
+static inline size_t relay_frame_len(const uint8_t *msg) {
+    return sizeof(ctmp_header) + ntohs(((const ctmp_header *)msg)->length);
+}
+
+/**
+ * @brief The downstream end of a relay link (-R) - this proxy connects out to another proxy's destination port,
+ * asks for batches with RELAY_CTL, and takes what comes back as one of its sources, reconnecting every RELAY_RETRY
+ * seconds whenever it isn't connected
+ */
+typedef struct {
+    int fd;  // only while connecting, the connection becomes a source once it's up
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char peer[PEER_STR_LEN];
+    time_t retry_at;
+    bool warned;  // failed attempts are only reported until one succeeds
+} relay_uplink;
+
+int relay_parse_spec(const char *arg, relay_uplink *up);
+void relay_uplink_tick(relay_uplink *up, ev_loop *loop, bool linked);
+bool relay_uplink_owns(const relay_uplink *up, const void *ptr);
+int relay_uplink_handle(relay_uplink *up, ev_loop *loop);
+void relay_uplink_close(relay_uplink *up, ev_loop *loop);
+
+#endif //RELAY_H
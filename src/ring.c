@@ -0,0 +1,120 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#define _GNU_SOURCE  // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ring.h"
+
+/**
+ * @brief Maps a "magic" ring buffer - size bytes of memory mapped twice, back to back, so that base[i] and
+ * base[i + size] are the same byte. Anything starting inside the first copy can be read or written as one contiguous
+ * run of up to size bytes, no matter where the wrap falls.
+ *
+ * @param size bytes, must be a multiple of the page size
+ * @return uint8_t* - base of the 2 * size byte mapping, NULL on failure
+ */
+uint8_t *ring_map_mirrored(size_t size) {
+    int fd = memfd_create("ctmp-ring", MFD_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: memfd_create failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        fprintf(stderr, "ERROR: Failed to size ring memfd: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    // reserve the whole span first so nothing else can land in between the two halves
+    uint8_t *base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Failed to reserve ring mapping: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Failed to mirror ring mapping: %s\n", strerror(errno));
+        munmap(base, 2 * size);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);  // the mappings keep the memory alive
+    return base;
+}
+
+void ring_unmap_mirrored(uint8_t *base, size_t size) {
+    if (base != NULL) {
+        munmap(base, 2 * size);
+    }
+}
+
+/**
+ * @brief Allocates the (mirrored) backing storage for the broadcast ring
+ *
+ * @param ring ring to initialise
+ * @return int - 0 on success, -1 on allocation failure
+ */
+int ring_init(bcast_ring *ring) {
+    *ring = (bcast_ring){.wake_fd = -1};
+
+    ring->data = ring_map_mirrored(RING_SIZE);
+    ring->frames = malloc(RING_FRAMES * sizeof(frame_desc));
+    if (ring->data == NULL || ring->frames == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate %d byte broadcast ring\n", RING_SIZE);
+        ring_free(ring);
+        return -1;
+    }
+
+    return 0;
+}
+
+void ring_free(bcast_ring *ring) {
+    ring_unmap_mirrored(ring->data, RING_SIZE);
+    free(ring->frames);
+    ring->data = NULL;
+    ring->frames = NULL;
+}
+
+/**
+ * @brief Appends a message to the ring and publishes it to the shards, caller must already have checked
+ * ring_has_space
+ *
+ * @param ring ring to write into
+ * @param msg complete CTMP message (header + payload)
+ * @param len length of the message
+ * @param stamp_us when the message was read, carried along for the latency metrics
+ */
+void ring_publish(bcast_ring *ring, const uint8_t *msg, size_t len, uint32_t stamp_us) {
+    uint64_t offset = ring->head;
+
+    memcpy(ring_ptr(ring, offset), msg, len);  // mirrored, so never needs splitting at the wrap
+    ring->head += len;
+    ring->frames[ring->frame_head & (RING_FRAMES - 1)] = (frame_desc){.offset = offset, .len = len, .stamp_us = stamp_us};
+
+    // data and descriptor must be visible before a shard can see the new head
+    __atomic_store_n(&ring->frame_head, ring->frame_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Called by a shard after it has released space, wakes the producer if it stalled on a full ring
+ *
+ * @param ring ring the shard consumes from
+ */
+void ring_wake_producer(bcast_ring *ring) {
+    if (ring->wake_fd != -1 && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(ring->wake_fd, &one, sizeof(one)) < 0) {
+            // eventfd counter can't realistically overflow, and a missed wake is covered by the poll timeout
+        }
+    }
+}
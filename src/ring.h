@@ -0,0 +1,86 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_SIZE (1 << 22)  // 4 MiB, must be a power of two and hold at least one max size CTMP message
+#define RING_MASK (RING_SIZE - 1)
+#define RING_FRAMES (1 << 14)  // max messages in the ring at once, must be a power of two
+#define CACHE_LINE 64  // state written by one thread and read by another is kept apart at this granularity
+
+/**
+ * @brief Describes one complete message sitting in the ring, these are what get queued per destination
+ */
+typedef struct {
+    uint64_t offset;  // absolute ring offset of the header
+    uint32_t len;  // header + payload
+    uint32_t stamp_us;  // when it was read from the source, truncated - only ever used for differences
+} frame_desc;
+
+/**
+ * @brief Shared broadcast ring - every complete message is written into it exactly once, destinations then only
+ * queue descriptors (offset + length) of the messages they still have to write.
+ *
+ * Offsets are absolute (monotonically increasing, never wrapped), and the buffer is a mirrored mapping, so a
+ * message is always contiguous in memory and wrap-around never has to be handled at all.
+ *
+ * The ring is also the single producer/multi consumer queue between the thread parsing the source and the
+ * destination shards (see shard.h): the producer writes the data and a frame_desc, then publishes frame_head with
+ * release semantics. Shards consume frames in order and report back how far they have got, which is what tail and
+ * frame_tail are recomputed from when the ring looks full.
+ */
+typedef struct {
+    uint8_t *data;
+    frame_desc *frames;
+
+    uint64_t head;  // producer only, one past the newest byte written
+    uint64_t tail;  // producer only, oldest byte a shard may still need
+    uint64_t frame_tail;  // producer only, oldest frame a shard has yet to fan out
+
+    // polled by every shard, so it gets a line of its own rather than bouncing each time head or tail moves
+    uint64_t frame_head __attribute__((aligned(CACHE_LINE)));  // atomic, next frame sequence to be published
+
+    int waiting __attribute__((aligned(CACHE_LINE)));  // atomic, set by the producer when it stalls on a full ring
+    int wake_fd;  // eventfd shards poke once they've freed space for a waiting producer, -1 when single threaded
+} bcast_ring;
+
+uint8_t *ring_map_mirrored(size_t size);
+void ring_unmap_mirrored(uint8_t *base, size_t size);
+
+int ring_init(bcast_ring *ring);
+void ring_free(bcast_ring *ring);
+
+/**
+ * @brief Whether a message of len bytes can currently be published without overwriting anything still needed
+ */
+static inline bool ring_has_space(const bcast_ring *ring, size_t len) {
+    return RING_SIZE - (size_t)(ring->head - ring->tail) >= len
+           && ring->frame_head - ring->frame_tail < RING_FRAMES;
+}
+
+void ring_publish(bcast_ring *ring, const uint8_t *msg, size_t len, uint32_t stamp_us);
+void ring_wake_producer(bcast_ring *ring);
+
+static inline uint64_t ring_published(const bcast_ring *ring) {
+    return __atomic_load_n(&ring->frame_head, __ATOMIC_ACQUIRE);
+}
+
+static inline const frame_desc *ring_frame(const bcast_ring *ring, uint64_t seq) {
+    return &ring->frames[seq & (RING_FRAMES - 1)];
+}
+
+/**
+ * @brief Address of an absolute offset - the data is mapped twice back to back (see ring_map_mirrored), so anything
+ * up to RING_SIZE bytes from here is contiguous even across the wrap
+ */
+static inline uint8_t *ring_ptr(const bcast_ring *ring, uint64_t offset) {
+    return ring->data + (offset & RING_MASK);
+}
+
+#endif //RING_H
@@ -0,0 +1,963 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "cpu.h"
+#include "shard.h"
+
+/**
+ * @brief Sets up a shard, either sharing the caller's event loop (single threaded) or creating its own for a worker
+ *
+ * @param sh shard to initialise
+ * @param id index, only used for logging
+ * @param max_dsts destinations this shard may own
+ * @param ring broadcast ring to consume from
+ * @param loop loop to share, or NULL to create one of the given backend for a worker thread
+ * @param backend backend for the worker's own loop
+ * @return int - 0 on success, -1 on failure
+ */
+int shard_init(shard *sh, int id, int max_dsts, bcast_ring *ring, ev_loop *loop, ev_backend backend) {
+    *sh = (shard){.id = id, .ring = ring, .max_dsts = max_dsts, .wake_fd = -1, .threaded = loop == NULL,
+                  .cpu = -1, .policy = DST_POLICY_BLOCK, .hwm = DST_DEFAULT_HWM};
+
+    // start from whatever is already published, a new shard has no destinations that could want older frames
+    sh->frame_cursor = sh->released_frame = ring_published(ring);
+    sh->fanned = sh->released = ring->head;
+
+    // only the bookkeeping is sized up front, the dst_client slots themselves come as they are needed
+    sh->chunks = calloc((max_dsts + DST_CHUNK - 1) / DST_CHUNK, sizeof(dst_client *));
+    sh->active = malloc(max_dsts * sizeof(dst_client *));
+    sh->free_slots = malloc(max_dsts * sizeof(dst_client *));
+    sh->incoming = malloc(max_dsts * sizeof(int));
+    sh->writes = malloc(SHARD_IO_BATCH * sizeof(dst_write));
+    if (sh->chunks == NULL || sh->active == NULL || sh->free_slots == NULL || sh->incoming == NULL
+        || sh->writes == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate destination table for shard %d\n", id);
+        return -1;
+    }
+
+    timer_wheel_init(&sh->wheel, time(NULL));
+
+    pthread_mutex_init(&sh->lock, NULL);
+
+    if (!sh->threaded) {
+        sh->loop = loop;
+        return 0;
+    }
+
+    sh->loop = ev_create(backend);
+    sh->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (sh->loop == NULL || sh->wake_fd == -1) {
+        fprintf(stderr, "ERROR: Failed to create event loop for shard %d: %s\n", id, strerror(errno));
+        return -1;
+    }
+
+    ev_add(sh->loop, sh->wake_fd, EPOLLIN, &sh->wake_fd);
+
+    return 0;
+}
+
+/**
+ * @brief Takes a free destination slot, allocating another chunk of them if none are left
+ *
+ * @return dst_client* - NULL if out of memory (the caller has already checked max_dsts)
+ */
+static dst_client *shard_alloc_slot(shard *sh) {
+    if (sh->free_head == sh->free_tail) {
+        dst_client *chunk = aligned_alloc(CACHE_LINE, DST_CHUNK * sizeof(dst_client));
+        if (chunk == NULL) {
+            return NULL;
+        }
+        sh->chunks[sh->num_chunks++] = chunk;
+
+        // the last chunk may be partly unused, if max_dsts isn't a multiple of DST_CHUNK
+        int slots = sh->max_dsts - (sh->num_chunks - 1) * DST_CHUNK;
+        for (int j = 0; j < slots && j < DST_CHUNK; j++) {
+            chunk[j].fd = -1;
+            chunk[j].timer = (timer_node){0};
+            chunk[j].spill = NULL;
+            chunk[j].zerocopy = NULL;
+            chunk[j].q = NULL;
+            chunk[j].pipe[0] = chunk[j].pipe[1] = -1;
+            sh->free_slots[sh->free_tail++ % sh->max_dsts] = &chunk[j];
+        }
+    }
+
+    return sh->free_slots[sh->free_head++ % sh->max_dsts];
+}
+
+/**
+ * @brief Borrows queues for a destination that has none, from the shared pool
+ *
+ * @return bool - false if the memory budget is used up
+ */
+static bool shard_attach_queues(shard *sh, dst_client *dst) {
+    if (dst->q == NULL) {
+        dst->q = pool_get(sh->pool);
+    }
+    return dst->q != NULL;
+}
+
+/**
+ * @brief Hands a destination's queues back to the pool once it has drained
+ */
+static void shard_detach_queues(shard *sh, dst_client *dst) {
+    if (dst->q != NULL && !dst_queued(dst)) {
+        pool_put(sh->pool, dst->q);
+        dst->q = NULL;
+    }
+}
+
+static void shard_close_dst(shard *sh, dst_client *dst) {
+    timer_cancel(&sh->wheel, &dst->timer);
+    filter_table_release(&sh->filters, dst->group);
+    dst->group = 0;
+    close_dst_client(sh->loop, dst);
+    shard_detach_queues(sh, dst);
+
+    // swap the last active destination into the hole, keeping the set dense
+    dst_client *last = sh->active[--sh->num_active];
+    sh->active[dst->active_idx] = last;
+    last->active_idx = dst->active_idx;
+    sh->free_slots[sh->free_tail++ % sh->max_dsts] = dst;
+
+    __atomic_sub_fetch(&sh->num_dsts, 1, __ATOMIC_RELAXED);
+    sh->dirty = true;
+    sh->stalled = false;  // may have been the one holding the shard back
+}
+
+/**
+ * @brief Sets or clears EPOLLOUT on a destination depending on whether it still has anything queued, arming its stall
+ * deadline as the socket fills up and cancelling it once it drains
+ */
+static void shard_update_mask(shard *sh, dst_client *dst) {
+    if (dst_pending(dst) || dst->replaying) {
+        if (!(dst->prev_mask & EPOLLOUT)) { // only want to set EPOLLOUT on mask change
+            // must drain within CLIENT_TIMEOUT (whole) seconds of stalling, or it is considered dead
+            timer_arm(&sh->wheel, &dst->timer, time(NULL) + CLIENT_TIMEOUT + 1);
+            ev_mod(sh->loop, dst->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, dst);
+            dst->prev_mask = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        }
+    } else {
+        // remove EPOLLOUT so we don't get redundant wake-ups
+        if (dst->prev_mask & EPOLLOUT) {
+            timer_cancel(&sh->wheel, &dst->timer);
+            ev_mod(sh->loop, dst->fd, EPOLLIN | EPOLLRDHUP, dst);
+            dst->prev_mask = EPOLLIN | EPOLLRDHUP;
+        }
+    }
+}
+
+static void shard_add_dst(shard *sh, int fd) {
+    dst_client *dst = shard_alloc_slot(sh);
+    if (dst == NULL) {
+        fprintf(stderr, "Failed to allocate a slot in shard %d for destination on fd %d\n", sh->id, fd);
+        close(fd);
+        __atomic_sub_fetch(&sh->num_dsts, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    dst->fd = fd;  // not a compound literal, no need to zero the whole queue
+    if (sh->zc != NULL && splice_open_dst(sh->zc, dst) < 0) {
+        dst->fd = -1;
+        sh->free_slots[sh->free_tail++ % sh->max_dsts] = dst;
+        close(fd);
+        __atomic_sub_fetch(&sh->num_dsts, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (sh->zerocopy_min > 0 && (dst->zerocopy = zerocopy_open(fd, sh->zerocopy_min, dst->zerocopy)) == NULL) {
+        fprintf(stderr, "Failed to allocate zero-copy state for destination on fd %d, sending as usual\n", fd);
+    }
+
+    ev_add(sh->loop, fd, EPOLLIN | EPOLLRDHUP, dst);  // EPOLLIN for control lines
+
+    dst->head[DST_LANE_NORMAL] = dst->tail[DST_LANE_NORMAL] = 0;
+    dst->head[DST_LANE_PRIO] = dst->tail[DST_LANE_PRIO] = 0;
+    dst->sent = dst->sending = dst->prio_streak = 0;
+    dst->prio_guard = sh->prio_guard;
+    dst->spill_len = dst->spill_sent = 0;
+    dst->prev_mask = EPOLLIN | EPOLLRDHUP;
+    dst->policy = sh->policy;
+    dst->hwm = sh->hwm;
+    dst->policy_requested = false;
+    dst->drops = dst->drop_bytes = dst->bytes_out = 0;
+    dst->ctl_len = 0;
+    dst->replay_seq = DST_NO_REPLAY;
+    dst->replaying = false;
+    dst->group = 0;
+    dst->filter_requested = false;
+    dst->relay = dst->relay_requested = false;
+    dst->relay_seq = 0;
+    dst->active_idx = sh->num_active;
+    sh->active[sh->num_active++] = dst;
+
+    printf("Destination on fd %d placed in shard %d (%d active)\n", fd, sh->id, sh->num_active);
+}
+
+/**
+ * @brief Hands a freshly accepted destination to a shard, called from the accepting thread
+ *
+ * @param sh shard to place the destination in
+ * @param fd connected, non-blocking destination socket
+ * @return bool - false if the shard is already full
+ */
+bool shard_assign_dst(shard *sh, int fd) {
+    if (__atomic_add_fetch(&sh->num_dsts, 1, __ATOMIC_RELAXED) > sh->max_dsts) {
+        __atomic_sub_fetch(&sh->num_dsts, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if (!sh->threaded) {
+        shard_add_dst(sh, fd);
+        return true;
+    }
+
+    // the worker owns its loop and table, so just queue it up and let the worker register it
+    pthread_mutex_lock(&sh->lock);
+    sh->incoming[sh->num_incoming] = fd;
+    __atomic_store_n(&sh->num_incoming, sh->num_incoming + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sh->lock);
+
+    uint64_t one = 1;
+    if (write(sh->wake_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Failed to wake shard %d: %s\n", sh->id, strerror(errno));
+    }
+
+    return true;
+}
+
+static void shard_take_incoming(shard *sh) {
+    if (__atomic_load_n(&sh->num_incoming, __ATOMIC_RELAXED) == 0) {
+        return;  // racy peek is fine, anything missed gets picked up next time round
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    for (int j = 0; j < sh->num_incoming; j++) {
+        shard_add_dst(sh, sh->incoming[j]);
+    }
+    __atomic_store_n(&sh->num_incoming, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/**
+ * @brief Takes a destination out of the live fan-out to send it the journal from the message it asked for, until it
+ * has caught up with where the shard has fanned out to
+ *
+ * @return bool - false if the destination had to be closed
+ */
+static bool shard_start_replay(shard *sh, dst_client *dst) {
+    uint64_t seq = dst->replay_seq;
+    dst->replay_seq = DST_NO_REPLAY;
+
+    if (sh->journal == NULL) {
+        fprintf(stderr, "Destination on fd %d asked for a replay, but there is no journal (-j)\n", dst->fd);
+        return true;
+    }
+
+    if (dst->group != 0) {
+        fprintf(stderr, "Destination on fd %d asked for a replay, but replays aren't filtered (send filter=all)\n",
+                dst->fd);
+        return true;
+    }
+
+    if (dst->relay) {
+        fprintf(stderr, "Destination on fd %d asked for a replay, but replays aren't sent in relay batches\n", dst->fd);
+        return true;
+    }
+
+    uint64_t from = seq;
+    uint64_t offset;
+    if (!journal_locate(sh->journal, &from, &offset) || from >= sh->frame_cursor) {
+        printf("Destination on fd %d asked to replay from message %lu, nothing before the live feed to send\n",
+               dst->fd, (unsigned long)seq);
+        return true;
+    }
+
+    // everything still queued is in the journal too - only a message already partly written has to finish first
+    if (dst->sent > 0 && spill_dst_front(dst, sh->ring) < 0) {
+        fprintf(stderr, "Failed to allocate spill buffer for destination on fd %d\n", dst->fd);
+        return false;
+    }
+    dst->tail[DST_LANE_NORMAL] = dst->head[DST_LANE_NORMAL];
+    dst->tail[DST_LANE_PRIO] = dst->head[DST_LANE_PRIO];
+    shard_detach_queues(sh, dst);
+    dst->replay = offset;
+    dst->replaying = true;
+    sh->dirty = true;
+
+    printf("Destination on fd %d replaying from message %lu (asked for %lu), %lu bytes behind\n", dst->fd,
+           (unsigned long)from, (unsigned long)seq, (unsigned long)(sh->fanned - offset));
+    return true;
+}
+
+/**
+ * @brief Sends a replaying destination more of the journal, putting it back on the live feed once it catches up
+ *
+ * @return ssize_t - bytes written, -1 on an unrecoverable error (or if the replay was lapped)
+ */
+static ssize_t shard_flush_replay(shard *sh, dst_client *dst) {
+    ssize_t total = 0;
+    if (dst->spill_len > 0) {
+        total = flush_dst_client(dst, sh->ring, &sh->metrics);  // only the spill, the queue is empty
+        if (total < 0 || dst->spill_len > 0) {
+            return total;
+        }
+    }
+
+    ssize_t count = journal_send(sh->journal, dst->fd, &dst->replay, sh->fanned);
+    if (count < 0) {
+        return -1;
+    }
+    metric_add(&dst->bytes_out, count);
+    metric_add(&sh->metrics.bytes_out, count);
+
+    if (dst->replay == sh->fanned) {  // the next frame fanned out is the next one it needs
+        dst->replaying = false;
+        printf("Destination on fd %d caught up, back on the live feed\n", dst->fd);
+    }
+
+    return total + count;
+}
+
+/**
+ * @brief Gives a destination the slow-consumer policy it asked for, within what the operator's (-p) allows - only
+ * the operator can make a destination block, which would hold the feed back for everyone else, and none may hold
+ * more of the ring than the operator's high-water mark
+ */
+static void shard_set_policy(shard *sh, dst_client *dst) {
+    dst->policy_requested = false;
+
+    if (dst->policy_req == DST_POLICY_BLOCK ? sh->policy != DST_POLICY_BLOCK : sh->zc != NULL) {
+        fprintf(stderr, "Destination on fd %d can't use %s %s\n", dst->fd, dst_policy_name(dst->policy_req),
+                sh->zc != NULL ? "in splice mode" : "unless the proxy was started with it");
+        return;
+    }
+
+    dst->policy = dst->policy_req;
+    dst->hwm = dst->hwm_req < sh->hwm ? dst->hwm_req : sh->hwm;
+    printf("Destination on fd %d now using %s (high-water mark %u bytes)\n", dst->fd, dst_policy_name(dst->policy),
+           dst->hwm);
+}
+
+/**
+ * @brief Moves a destination into the group for the filter it asked for, from the next frame fanned out on
+ */
+static void shard_set_filter(shard *sh, dst_client *dst) {
+    dst->filter_requested = false;
+
+    if (sh->zc != NULL || dst->replaying) {
+        fprintf(stderr, "Destination on fd %d can't be filtered %s\n", dst->fd,
+                sh->zc != NULL ? "in splice mode" : "while replaying");
+        return;
+    }
+
+    // let go of the current group first, when the destination is all that's in it that frees the slot for the new one
+    ctmp_filter current = sh->filters.filters[dst->group];
+    filter_table_release(&sh->filters, dst->group);
+
+    int group = filter_table_acquire(&sh->filters, &dst->filter_req);
+    if (group < 0) {
+        fprintf(stderr, "Destination on fd %d asked for a filter, but shard %d already has %d different ones\n",
+                dst->fd, sh->id, FILTER_GROUPS - 1);
+        if (dst->group != 0) {
+            dst->group = filter_table_acquire(&sh->filters, &current);  // can't fail, its slot is the one left free
+        }
+        return;
+    }
+
+    dst->group = group;
+    printf("Destination on fd %d now in filter group %d\n", dst->fd, group);
+}
+
+/**
+ * @brief Switches a destination over to relay batches, from the next message boundary on
+ *
+ * @return bool - false if the destination had to be closed
+ */
+static bool shard_set_relay(shard *sh, dst_client *dst) {
+    dst->relay_requested = false;
+
+    if (sh->zc != NULL || dst->replaying || dst->relay) {
+        fprintf(stderr, "Destination on fd %d can't be a relay %s\n", dst->fd,
+                sh->zc != NULL ? "in splice mode" : dst->relay ? "twice" : "while replaying");
+        return true;
+    }
+
+    // a message already partly written has to finish bare, the other end is still expecting it
+    if (dst->sent > 0 && spill_dst_front(dst, sh->ring) < 0) {
+        fprintf(stderr, "Failed to allocate spill buffer for destination on fd %d\n", dst->fd);
+        return false;
+    }
+
+    dst->relay = true;
+    printf("Destination on fd %d is a relay, sending it batches\n", dst->fd);
+    return true;
+}
+
+/**
+ * @brief Handles a readiness event for one of the shard's destinations (or its wake eventfd)
+ *
+ * @param sh shard owning the destination
+ * @param event event as returned by ev_wait
+ */
+void shard_handle_event(shard *sh, const ev_event *event) {
+    if (event->ptr == &sh->wake_fd) {
+        uint64_t count;
+        if (read(sh->wake_fd, &count, sizeof(count)) < 0) {
+            // EAGAIN, someone else's wake already cleared it
+        }
+        return;
+    }
+
+    dst_client *dst = event->ptr;
+    bool cleanup = false;
+
+    if (dst->fd == -1) {
+        return;  // closed earlier in this same batch
+    }
+
+    // zero-copy completions raise EPOLLERR too, it's only an actual error if that's not what it was
+    uint32_t events = event->events;
+    if ((events & EPOLLERR) && dst->zerocopy != NULL && zerocopy_reap(dst->zerocopy, dst->fd) > 0) {
+        events &= ~EPOLLERR;
+        sh->dirty = true;  // releases ring space
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {  // errored, hang up, half-close (close via peer, ie not writable)
+        int soerr = 0;
+        socklen_t len = sizeof(soerr);
+        getsockopt(dst->fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+        fprintf(stderr, "Destination on fd %d hung or disconnected (Status: %s)\nCleaning up...\n", dst->fd,
+                strerror(soerr));
+        cleanup = true;
+
+    } else {
+        if (events & EPOLLIN) {
+            cleanup = read_dst_control(dst) < 0;
+
+            if (!cleanup && dst->policy_requested) {
+                shard_set_policy(sh, dst);
+            }
+
+            if (!cleanup && dst->filter_requested) {
+                shard_set_filter(sh, dst);
+            }
+
+            if (!cleanup && dst->relay_requested) {
+                cleanup = !shard_set_relay(sh, dst);
+            }
+
+            if (!cleanup && dst->replay_seq != DST_NO_REPLAY) {
+                cleanup = !shard_start_replay(sh, dst);
+            }
+        }
+
+        if (!cleanup && (events & EPOLLOUT)) {
+            // drain all that we can, to reduce wakeups needed - level triggered
+            ssize_t written;
+            if (dst->replaying) {
+                written = shard_flush_replay(sh, dst);
+            } else if (sh->zc != NULL) {
+                written = splice_flush_dst(dst, &sh->metrics);
+            } else {
+                written = flush_dst_client(dst, sh->ring, &sh->metrics);
+                shard_detach_queues(sh, dst);
+            }
+            cleanup = written < 0;
+            sh->dirty = true;
+            sh->stalled = false;  // queues may have room again
+
+            // a dropping destination may never fully drain under load, and a replay can take a while, so for those
+            // it's only dead if it stops taking data altogether - a blocking one must still catch up within the timeout
+            bool lenient = dst->policy != DST_POLICY_BLOCK || dst->replaying;
+            if (written > 0 && lenient && (dst_pending(dst) || dst->replaying)) {
+                timer_arm(&sh->wheel, &dst->timer, sh->wheel.now + CLIENT_TIMEOUT + 1);
+            }
+        }
+    }
+
+    if (cleanup) {  // clean-up dsts that are in an unrecoverable state
+        shard_close_dst(sh, dst);
+    } else {
+        shard_update_mask(sh, dst);
+    }
+}
+
+/**
+ * @brief Flushes every destination with anything pending, SHARD_IO_BATCH of them at a time. Each round plans one
+ * write per destination and hands them to the event loop together (see ev_io_batch), so with io_uring it takes one
+ * syscall however many destinations there are. A destination only stays in for another round while its socket keeps
+ * taking everything planned for it.
+ */
+static void shard_flush_all(shard *sh) {
+    dst_client *batch[SHARD_IO_BATCH];
+    ev_io ios[SHARD_IO_BATCH];
+
+    for (int j = sh->num_active - 1; j >= 0;) {  // backwards, closing swaps in one that's already been visited
+        int n = 0;
+        for (; j >= 0 && n < SHARD_IO_BATCH; j--) {
+            if (dst_pending(sh->active[j])) {
+                batch[n++] = sh->active[j];
+            }
+        }
+
+        while (n > 0) {
+            for (int k = 0; k < n; k++) {
+                dst_plan_write(batch[k], sh->ring, &sh->writes[k]);
+                ios[k] = (ev_io){.fd = batch[k]->fd, .send = true, .flags = sh->writes[k].flags,
+                                 .msg = &sh->writes[k].msg};
+            }
+            ev_io_batch(sh->loop, ios, n);
+
+            int more = 0;
+            for (int k = 0; k < n; k++) {
+                dst_client *dst = batch[k];
+                ssize_t written = dst_finish_write(dst, &sh->writes[k], ios[k].res, &sh->metrics);
+
+                if (written < 0) {
+                    shard_close_dst(sh, dst);
+                } else if ((size_t)written == sh->writes[k].len && dst_pending(dst)) {
+                    batch[more++] = dst;
+                } else {
+                    shard_update_mask(sh, dst);
+                }
+            }
+            n = more;
+        }
+    }
+}
+
+/**
+ * @brief Span of the ring a destination would pin once desc is queued (or just sent, if it's dropped)
+ */
+static uint64_t dst_span(const dst_client *dst, const frame_desc *desc) {
+    return desc->offset + desc->len - dst_oldest(dst, desc->offset);
+}
+
+static void shard_count_drop(shard *sh, dst_client *dst, uint32_t len) {
+    metric_add(&dst->drops, 1);
+    dst->drop_bytes += len;
+    metric_add(&sh->metrics.drops, 1);
+}
+
+/**
+ * @brief Lets go of the front message of one of a destination's lanes - dropping it if nothing of it has been written
+ * yet, otherwise spilling the rest of it so it still goes out whole
+ *
+ * @param lane lane to shed from, -1 for whichever holds the oldest message
+ * @return bool - false if the spill buffer couldn't be allocated
+ */
+static bool shard_shed_oldest(shard *sh, dst_client *dst, int lane) {
+    sh->dirty = true;  // releases ring space
+
+    if (lane < 0) {
+        lane = dst_oldest_lane(dst);
+    }
+    if (dst->sent > 0 && dst->sending == lane) {
+        return spill_dst_front(dst, sh->ring) == 0;
+    }
+
+    shard_count_drop(sh, dst, dst_lane_at(dst, lane, dst->tail[lane])->len);
+    dst->tail[lane]++;
+    return true;
+}
+
+/**
+ * @brief Applies a non-blocking destination's policy before queueing desc onto it
+ *
+ * Whatever the policy, a non-blocking destination never pins more than hwm bytes of the ring behind the newest
+ * message, otherwise it could still end up stalling the producer. So under drop-newest, queued messages that fall
+ * that far behind are let go as well as the ones that don't fit.
+ *
+ * @param lane lane desc would be queued in
+ * @return bool - true if desc should be queued, false if it was dropped (or the destination closed)
+ */
+static bool shard_admit(shard *sh, dst_client *dst, int lane, const frame_desc *desc) {
+    if (!shard_attach_queues(sh, dst)) {  // nothing queued to shed, the newest is all there is to let go
+        if (dst->policy == DST_POLICY_DISCONNECT) {
+            fprintf(stderr, "Destination on fd %d has nowhere to queue, the buffer pool is used up\n", dst->fd);
+            shard_close_dst(sh, dst);
+        } else {
+            shard_count_drop(sh, dst, desc->len);
+        }
+        return false;
+    }
+
+    if (dst_lane_space(dst, lane) > 0 && dst_span(dst, desc) <= dst->hwm) {
+        return true;
+    }
+
+    if (dst->policy == DST_POLICY_DISCONNECT) {
+        fprintf(stderr, "Destination on fd %d passed its high-water mark of %u bytes\n", dst->fd, dst->hwm);
+        shard_close_dst(sh, dst);
+        return false;
+    }
+
+    bool keep = dst->policy == DST_POLICY_DROP_OLDEST;
+    if (!keep) {
+        shard_count_drop(sh, dst, desc->len);
+    }
+
+    // hwm always fits a whole message, so emptying the queue is guaranteed to make room
+    while (dst_queued(dst)) {
+        int shed;
+        if (keep && dst_lane_space(dst, lane) == 0) {
+            shed = lane;
+        } else if (dst_span(dst, desc) > dst->hwm) {
+            shed = -1;
+        } else {
+            break;
+        }
+
+        if (!shard_shed_oldest(sh, dst, shed)) {
+            fprintf(stderr, "Failed to allocate spill buffer for destination on fd %d\n", dst->fd);
+            shard_close_dst(sh, dst);
+            return false;
+        }
+    }
+
+    return keep;
+}
+
+/**
+ * @brief Makes sure every blocking destination a frame is going to has queues to put it in, before any of them get it
+ *
+ * Running out of queues to borrow holds the shard back like a full queue would, which is how the memory budget
+ * pushes back on the sources. A destination kept waiting on the pool has its stall deadline armed as if its socket
+ * were full, so a budget too small for everyone connected sheds destinations rather than wedging the feed.
+ *
+ * @param match groups that want the frame (see filter_table_eval)
+ * @return bool - false if one of them couldn't get any
+ */
+static bool shard_attach_blocking(shard *sh, uint64_t match) {
+    for (int j = 0; j < sh->num_active; j++) {
+        dst_client *dst = sh->active[j];
+        if (dst->q != NULL || dst->policy != DST_POLICY_BLOCK || dst->replaying || !(match >> dst->group & 1)) {
+            continue;
+        }
+
+        if (!shard_attach_queues(sh, dst)) {
+            if (!timer_armed(&dst->timer)) {
+                timer_arm(&sh->wheel, &dst->timer, time(NULL) + CLIENT_TIMEOUT + 1);
+            }
+            return false;
+        }
+        if (!(dst->prev_mask & EPOLLOUT)) {
+            timer_cancel(&sh->wheel, &dst->timer);  // in case it had been waiting on the pool
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Splice mode's take on shard_pump - tees each batch of the source pipe into every destination's pipe and
+ * splices it out, discarding it from the source pipe once everyone has it. A destination still writing the last
+ * batch holds the next one back for all of them (see splice_src).
+ *
+ * @param sh the (only) shard
+ */
+static void shard_pump_spliced(shard *sh) {
+    splice_src *zc = sh->zc;
+
+    while (splice_next_batch(zc)) {
+        bool everyone = true;
+
+        for (int j = sh->num_active - 1; j >= 0; j--) {  // backwards, closing swaps in one already visited
+            dst_client *dst = sh->active[j];
+
+            if (dst->batch_seq == zc->batch_seq) {
+                continue;  // already has it
+            }
+            if (dst->piped > 0) {
+                everyone = false;  // can only tee into an empty pipe, wait for EPOLLOUT
+                continue;
+            }
+
+            if (splice_tee_dst(zc, dst) < 0 || splice_flush_dst(dst, &sh->metrics) < 0) {
+                shard_close_dst(sh, dst);
+            } else {
+                shard_update_mask(sh, dst);
+            }
+        }
+
+        sh->stalled = !everyone;
+        if (!everyone || splice_retire_batch(zc) < 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief One pass of shard_pump - fans out as much as the blocking destinations have room for, then flushes
+ *
+ * @param sh shard to pump
+ * @return bool - true if it fanned something out but had to stop short, and the flush may have made room since
+ */
+static bool shard_fan_out(shard *sh) {
+    uint64_t published = ring_published(sh->ring);
+    if (published == sh->frame_cursor) {
+        return false;
+    }
+
+    // blocking destinations bound how many frames go out per lane, a full lane holds back the frame that needs it
+    uint32_t room[DST_LANES] = {UINT32_MAX, UINT32_MAX};
+    for (int j = 0; j < sh->num_active; j++) {
+        const dst_client *dst = sh->active[j];
+        if (dst->policy == DST_POLICY_BLOCK && !dst->replaying) {
+            for (int l = 0; l < DST_LANES; l++) {
+                if (dst_lane_space(dst, l) < room[l]) room[l] = dst_lane_space(dst, l);
+            }
+        }
+    }
+
+    uint64_t f = sh->frame_cursor;
+    for (; f < published; f++) {
+        const frame_desc *desc = ring_frame(sh->ring, f);
+        const uint8_t *msg = ring_ptr(sh->ring, desc->offset);
+
+        int lane = DST_LANE_NORMAL;
+        if (sh->prio_guard > 0 && ((const ctmp_header *)msg)->options == CTMP_OPTION_SENSITIVE) {
+            lane = DST_LANE_PRIO;
+        }
+        if (room[lane] == 0) {
+            break;
+        }
+
+        // each distinct filter is tested once per frame, destinations then just check their group's bit
+        uint64_t match = 1;
+        if (sh->filters.in_use != 0) {
+            match = filter_table_eval(&sh->filters, msg, desc->len);
+        }
+
+        if (!shard_attach_blocking(sh, match)) {
+            break;
+        }
+        room[lane]--;
+
+        for (int j = sh->num_active - 1; j >= 0; j--) {  // backwards, disconnecting swaps in one already visited
+            dst_client *dst = sh->active[j];
+
+            if (dst->replaying || !(match >> dst->group & 1)) {
+                continue;  // gets this from the journal (rejoining once it has caught up), or doesn't want it
+            }
+
+            if (dst->policy == DST_POLICY_BLOCK || shard_admit(sh, dst, lane, desc)) {
+                dst_enqueue(dst, lane, desc);
+            }
+        }
+
+        sh->fanned = desc->offset + desc->len;
+    }
+
+    sh->stalled = f < published;
+    if (f == sh->frame_cursor) {
+        for (int j = 0; j < sh->num_active; j++) {  // don't sit on queues borrowed for nothing while others wait
+            shard_detach_queues(sh, sh->active[j]);
+        }
+        return false;
+    }
+
+    sh->frame_cursor = f;
+    sh->dirty = true;
+
+    shard_flush_all(sh);
+    for (int j = 0; j < sh->num_active; j++) {
+        shard_detach_queues(sh, sh->active[j]);
+    }
+
+    return sh->stalled;
+}
+
+/**
+ * @brief Fans newly published frames out to every destination in the shard, then flushes them straight away so the
+ * common case of a socket with room never needs an EPOLLOUT round trip.
+ *
+ * A blocking destination whose queue is full holds the whole shard back (and so, eventually, the producer),
+ * preserving the block-on-slowest behaviour. Any other destination that can't keep up has its policy applied
+ * instead, so it never holds anyone else back.
+ *
+ * @param sh shard to pump
+ */
+void shard_pump(shard *sh) {
+    if (sh->zc != NULL) {
+        shard_pump_spliced(sh);
+        return;
+    }
+
+    // a full queue is often emptied by the very flush that follows, and then there's no EPOLLOUT coming to say so
+    while (shard_fan_out(sh)) {
+    }
+}
+
+/**
+ * @brief Publishes how much of the ring this shard still needs, so the producer can reclaim the rest
+ *
+ * @param sh shard to publish for
+ */
+void shard_publish_released(shard *sh) {
+    if (!sh->dirty) {
+        return;
+    }
+    sh->dirty = false;
+
+    uint64_t released = sh->fanned;
+    for (int j = 0; j < sh->num_active; j++) {
+        if (dst_oldest(sh->active[j], sh->fanned) < released) {
+            released = dst_oldest(sh->active[j], sh->fanned);  // slowest dst decides what can be reclaimed
+        }
+    }
+
+    __atomic_store_n(&sh->released, released, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&sh->released_frame, sh->frame_cursor, __ATOMIC_SEQ_CST);
+
+    ring_wake_producer(sh->ring);
+}
+
+static void shard_expire_dst(timer_node *node, void *ctx) {
+    dst_client *dst = (dst_client *)((char *)node - offsetof(dst_client, timer));
+
+    shard *sh = ctx;
+
+    fprintf(stderr, "Destination on fd %d stalled for over %ds\n", dst->fd, CLIENT_TIMEOUT);
+    metric_add(&sh->metrics.timeouts, 1);
+    shard_close_dst(sh, dst);
+}
+
+/**
+ * @brief Housekeeping run once per loop iteration - timeouts, and telling the producer what has been released
+ *
+ * @param sh shard to tick
+ */
+void shard_tick(shard *sh) {
+    // clean-up dst clients that have been stalled past the timeout - only does any work once a second, and then only
+    // touches the ones actually due
+    timer_wheel_advance(&sh->wheel, time(NULL), shard_expire_dst, sh);
+
+    shard_publish_released(sh);
+}
+
+/**
+ * @brief Called by the producer after publishing frames, wakes the worker if it is blocked waiting for events
+ *
+ * @param sh shard to notify
+ */
+void shard_notify(shard *sh) {
+    if (sh->threaded && __atomic_exchange_n(&sh->idle, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(sh->wake_fd, &one, sizeof(one)) < 0) {
+            // counter can't realistically overflow, and a missed wake is covered by the poll timeout
+        }
+    }
+}
+
+static void *shard_run(void *arg) {
+    shard *sh = arg;
+    ev_event events[SHARD_EVENTS];
+
+    while (sh->running) {
+        // busy polling never blocks, so it never needs waking either and the producer is spared the eventfd write
+        if (!sh->busy_poll) {
+            __atomic_store_n(&sh->idle, 1, __ATOMIC_SEQ_CST);
+        }
+
+        // only skip the wait if there is something we can actually get on with
+        bool more = sh->busy_poll
+                    || (!sh->stalled && __atomic_load_n(&sh->ring->frame_head, __ATOMIC_SEQ_CST) != sh->frame_cursor);
+        int num_events = ev_wait(sh->loop, events, SHARD_EVENTS, more ? 0 : 20);
+
+        __atomic_store_n(&sh->idle, 0, __ATOMIC_RELAXED);
+
+        if (num_events < 0 && errno != EINTR) {
+            fprintf(stderr, "Unrecoverable error whilst polling in shard %d: %s\n", sh->id, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            shard_handle_event(sh, &events[i]);
+        }
+
+        shard_take_incoming(sh);
+        shard_pump(sh);
+        shard_tick(sh);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Starts the worker thread for a threaded shard
+ *
+ * @return int - 0 on success, -1 if the thread couldn't be created
+ */
+int shard_start(shard *sh) {
+    sh->running = true;
+
+    int err = pthread_create(&sh->thread, NULL, shard_run, sh);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: Failed to start worker for shard %d: %s\n", sh->id, strerror(err));
+        sh->running = false;
+        return -1;
+    }
+
+    if (sh->cpu >= 0 && cpu_pin_thread(sh->thread, sh->cpu) < 0) {
+        shard_stop(sh);
+        return -1;
+    }
+
+    return 0;
+}
+
+void shard_stop(shard *sh) {
+    if (!sh->running) {
+        return;
+    }
+
+    sh->running = false;
+    pthread_join(sh->thread, NULL);
+}
+
+/**
+ * @brief Closes every destination still owned by the shard and releases its resources
+ */
+void shard_free(shard *sh) {
+    shard_take_incoming(sh);
+
+    for (int j = 0; j < sh->num_active; j++) {
+        close(sh->active[j]->fd);
+        if (sh->active[j]->pipe[0] != -1) {
+            close(sh->active[j]->pipe[0]);
+            close(sh->active[j]->pipe[1]);
+        }
+    }
+
+    if (sh->threaded) {
+        if (sh->wake_fd != -1) close(sh->wake_fd);
+        if (sh->loop) ev_destroy(sh->loop);
+    }
+
+    pthread_mutex_destroy(&sh->lock);
+    for (int c = 0; c < sh->num_chunks; c++) {
+        int slots = sh->max_dsts - c * DST_CHUNK;
+        for (int j = 0; j < slots && j < DST_CHUNK; j++) {
+            free(sh->chunks[c][j].spill);
+            free(sh->chunks[c][j].zerocopy);
+        }
+        free(sh->chunks[c]);
+    }
+    free(sh->chunks);
+    free(sh->active);
+    free(sh->free_slots);
+    free(sh->incoming);
+    free(sh->writes);
+}
@@ -0,0 +1,101 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "client.h"
+#include "event.h"
+#include "filter.h"
+#include "journal.h"
+#include "metrics.h"
+#include "pool.h"
+#include "ring.h"
+#include "splice.h"
+#include "timer.h"
+
+#define SHARD_EVENTS 256  // max events handled per wait
+#define MAX_WORKERS 64
+#define DST_CHUNK 32  // destination slots allocated at a time
+#define SHARD_IO_BATCH 64  // max destination writes handed to the event loop at once
+
+/**
+ * @brief A shard owns a subset of the destinations and does all of their I/O.
+ *
+ * Shards consume frames from the broadcast ring in order, queue a descriptor for each onto every destination they
+ * own, and flush them. How far they have got is published back (released/released_frame) so the producer knows
+ * what it can reuse. Only destinations with the block policy can hold a shard back, the rest have their policy
+ * applied once they pass their high-water mark (see dst_policy).
+ *
+ * Without worker threads there is exactly one shard, sharing the main event loop and driven inline from main().
+ * With -w N there are N shards, each running on its own thread with its own event loop, so egress scales with
+ * cores rather than being pinned to the thread parsing the source.
+ */
+typedef struct shard {
+    int id;
+    ev_loop *loop;
+    bcast_ring *ring;
+
+    // slots are allocated DST_CHUNK at a time as destinations connect and never move, since the event loop and timer
+    // wheel hold pointers to them - active is the densely packed set of connected ones, so fan-out cost scales with
+    // what is actually connected rather than max_dsts
+    dst_client **chunks;
+    int num_chunks;
+    dst_client **active;
+    int num_active;
+    dst_client **free_slots;  // FIFO, so a slot just closed isn't immediately handed to a new destination
+    uint32_t free_head;
+    uint32_t free_tail;
+    int max_dsts;
+    int num_dsts;  // atomic, includes destinations handed over but not yet picked up by the worker
+    dst_policy policy;  // slow-consumer policy new destinations start with, they may pick their own
+    uint32_t hwm;
+    uint8_t prio_guard;  // see dst_client, 0 if sensitive messages aren't sent ahead of the rest
+    chunk_pool *pool;  // shared by every shard, destinations borrow their queues from it
+    uint32_t zerocopy_min;  // -Z, see dst_zerocopy, 0 to always copy
+
+    uint64_t frame_cursor;  // next frame to fan out
+    uint64_t fanned;  // ring offset everything before which has been fanned out
+    bool stalled;  // a blocking destination's queue is full, wait for it to drain before fanning out more
+    bool dirty;  // something moved since released was last published
+    timer_wheel wheel;  // stall deadlines of destinations that can't keep up
+    egress_metrics metrics;  // written only by whichever thread runs the shard
+    splice_src *zc;  // splice mode (-z), destinations are fed from the source pipe rather than the ring
+    const journal *journal;  // -j, where replays are sent from
+    filter_table filters;  // distinct filters of the shard's destinations
+    dst_write *writes;  // SHARD_IO_BATCH of them, planned for the destinations flushed together
+
+    // read by the producer on every reclaim, so kept off the lines the worker writes as it fans out
+    uint64_t released __attribute__((aligned(CACHE_LINE)));  // atomic, oldest byte this shard still needs
+    uint64_t released_frame;  // atomic, frame_cursor as last published
+
+    bool threaded;
+    bool busy_poll;  // -b, the worker spins on its loop rather than ever blocking in it
+    int cpu;  // -c, CPU the worker is pinned to, -1 if it isn't
+    volatile bool running;
+    pthread_t thread;
+    int wake_fd;  // eventfd the producer pokes when frames are published while this shard is idle
+    int idle;  // atomic, worker is (about to be) blocked in ev_wait
+
+    pthread_mutex_t lock;  // guards incoming, destinations accepted by main() waiting to be picked up
+    int *incoming;
+    int num_incoming;
+} __attribute__((aligned(CACHE_LINE))) shard;
+
+int shard_init(shard *sh, int id, int max_dsts, bcast_ring *ring, ev_loop *loop, ev_backend backend);
+int shard_start(shard *sh);
+void shard_stop(shard *sh);
+void shard_free(shard *sh);
+
+bool shard_assign_dst(shard *sh, int fd);
+void shard_handle_event(shard *sh, const ev_event *event);
+void shard_pump(shard *sh);
+void shard_tick(shard *sh);
+void shard_publish_released(shard *sh);
+void shard_notify(shard *sh);
+
+#endif //SHARD_H
@@ -0,0 +1,454 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include "ctmp.h"
+#include "sockmap.h"
+
+/*
+ * Just enough of an eBPF assembler for the two programs below, so there's no dependency on clang or libbpf
+ */
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+#define MOV64_REG(d, s) INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i) INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_REG(d, s) INSN(BPF_ALU64 | BPF_ADD | BPF_X, d, s, 0, 0)
+#define ADD64_IMM(d, i) INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define BE16(d) INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define LDX(size, d, s, o) INSN(BPF_LDX | (size) | BPF_MEM, d, s, o, 0)
+#define ST_W(d, o, i) INSN(BPF_ST | BPF_W | BPF_MEM, d, 0, o, i)
+#define ATOMIC_ADD64(d, s, o) INSN(BPF_STX | BPF_DW | BPF_ATOMIC, d, s, o, BPF_ADD)
+#define JA() INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)  // jumps leave off the offset, emit_jump patches it in from a label
+#define JEQ_IMM(d, i) INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, 0, i)
+#define JNE_IMM(d, i) INSN(BPF_JMP | BPF_JNE | BPF_K, d, 0, 0, i)
+#define JGE_IMM(d, i) INSN(BPF_JMP | BPF_JGE | BPF_K, d, 0, 0, i)
+#define JEQ_REG(d, s) INSN(BPF_JMP | BPF_JEQ | BPF_X, d, s, 0, 0)
+#define JNE_REG(d, s) INSN(BPF_JMP | BPF_JNE | BPF_X, d, s, 0, 0)
+#define JGT_REG(d, s) INSN(BPF_JMP | BPF_JGT | BPF_X, d, s, 0, 0)
+#define CALL(f) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD(d, fd) INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+
+enum { R0 = 0, R1, R2, R3, R4, R5, R6, R7, R8, R9, R10 };
+
+#define HDR (-(int)sizeof(ctmp_header))  // the header is copied to the bottom of the stack
+#define HDR_OPTIONS (HDR + (int)offsetof(ctmp_header, options))
+#define HDR_LENGTH (HDR + (int)offsetof(ctmp_header, length))
+#define HDR_PAD (HDR + (int)offsetof(ctmp_header, cpad))
+#define KEY (HDR - (int)sizeof(uint32_t))  // and a map key just below it
+#define SKB_LEN offsetof(struct __sk_buff, len)
+
+// r0 = pointer to the sockmap_counts at k (0 if missing), 6 instructions
+#define LOOKUP_COUNTS(map, k) \
+    ST_W(R10, KEY, k), LD_MAP_FD(R1, map), MOV64_REG(R2, R10), ADD64_IMM(R2, KEY), CALL(BPF_FUNC_map_lookup_elem)
+
+/**
+ * @brief A program being assembled - jumps name a label rather than an offset, and are patched once every label is
+ * placed, so adding or removing an instruction can't silently retarget the branches after it
+ */
+typedef struct {
+    struct bpf_insn insns[SOCKMAP_PROG_MAX];
+    int count;
+    int labels[SOCKMAP_PROG_LABELS];  // instruction each label is placed at, -1 until it is
+    int jumps[SOCKMAP_PROG_MAX];  // label each instruction jumps to, -1 if it isn't a jump
+} bpf_asm;
+
+#define EMIT(a, ...) emit(a, (const struct bpf_insn[]){__VA_ARGS__}, \
+                          sizeof((const struct bpf_insn[]){__VA_ARGS__}) / sizeof(struct bpf_insn))
+
+static void asm_init(bpf_asm *a) {
+    a->count = 0;
+    memset(a->labels, -1, sizeof(a->labels));
+}
+
+static void emit(bpf_asm *a, const struct bpf_insn *insns, int count) {
+    for (int k = 0; k < count && a->count < SOCKMAP_PROG_MAX; k++) {
+        a->jumps[a->count] = -1;
+        a->insns[a->count++] = insns[k];
+    }
+}
+
+static void emit_jump(bpf_asm *a, struct bpf_insn insn, int label) {
+    emit(a, &insn, 1);
+    a->jumps[a->count - 1] = label;
+}
+
+static void place_label(bpf_asm *a, int label) {
+    a->labels[label] = a->count;
+}
+
+/**
+ * @brief Patches every jump with the offset of its label
+ *
+ * @return int - 0 on success, -1 if the program overflowed or jumps to a label that was never placed
+ */
+static int asm_link(bpf_asm *a, const char *name) {
+    if (a->count == SOCKMAP_PROG_MAX) {
+        fprintf(stderr, "The %s program doesn't fit in %d instructions\n", name, SOCKMAP_PROG_MAX);
+        return -1;
+    }
+
+    for (int k = 0; k < a->count; k++) {
+        if (a->jumps[k] == -1) {
+            continue;
+        }
+        if (a->labels[a->jumps[k]] == -1) {
+            fprintf(stderr, "The %s program jumps to label %d, which is never placed\n", name, a->jumps[k]);
+            return -1;
+        }
+        a->insns[k].off = (int16_t)(a->labels[a->jumps[k]] - (k + 1));  // relative to the next instruction
+    }
+
+    return 0;
+}
+
+static int bpf(int cmd, union bpf_attr *attr) {
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int create_map(enum bpf_map_type type, uint32_t value_size, uint32_t entries) {
+    union bpf_attr attr = {.map_type = type, .key_size = sizeof(uint32_t), .value_size = value_size,
+                           .max_entries = entries};
+    return bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int update_map(int map, uint32_t key, const void *value) {
+    union bpf_attr attr = {.map_fd = map, .key = (uintptr_t)&key, .value = (uintptr_t)value, .flags = BPF_ANY};
+    return bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int update_sock(int map, uint32_t key, int fd) {
+    uint32_t value = fd;
+    return update_map(map, key, &value);
+}
+
+static int load_prog(const struct bpf_insn *insns, size_t count, const char *name) {
+    static char log[SOCKMAP_LOG_SIZE];
+    union bpf_attr attr = {.prog_type = BPF_PROG_TYPE_SK_SKB, .insns = (uintptr_t)insns, .insn_cnt = count,
+                           .license = (uintptr_t)"Dual BSD/GPL"};
+
+    int fd = bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    // again for the verifier's reasons - not the first time round, as a log that fills up fails a good program too
+    int err = errno;
+    log[0] = '\0';
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    bpf(BPF_PROG_LOAD, &attr);
+    fprintf(stderr, "Failed to load %s program: %s\n%s\n", name, strerror(err), log);
+    return -1;
+}
+
+static int attach_prog(int map, int prog, enum bpf_attach_type type) {
+    union bpf_attr attr = {.target_fd = map, .attach_bpf_fd = prog, .attach_type = type};
+    return bpf(BPF_PROG_ATTACH, &attr);
+}
+
+/**
+ * @brief Source verdict - counts the skb as seen, then while userspace is caught up, walks it header by header,
+ * checking each the way is_header_valid does with options 0 (so anything sensitive is left to userspace), and redirects
+ * it out of the destination socket if it ends exactly where a message does. That drops it if there's no destination,
+ * just as fanning it out to nobody would. Otherwise counts it as passed and passes it up.
+ */
+static int load_verdict_src(int counters, int dst_map) {
+    enum { PASS, COUNT_AND_PASS, LOOP, REDIRECT };
+    static bpf_asm a;  // a few KiB, too much for the stack of a function that's only ever called once
+    asm_init(&a);
+
+    EMIT(&a, MOV64_REG(R6, R1),
+             LDX(BPF_W, R1, R6, SKB_LEN));
+    emit_jump(&a, JEQ_IMM(R1, 0), PASS);  // the FIN - redirected, the destination would take 0 bytes sent for an error
+    EMIT(&a, LOOKUP_COUNTS(counters, SOCKMAP_VERDICT_COUNTS));
+    emit_jump(&a, JEQ_IMM(R0, 0), PASS);
+    EMIT(&a, MOV64_REG(R8, R0),
+             LDX(BPF_W, R1, R6, SKB_LEN),
+             ATOMIC_ADD64(R8, R1, offsetof(sockmap_counts, seen)),
+             LOOKUP_COUNTS(counters, SOCKMAP_ACK));
+    emit_jump(&a, JEQ_IMM(R0, 0), PASS);
+    EMIT(&a, LDX(BPF_DW, R1, R8, offsetof(sockmap_counts, passed)),
+             LDX(BPF_DW, R2, R0, offsetof(sockmap_counts, passed)));
+    emit_jump(&a, JNE_REG(R1, R2), COUNT_AND_PASS);  // userspace still has some of the stream in hand
+    EMIT(&a, MOV64_IMM(R7, 0),  // offset of the next header
+             MOV64_IMM(R9, 0));  // headers walked
+
+    place_label(&a, LOOP);
+    EMIT(&a, LDX(BPF_W, R1, R6, SKB_LEN));
+    emit_jump(&a, JEQ_REG(R7, R1), REDIRECT);  // all whole messages
+    emit_jump(&a, JGE_IMM(R9, SOCKMAP_WALK_MAX), COUNT_AND_PASS);
+    EMIT(&a, MOV64_REG(R1, R6),
+             MOV64_REG(R2, R7),
+             MOV64_REG(R3, R10),
+             ADD64_IMM(R3, HDR),
+             MOV64_IMM(R4, sizeof(ctmp_header)),
+             CALL(BPF_FUNC_skb_load_bytes));
+    emit_jump(&a, JNE_IMM(R0, 0), COUNT_AND_PASS);  // the header runs on into the next skb
+    EMIT(&a, LDX(BPF_B, R0, R10, HDR));
+    emit_jump(&a, JNE_IMM(R0, CTMP_MAGIC), COUNT_AND_PASS);
+    EMIT(&a, LDX(BPF_B, R0, R10, HDR_OPTIONS));
+    emit_jump(&a, JNE_IMM(R0, 0), COUNT_AND_PASS);
+    EMIT(&a, LDX(BPF_H, R0, R10, HDR_PAD));
+    emit_jump(&a, JNE_IMM(R0, 0), COUNT_AND_PASS);
+    EMIT(&a, LDX(BPF_H, R0, R10, HDR_LENGTH),
+             BE16(R0),
+             ADD64_REG(R7, R0),
+             ADD64_IMM(R7, sizeof(ctmp_header)),
+             LDX(BPF_W, R1, R6, SKB_LEN));
+    emit_jump(&a, JGT_REG(R7, R1), COUNT_AND_PASS);  // the message runs on into the next skb
+    EMIT(&a, ADD64_IMM(R9, 1));
+    emit_jump(&a, JA(), LOOP);
+
+    place_label(&a, REDIRECT);
+    EMIT(&a, MOV64_REG(R1, R6),
+             LD_MAP_FD(R2, dst_map),
+             MOV64_IMM(R3, 0),
+             MOV64_IMM(R4, 0),  // no BPF_F_INGRESS, so out of the destination's socket rather than into it
+             CALL(BPF_FUNC_sk_redirect_map),
+             EXIT());
+
+    place_label(&a, COUNT_AND_PASS);
+    EMIT(&a, LDX(BPF_W, R1, R6, SKB_LEN),
+             ATOMIC_ADD64(R8, R1, offsetof(sockmap_counts, passed)));
+
+    place_label(&a, PASS);
+    EMIT(&a, MOV64_IMM(R0, SK_PASS),
+             EXIT());
+
+    if (asm_link(&a, "source verdict") < 0) {
+        return -1;
+    }
+    return load_prog(a.insns, a.count, "source verdict");
+}
+
+/**
+ * @brief Loopback verdict - everything arriving here has already been validated by userspace
+ */
+static int load_verdict_inject(int dst_map) {
+    const struct bpf_insn insns[] = {
+        LD_MAP_FD(R2, dst_map),
+        MOV64_IMM(R3, 0),
+        MOV64_IMM(R4, 0),
+        CALL(BPF_FUNC_sk_redirect_map),
+        EXIT(),
+    };
+    return load_prog(insns, sizeof(insns) / sizeof(insns[0]), "loopback verdict");
+}
+
+/**
+ * @brief Connects a loopback TCP pair for validated messages to re-enter the kernel through
+ *
+ * @return int - 0 on success, -1 on failure
+ */
+static int open_inject(sockmap_fwd *fwd) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int ok = listen_fd != -1 && bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+             && listen(listen_fd, 1) == 0 && getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == 0;
+
+    if (ok) {
+        fwd->inject_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ok = fwd->inject_fd != -1 && connect(fwd->inject_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if (ok) {
+        fwd->inject_peer = accept(listen_fd, NULL, NULL);  // already queued, a loopback connect completes at once
+        ok = fwd->inject_peer != -1;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Failed to connect loopback for in-kernel forwarding: %s\n", strerror(errno));
+    }
+    if (listen_fd != -1) {
+        close(listen_fd);
+    }
+    return ok ? 0 : -1;
+}
+
+#define SOCKMAP_CLOSED ((sockmap_fwd){.src_map = -1, .inject_map = -1, .dst_map = -1, .counters = -1, \
+                                       .progs = {-1, -1}, .inject_fd = -1, .inject_peer = -1, .dst_fd = -1})
+
+/**
+ * @brief Creates the maps, loads and attaches the programs and connects the loopback for validated messages
+ *
+ * @param fwd state to set up, left closed on failure
+ * @return int - 0 on success, -1 if the kernel won't have it (the caller falls back to forwarding in userspace)
+ */
+int sockmap_open(sockmap_fwd *fwd) {
+    *fwd = SOCKMAP_CLOSED;
+
+    fwd->src_map = create_map(BPF_MAP_TYPE_SOCKMAP, sizeof(uint32_t), 1);
+    fwd->inject_map = create_map(BPF_MAP_TYPE_SOCKMAP, sizeof(uint32_t), 1);
+    fwd->dst_map = create_map(BPF_MAP_TYPE_SOCKMAP, sizeof(uint32_t), 1);
+    fwd->counters = create_map(BPF_MAP_TYPE_ARRAY, sizeof(sockmap_counts), SOCKMAP_COUNTERS);
+    if (fwd->src_map < 0 || fwd->inject_map < 0 || fwd->dst_map < 0 || fwd->counters < 0) {
+        fprintf(stderr, "Failed to create sockmap: %s\n", strerror(errno));
+        sockmap_close(fwd);
+        return -1;
+    }
+
+    fwd->progs[SOCKMAP_VERDICT_SRC] = load_verdict_src(fwd->counters, fwd->dst_map);
+    fwd->progs[SOCKMAP_VERDICT_INJECT] = load_verdict_inject(fwd->dst_map);
+    for (int p = 0; p < SOCKMAP_PROGS; p++) {
+        if (fwd->progs[p] < 0) {
+            sockmap_close(fwd);
+            return -1;
+        }
+    }
+
+    // verdicts only, no stream parser, so each sees whole skbs from where the last one left off
+    // programs go on before any socket does, they only apply to sockets added afterwards
+    if (attach_prog(fwd->src_map, fwd->progs[SOCKMAP_VERDICT_SRC], BPF_SK_SKB_VERDICT) < 0
+        || attach_prog(fwd->inject_map, fwd->progs[SOCKMAP_VERDICT_INJECT], BPF_SK_SKB_VERDICT) < 0) {
+        fprintf(stderr, "Failed to attach sockmap programs: %s\n", strerror(errno));
+        sockmap_close(fwd);
+        return -1;
+    }
+
+    if (open_inject(fwd) < 0) {
+        sockmap_close(fwd);
+        return -1;
+    }
+    if (update_sock(fwd->inject_map, 0, fwd->inject_peer) < 0) {
+        fprintf(stderr, "Failed to add loopback to sockmap: %s\n", strerror(errno));
+        sockmap_close(fwd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void sockmap_close(sockmap_fwd *fwd) {
+    int fds[] = {fwd->dst_fd, fwd->inject_fd, fwd->inject_peer, fwd->src_map, fwd->inject_map, fwd->dst_map,
+                 fwd->counters, fwd->progs[0], fwd->progs[1]};
+    for (size_t k = 0; k < sizeof(fds) / sizeof(fds[0]); k++) {
+        if (fds[k] >= 0) {
+            close(fds[k]);
+        }
+    }
+
+    *fwd = SOCKMAP_CLOSED;
+}
+
+/**
+ * @brief Puts a newly accepted source under the verdict, starting out held in userspace until sockmap_ack finds the
+ * last source's stream has all gone. A closed socket leaves the map by itself, so the key is only ever overwritten once
+ * the previous source has gone, and with it any chance of the program running concurrently.
+ *
+ * @return int - 0 on success, -1 if the socket can't go in a sockmap (it isn't TCP, or isn't connected)
+ */
+int sockmap_add_src(sockmap_fwd *fwd, int fd) {
+    sockmap_counts counts = {0};
+    sockmap_counts ack = {.passed = UINT64_MAX};  // can never match, so everything is passed until the first ack
+    fwd->consumed = 0;
+    fwd->acked = ack.passed;
+
+    if (update_map(fwd->counters, SOCKMAP_VERDICT_COUNTS, &counts) < 0
+        || update_map(fwd->counters, SOCKMAP_ACK, &ack) < 0 || update_sock(fwd->src_map, 0, fd) < 0) {
+        fprintf(stderr, "Failed to add source on fd %d to sockmap: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Lets the source verdict go back to redirecting once userspace has forwarded everything it was passed
+ *
+ * @param src_fd the source, -1 if there isn't one
+ * @param drained whether everything read from the source has been published, and fanned out to the loopback
+ */
+void sockmap_ack(sockmap_fwd *fwd, int src_fd, bool drained) {
+    if (src_fd == -1 || fwd->fallback || fwd->acked == fwd->consumed || !drained) {
+        return;
+    }
+
+    // and it's all left the loopback, so is already queued on the destination ahead of anything redirected next
+    int unsent = 0;
+    if (ioctl(fwd->inject_fd, SIOCOUTQ, &unsent) < 0 || unsent > 0) {
+        return;
+    }
+
+    // and the program has seen every byte the source has sent - whatever arrived before it went in the sockmap can be
+    // read straight off the socket without ever being counted, so the counts would never be a match for what was read
+    sockmap_counts counts;
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    uint32_t key = SOCKMAP_VERDICT_COUNTS;
+    union bpf_attr attr = {.map_fd = fwd->counters, .key = (uintptr_t)&key, .value = (uintptr_t)&counts};
+    if (bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0 || getsockopt(src_fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) < 0
+        || counts.seen != info.tcpi_bytes_received) {
+        return;
+    }
+
+    sockmap_counts ack = {.passed = fwd->consumed};
+    if (update_map(fwd->counters, SOCKMAP_ACK, &ack) < 0) {
+        fprintf(stderr, "Failed to update sockmap counters: %s\n", strerror(errno));
+        return;
+    }
+    fwd->acked = fwd->consumed;
+}
+
+/**
+ * @brief Makes fd the destination messages are redirected to
+ *
+ * @return int - 0 on success, -1 if there already is one or it can't go in a sockmap
+ */
+int sockmap_set_dst(sockmap_fwd *fwd, int fd) {
+    if (fwd->dst_fd != -1) {
+        return -1;
+    }
+
+    if (update_sock(fwd->dst_map, 0, fd) < 0) {
+        fprintf(stderr, "Failed to add destination on fd %d to sockmap: %s\n", fd, strerror(errno));
+        return -1;
+    }
+
+    fwd->dst_fd = fd;
+    return 0;
+}
+
+/**
+ * @brief Goes back to forwarding everything through userspace for the rest of the run, for when a second destination
+ * connects - a redirect only reaches the one.
+ *
+ * Taking the source out of the sockmap would throw away whatever the verdict had passed up that hadn't been read yet,
+ * so instead it stays in with an acknowledgement the verdict can never match, and passes everything up from then on.
+ * Sources that connect later aren't put in at all. The destination stays where it is too, as the redirect target of
+ * the loopback, so what was redirected to it before stays in order with everything it is sent after.
+ */
+void sockmap_fallback(sockmap_fwd *fwd) {
+    sockmap_counts ack = {.passed = UINT64_MAX};
+    if (update_map(fwd->counters, SOCKMAP_ACK, &ack) < 0) {
+        fprintf(stderr, "Failed to update sockmap counters: %s\n", strerror(errno));
+    }
+
+    fwd->acked = ack.passed;
+    fwd->fallback = true;
+}
+
+/**
+ * @brief Closes the destination, which also takes it out of the sockmap
+ */
+void sockmap_drop_dst(sockmap_fwd *fwd) {
+    if (fwd->dst_fd != -1) {
+        close(fwd->dst_fd);
+        fwd->dst_fd = -1;
+    }
+}
@@ -0,0 +1,77 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef SOCKMAP_H
+#define SOCKMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SOCKMAP_WALK_MAX 1024  // most messages the verdict walks in one skb before leaving it to userspace
+#define SOCKMAP_LOG_SIZE 4096  // verifier log kept for a program that fails to load
+#define SOCKMAP_PROG_MAX 128  // instructions a program may assemble to
+#define SOCKMAP_PROG_LABELS 8  // jump targets a program may have
+
+enum {
+    SOCKMAP_VERDICT_COUNTS = 0,  // only ever written by the source verdict
+    SOCKMAP_ACK,  // only ever written by userspace
+    SOCKMAP_COUNTERS
+};
+
+typedef struct {
+    uint64_t passed;  // SOCKMAP_VERDICT_COUNTS - bytes passed up to userspace, SOCKMAP_ACK - the last of them it's done
+    uint64_t seen;  // SOCKMAP_VERDICT_COUNTS - bytes the program has run on at all, passed or redirected
+} sockmap_counts;
+
+enum {
+    SOCKMAP_VERDICT_SRC = 0,  // redirects skbs of whole, valid normal messages, passes everything else up
+    SOCKMAP_VERDICT_INJECT,  // redirects everything userspace has already validated
+    SOCKMAP_PROGS
+};
+
+/**
+ * @brief In-kernel forwarding (-k) - the source sits in a BPF sockmap whose verdict program walks every CTMP header in
+ * each skb the way is_header_valid does, and when the skb is nothing but whole, valid, normal messages redirects it
+ * straight out of the destination socket without waking userspace at all.
+ *
+ * Anything else - a sensitive message, whose checksum the program doesn't verify, a malformed header, or a message
+ * running on into the next skb - is passed up the source socket, where the existing path reads, validates and
+ * publishes it to the broadcast ring. The ring's one destination is a loopback connection back into the kernel
+ * (inject_fd), whose far end sits in a sockmap of its own with a verdict that redirects whatever arrives to the real
+ * destination.
+ *
+ * An skb can't be split, and the stream parser that could frame it doesn't tell its programs where in the skb the
+ * message starts, so once anything has been passed up, everything after it is too - until userspace has forwarded all
+ * of it and seen it leave the loopback, and acknowledges as much by setting SOCKMAP_ACK to what the program counted as
+ * passed. Only then, with the stream at a message boundary and nothing of it left in flight, does the
+ * program go back to redirecting. So the destination gets exactly the byte stream userspace would have sent it.
+ *
+ * A redirect can only go to a single socket, and the counters are for a single stream, so this is limited to one
+ * source and one destination. A second destination connecting sends the proxy back to the userspace path for good
+ * (see sockmap_fallback).
+ */
+typedef struct {
+    int src_map;  // the source, at key 0
+    int inject_map;  // the kernel end of the loopback connection
+    int dst_map;  // the destination, at key 0 - no programs attached, only a redirect target
+    int counters;  // a sockmap_counts at SOCKMAP_VERDICT_COUNTS and SOCKMAP_ACK
+    int progs[SOCKMAP_PROGS];
+    int inject_fd;  // userspace end of the loopback connection, a copy of which is a shard's destination
+    int inject_peer;
+    int dst_fd;  // -1 until a destination connects
+    uint64_t consumed;  // bytes read from the current source
+    uint64_t acked;  // last value written to SOCKMAP_ACK
+    bool fallback;  // everything goes through userspace, since more than one destination has connected
+} sockmap_fwd;
+
+int sockmap_open(sockmap_fwd *fwd);
+void sockmap_close(sockmap_fwd *fwd);
+
+int sockmap_add_src(sockmap_fwd *fwd, int fd);
+void sockmap_ack(sockmap_fwd *fwd, int src_fd, bool drained);
+int sockmap_set_dst(sockmap_fwd *fwd, int fd);
+void sockmap_fallback(sockmap_fwd *fwd);
+void sockmap_drop_dst(sockmap_fwd *fwd);
+
+#endif //SOCKMAP_H
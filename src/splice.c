@@ -0,0 +1,388 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#define _GNU_SOURCE  // splice, tee, F_SETPIPE_SZ
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "splice.h"
+
+/**
+ * @brief Creates a non-blocking pipe of exactly size bytes
+ *
+ * @return int - 0 on success, -1 if it couldn't be created or sized
+ */
+static int open_pipe(int fds[2], int size) {
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    if (fcntl(fds[1], F_SETPIPE_SZ, size) != size) {
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sets up the source pipe and the rest of what splice mode needs
+ *
+ * @param zc state to initialise
+ * @return int - 0 on success, -1 on failure
+ */
+int splice_src_init(splice_src *zc) {
+    *zc = (splice_src){.pipe = {-1, -1}, .pipe_size = SPLICE_PIPE_SIZE};
+
+    zc->devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    zc->peek = malloc(sizeof(ctmp_header) + UINT16_MAX);
+    if (zc->devnull == -1 || zc->peek == NULL || open_pipe(zc->pipe, zc->pipe_size) < 0) {
+        fprintf(stderr, "ERROR: Failed to set up %d byte source pipe: %s\n", zc->pipe_size, strerror(errno));
+        splice_src_free(zc);
+        return -1;
+    }
+
+    return 0;
+}
+
+void splice_src_free(splice_src *zc) {
+    if (zc->pipe[0] != -1) {
+        close(zc->pipe[0]);
+        close(zc->pipe[1]);
+    }
+    if (zc->devnull != -1) {
+        close(zc->devnull);
+    }
+    free(zc->peek);
+    zc->peek = NULL;
+}
+
+/**
+ * @brief Forgets the message that was coming in when the source went away - whatever of it is already in the pipe is
+ * left to be discarded once the whole messages in front of it have gone out
+ */
+void splice_src_reset(splice_src *zc) {
+    if (zc->frame_left > 0) {
+        zc->orphan += zc->framer.frame_len - zc->frame_left;
+    }
+
+    zc->frame_left = 0;
+    zc->copied = 0;
+    ctmp_framer_consume(&zc->framer);
+}
+
+/**
+ * @brief Moves len bytes from the front of the source pipe to /dev/null
+ */
+static int discard(splice_src *zc, uint32_t len) {
+    while (len > 0) {
+        ssize_t count = splice(zc->pipe[0], NULL, zc->devnull, NULL, len, SPLICE_F_NONBLOCK);
+        if (count <= 0) {
+            fprintf(stderr, "ERROR: Failed to discard from source pipe: %s\n", strerror(errno));
+            return -1;
+        }
+
+        len -= count;
+        zc->retired += count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Discards a cut-off message once it is at the front of the pipe
+ *
+ * @return bool - true if there's no orphan (left) in the pipe
+ */
+static bool drop_orphan(splice_src *zc) {
+    if (zc->orphan == 0) {
+        return true;
+    }
+
+    if (zc->batch > 0 || zc->ready > 0 || discard(zc, zc->orphan) < 0) {
+        return false;
+    }
+
+    zc->orphan = 0;
+    return true;
+}
+
+/**
+ * @brief Validates the next message before any of it goes in the pipe - nothing is ever left waiting in the socket
+ * for the rest of it to arrive, since a socket short of receive memory may never get the rest, and epoll would report
+ * it readable all the while. So the header is peeked when it's all there, or taken into peek a piece at a time when
+ * it isn't, and a sensitive message is read out into peek as it arrives and summed a read at a time.
+ *
+ * @return splice_result - SPLICE_DRAINED until it can go in the pipe, at which point frame_left is set
+ */
+static splice_result check_front(splice_src *zc, int fd) {
+    if (zc->framer.frame_len == 0) {
+        size_t want = sizeof(ctmp_header) - zc->copied;
+
+        ssize_t count = recv(fd, zc->peek + zc->copied, want, MSG_PEEK | MSG_DONTWAIT);
+        if (count < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? SPLICE_DRAINED : SPLICE_ERROR;
+        }
+        if (count == 0) {
+            return SPLICE_EOF;
+        }
+
+        if (zc->copied > 0 || (size_t)count < want) {
+            if (recv(fd, zc->peek + zc->copied, count, MSG_DONTWAIT) != count) {
+                return SPLICE_ERROR;  // was there a moment ago
+            }
+
+            zc->copied += count;
+            if (zc->copied < sizeof(ctmp_header)) {
+                return SPLICE_DRAINED;
+            }
+        }
+
+        if (ctmp_framer_feed(&zc->framer, zc->peek, sizeof(ctmp_header)) == CTMP_BAD_HEADER) {
+            return SPLICE_BAD_HEADER;
+        }
+
+        if (((const ctmp_header *)zc->peek)->options != CTMP_OPTION_SENSITIVE) {
+            zc->frame_left = zc->framer.frame_len;  // nothing left to check, the payload can go straight through
+            return SPLICE_DRAINED;
+        }
+    }
+
+    while (zc->copied < zc->framer.frame_len) {
+        ssize_t count = recv(fd, zc->peek + zc->copied, zc->framer.frame_len - zc->copied, MSG_DONTWAIT);
+        if (count < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? SPLICE_DRAINED : SPLICE_ERROR;
+        }
+        if (count == 0) {
+            return SPLICE_EOF;
+        }
+
+        // the framer picks up where it left off, so only what just arrived is summed
+        zc->copied += count;
+        if (zc->copied >= sizeof(ctmp_header)
+            && ctmp_framer_feed(&zc->framer, zc->peek, zc->copied) == CTMP_BAD_CHECKSUM) {
+            return SPLICE_BAD_CHECKSUM;
+        }
+    }
+
+    zc->frame_left = zc->framer.frame_len;
+    return SPLICE_DRAINED;
+}
+
+/**
+ * @brief Rewrites a message stuck alone in the pipe, when it arrived in so many small segments that it used up every
+ * pipe slot before completing - read back and written in one go, it packs into full pages
+ *
+ * @return int - 0 on success, -1 if the pipe couldn't be read or written
+ */
+static int compact(splice_src *zc) {
+    size_t held = zc->framer.frame_len - zc->frame_left;
+
+    if (read(zc->pipe[0], zc->peek, held) != (ssize_t)held || write(zc->pipe[1], zc->peek, held) != (ssize_t)held) {
+        fprintf(stderr, "ERROR: Failed to compact source pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Splices as many validated messages from the source socket into the pipe as it has room for
+ *
+ * @param zc splice state
+ * @param fd source socket
+ * @param in ingress counters
+ * @param msgs incremented for each message completed
+ * @return splice_result - why it stopped
+ */
+splice_result splice_pull(splice_src *zc, int fd, ingress_metrics *in, uint32_t *msgs) {
+    if (!drop_orphan(zc)) {
+        return SPLICE_FULL;  // a new source's messages can't go in behind an old one's leftovers
+    }
+
+    while (true) {
+        if (zc->frame_left == 0) {
+            splice_result result = check_front(zc, fd);
+            if (result != SPLICE_DRAINED || zc->frame_left == 0) {
+                return result;
+            }
+        }
+
+        // whatever was taken out of the socket to check it goes in first, the rest is spliced straight across
+        uint32_t in_pipe = zc->framer.frame_len - zc->frame_left;
+        ssize_t count;
+        if (in_pipe < zc->copied) {
+            count = write(zc->pipe[1], zc->peek + in_pipe, zc->copied - in_pipe);
+            if (count < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? SPLICE_FULL : SPLICE_ERROR;
+            }
+        } else {
+            count = splice(fd, NULL, zc->pipe[1], NULL, zc->frame_left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+
+        if (count == 0) {
+            return SPLICE_EOF;
+        }
+
+        if (count < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return SPLICE_ERROR;
+            }
+
+            int avail = 0;
+            if (ioctl(fd, FIONREAD, &avail) < 0 || avail == 0) {
+                return SPLICE_DRAINED;  // rest of the message isn't here yet
+            }
+
+            // the socket has more but the pipe took none of it, so the pipe is full - only once it holds nothing
+            // but the incoming message is that down to how it's fragmented rather than to destinations lagging
+            if (zc->batch > 0 || zc->ready > 0) {
+                return SPLICE_FULL;
+            }
+            if (compact(zc) < 0) {
+                return SPLICE_ERROR;
+            }
+            continue;
+        }
+
+        zc->frame_left -= count;
+        if (zc->frame_left > 0) {
+            continue;
+        }
+
+        if (zc->ready == 0) {
+            zc->ready_stamp_us = (uint32_t)metrics_now_us();
+        }
+        zc->ready += zc->framer.frame_len;
+        zc->ready_msgs++;
+        metric_add(&in->msgs_in, 1);
+        metric_add(&in->bytes_in, zc->framer.frame_len);
+        (*msgs)++;
+
+        zc->copied = 0;
+        ctmp_framer_consume(&zc->framer);
+    }
+}
+
+/**
+ * @brief Makes the whole messages waiting in the pipe the batch to hand out, if there isn't one already
+ *
+ * @return bool - true if there is a batch to tee
+ */
+bool splice_next_batch(splice_src *zc) {
+    if (zc->batch > 0) {
+        return true;
+    }
+
+    if (zc->ready == 0) {
+        drop_orphan(zc);
+        return false;
+    }
+
+    zc->batch = zc->ready;
+    zc->batch_msgs = zc->ready_msgs;
+    zc->batch_stamp_us = zc->ready_stamp_us;
+    zc->batch_seq++;
+    zc->ready = zc->ready_msgs = 0;
+
+    return true;
+}
+
+/**
+ * @brief Discards the batch once every destination has its own reference to it
+ *
+ * @return int - 0 on success, -1 if the pipe couldn't be drained
+ */
+int splice_retire_batch(splice_src *zc) {
+    if (discard(zc, zc->batch) < 0) {
+        return -1;
+    }
+
+    zc->batch = 0;
+    drop_orphan(zc);
+    return 0;
+}
+
+/**
+ * @brief Gives a new destination its own pipe, the same size as the source's. It starts with the next batch, so it
+ * never joins part way through the messages already going out.
+ *
+ * @return int - 0 on success, -1 if the pipe couldn't be made (e.g. out of pipe-user-pages)
+ */
+int splice_open_dst(const splice_src *zc, dst_client *dst) {
+    if (open_pipe(dst->pipe, zc->pipe_size) < 0) {
+        fprintf(stderr, "Failed to create %d byte pipe for destination on fd %d: %s\n", zc->pipe_size, dst->fd,
+                strerror(errno));
+        return -1;
+    }
+
+    dst->piped = 0;
+    dst->batch_seq = zc->batch_seq;
+    return 0;
+}
+
+/**
+ * @brief Duplicates the current batch into a destination's (empty) pipe
+ *
+ * @return int - 0 on success, -1 if it didn't all fit, which the equal pipe sizes should make impossible
+ */
+int splice_tee_dst(const splice_src *zc, dst_client *dst) {
+    ssize_t count = tee(zc->pipe[0], dst->pipe[1], zc->batch, SPLICE_F_NONBLOCK);
+    if (count != (ssize_t)zc->batch) {
+        fprintf(stderr, "Failed to tee %u bytes to destination on fd %d (%zd): %s\n", zc->batch, dst->fd, count,
+                strerror(errno));
+        return -1;
+    }
+
+    dst->piped = zc->batch;
+    dst->piped_msgs = zc->batch_msgs;
+    dst->piped_stamp_us = zc->batch_stamp_us;
+    dst->batch_seq = zc->batch_seq;
+    return 0;
+}
+
+/**
+ * @brief Splices as much of a destination's pipe to its socket as it will take
+ *
+ * @param dst destination to flush
+ * @param metrics owning shard's counters, the batch's messages are counted once it has all gone
+ * @return ssize_t - bytes written (0 if the socket was already full), -1 on an unrecoverable write error
+ */
+ssize_t splice_flush_dst(dst_client *dst, egress_metrics *metrics) {
+    ssize_t total = 0;
+
+    while (dst->piped > 0) {
+        ssize_t count = splice(dst->pipe[0], NULL, dst->fd, NULL, dst->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (count < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error writing to destination on fd %d: %s\nClosing destination connection...\n",
+                        dst->fd, strerror(errno));
+                return -1;
+            }
+
+            return total;  // socket full, wait for EPOLLOUT
+        }
+
+        total += count;
+        dst->piped -= count;
+        metric_add(&dst->bytes_out, count);
+        metric_add(&metrics->bytes_out, count);
+    }
+
+    if (dst->piped_msgs > 0) {  // the whole batch is out
+        metric_add(&metrics->msgs_out, dst->piped_msgs);
+        lat_record_n(&metrics->latency, (uint32_t)metrics_now_us() - dst->piped_stamp_us, dst->piped_msgs);
+        dst->piped_msgs = 0;
+    }
+
+    return total;
+}
@@ -0,0 +1,77 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "client.h"
+#include "ctmp.h"
+#include "metrics.h"
+
+#define SPLICE_PIPE_SIZE (1 << 18)  // 64 pages, room for several max size messages - every pipe gets the same
+
+typedef enum {
+    SPLICE_DRAINED = 0,  // took everything the socket had, or is waiting on the rest of a header/sensitive message
+    SPLICE_FULL,  // the pipe can't take any more until destinations catch up, pause the source
+    SPLICE_EOF,
+    SPLICE_ERROR,
+    SPLICE_BAD_HEADER,
+    SPLICE_BAD_CHECKSUM
+} splice_result;
+
+/**
+ * @brief Zero-copy forwarding (-z) - the source is spliced into a pipe and tee'd from there into a pipe per
+ * destination, which is spliced out to its socket, so payloads only ever move as page references inside the kernel.
+ *
+ * Validation still happens before anything is forwarded: a header is peeked (MSG_PEEK) and checked before its
+ * message is spliced. A sensitive message is read out of the socket instead, checksummed a read at a time as it
+ * arrives, and written into the pipe once it checks out - so only sensitive payloads (and the odd header split
+ * across segments) are ever copied to userspace at all, and nothing has to fit in the socket's receive buffer whole.
+ * Messages are only handed on once they are completely in the pipe, so a source disconnecting mid-message never
+ * leaves destinations with half of one.
+ *
+ * The source pipe holds, front to back, the batch currently being tee'd to destinations, whole messages waiting for
+ * the next batch, and the message currently coming in. tee always reads from the front of a pipe and can't resume
+ * part way through, so a batch is only tee'd into a destination pipe that is empty - with every pipe the same size,
+ * it is then guaranteed to fit in one go. Once every destination has it, the batch is discarded into /dev/null.
+ * A destination still writing the previous batch holds everyone back, so this is the block policy only.
+ */
+typedef struct {
+    int pipe[2];
+    int devnull;
+    int pipe_size;
+
+    uint32_t batch;  // bytes at the front being tee'd to destinations
+    uint32_t batch_msgs;
+    uint32_t batch_stamp_us;
+    uint64_t batch_seq;  // bumped every time a new batch is formed
+    uint32_t ready;  // bytes of whole messages behind the batch
+    uint32_t ready_msgs;
+    uint32_t ready_stamp_us;  // when the oldest of them came in
+    uint32_t frame_left;  // bytes of the incoming message still to be spliced, 0 between messages
+    uint32_t orphan;  // start of a message whose source went away, discarded once it reaches the front
+    uint64_t retired;  // total bytes discarded, so the caller can tell room has been made
+
+    ctmp_framer framer;  // validation of the incoming message
+    uint8_t *peek;  // one max size message, for checksumming sensitive ones
+    uint32_t copied;  // bytes of the incoming message read into peek - all of a sensitive one, or a split header
+} splice_src;
+
+int splice_src_init(splice_src *zc);
+void splice_src_free(splice_src *zc);
+void splice_src_reset(splice_src *zc);
+
+splice_result splice_pull(splice_src *zc, int fd, ingress_metrics *in, uint32_t *msgs);
+bool splice_next_batch(splice_src *zc);
+int splice_retire_batch(splice_src *zc);
+
+int splice_open_dst(const splice_src *zc, dst_client *dst);
+int splice_tee_dst(const splice_src *zc, dst_client *dst);
+ssize_t splice_flush_dst(dst_client *dst, egress_metrics *metrics);
+
+#endif //SPLICE_H
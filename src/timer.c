@@ -0,0 +1,83 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include "timer.h"
+
+void timer_wheel_init(timer_wheel *wheel, time_t now) {
+    for (int s = 0; s < WHEEL_SLOTS; s++) {
+        wheel->slots[s].next = wheel->slots[s].prev = &wheel->slots[s];
+    }
+
+    wheel->now = now;
+    wheel->armed = 0;
+}
+
+/**
+ * @brief Schedules a timer, moving it if it was already armed
+ *
+ * @param wheel wheel to schedule on
+ * @param node timer to arm
+ * @param expires absolute second to fire at, anything not after the wheel's current second fires on the next advance
+ */
+void timer_arm(timer_wheel *wheel, timer_node *node, time_t expires) {
+    timer_cancel(wheel, node);
+
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;  // current slot has already been processed
+    }
+
+    timer_node *slot = &wheel->slots[expires & (WHEEL_SLOTS - 1)];
+
+    node->expires = expires;
+    node->prev = slot->prev;
+    node->next = slot;
+    slot->prev->next = node;
+    slot->prev = node;
+    wheel->armed++;
+}
+
+void timer_cancel(timer_wheel *wheel, timer_node *node) {
+    if (!timer_armed(node)) {
+        return;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+    wheel->armed--;
+}
+
+/**
+ * @brief Moves the wheel on to now, firing every timer that has come due since the last advance
+ *
+ * @param wheel wheel to advance
+ * @param now current second, a no-op if it hasn't moved on
+ * @param fn called for each expired timer, already unlinked so it may re-arm or free it
+ * @param ctx passed through to fn
+ */
+void timer_wheel_advance(timer_wheel *wheel, time_t now, timer_fn fn, void *ctx) {
+    if (now <= wheel->now) {
+        return;
+    }
+
+    // after a full lap every slot has been visited, no point going round again however long it has been
+    time_t from = now - wheel->now > WHEEL_SLOTS ? now - WHEEL_SLOTS + 1 : wheel->now + 1;
+    wheel->now = now;
+
+    for (time_t t = from; t <= now && wheel->armed > 0; t++) {
+        timer_node *slot = &wheel->slots[t & (WHEEL_SLOTS - 1)];
+        timer_node *node = slot->next;
+
+        while (node != slot) {
+            timer_node *next = node->next;  // fn may re-arm node into this very slot
+
+            if (node->expires <= now) {
+                timer_cancel(wheel, node);
+                fn(node, ctx);
+            }
+
+            node = next;
+        }
+    }
+}
@@ -0,0 +1,47 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define WHEEL_SLOTS 8  // one second per slot, must be a power of two - anything further out just goes round again
+
+/**
+ * @brief Intrusive timer, embedded in whatever it times out. Unlinked timers have prev == NULL.
+ */
+typedef struct timer_node {
+    struct timer_node *next;
+    struct timer_node *prev;
+    time_t expires;  // fires on the first advance at or after this second
+} timer_node;
+
+/**
+ * @brief Hashed timing wheel with one second resolution
+ *
+ * Arming and cancelling are O(1) list operations, and advancing only visits the slots for the seconds that have
+ * actually passed, so the cost depends on how many timers are due rather than on how many things could time out.
+ * A timer further out than WHEEL_SLOTS seconds sits in its slot for an extra lap and is skipped until due.
+ */
+typedef struct {
+    timer_node slots[WHEEL_SLOTS];  // sentinels of circular lists
+    time_t now;  // last second advanced to
+    size_t armed;
+} timer_wheel;
+
+typedef void (*timer_fn)(timer_node *node, void *ctx);
+
+void timer_wheel_init(timer_wheel *wheel, time_t now);
+void timer_arm(timer_wheel *wheel, timer_node *node, time_t expires);
+void timer_cancel(timer_wheel *wheel, timer_node *node);
+void timer_wheel_advance(timer_wheel *wheel, time_t now, timer_fn fn, void *ctx);
+
+static inline bool timer_armed(const timer_node *node) {
+    return node->prev != NULL;
+}
+
+#endif //TIMER_H
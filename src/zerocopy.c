@@ -0,0 +1,145 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include "zerocopy.h"
+
+/**
+ * @brief Turns on SO_ZEROCOPY for a new destination - if the socket won't have it (only warned about, once) it just
+ * sends as usual
+ *
+ * @param fd destination socket
+ * @param min_frame -Z
+ * @param zc the slot's state from a previous destination, NULL to allocate it
+ * @return dst_zerocopy* - reset state, NULL if it couldn't be allocated
+ */
+dst_zerocopy *zerocopy_open(int fd, uint32_t min_frame, dst_zerocopy *zc) {
+    static bool warned = false;
+
+    if (zc == NULL && (zc = malloc(sizeof(*zc))) == NULL) {
+        return NULL;
+    }
+    zerocopy_reset(zc);
+
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        if (!warned) {
+            fprintf(stderr, "Failed to set SO_ZEROCOPY on fd %d, continuing without: %s\n", fd, strerror(errno));
+            warned = true;
+        }
+        return zc;
+    }
+
+    zc->min_frame = min_frame;
+    return zc;
+}
+
+/**
+ * @brief Makes the coming close of a destination with sends still in flight abortive, so the kernel throws away what
+ * it had queued instead of carrying on sending (and retransmitting) it from ring space about to be reused - the peer
+ * gets a reset rather than bytes that may already have been overwritten
+ */
+void zerocopy_abort(const dst_zerocopy *zc, int fd) {
+    if (zc->tail == zc->head) {
+        return;  // nothing pinned, the close can be as graceful as usual
+    }
+
+    struct linger reset = {.l_onoff = 1, .l_linger = 0};
+    if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset)) < 0) {
+        fprintf(stderr, "Failed to set SO_LINGER on fd %d: %s\n", fd, strerror(errno));
+    }
+}
+
+/**
+ * @brief Forgets everything in flight, once the socket it was in flight on has been closed (see zerocopy_abort)
+ */
+void zerocopy_reset(dst_zerocopy *zc) {
+    zc->head = zc->tail = 0;
+    zc->oldest = ZEROCOPY_NONE;
+    zc->min_frame = 0;
+}
+
+/**
+ * @brief Records a successful zero-copy send
+ *
+ * @param oldest oldest ring offset it gathered from
+ */
+void zerocopy_sent(dst_zerocopy *zc, uint64_t oldest) {
+    uint32_t id = zc->head++ & (ZEROCOPY_INFLIGHT - 1);
+    zc->pinned[id] = oldest;
+    zc->done[id] = false;
+
+    if (oldest < zc->oldest) {
+        zc->oldest = oldest;
+    }
+}
+
+/**
+ * @brief Marks sends lo to hi completed, letting go of whatever only they were holding on to
+ */
+static void zerocopy_complete(dst_zerocopy *zc, uint32_t lo, uint32_t hi) {
+    for (uint32_t id = zc->tail; id != zc->head; id++) {
+        if (id - lo <= hi - lo) {  // the ids are the kernel's and wrap, so compare distances
+            zc->done[id & (ZEROCOPY_INFLIGHT - 1)] = true;
+        }
+    }
+
+    while (zc->tail != zc->head && zc->done[zc->tail & (ZEROCOPY_INFLIGHT - 1)]) {
+        zc->tail++;
+    }
+
+    // completions usually come in order, so this is normally a short walk if anything is left at all
+    zc->oldest = ZEROCOPY_NONE;
+    for (uint32_t id = zc->tail; id != zc->head; id++) {
+        uint32_t k = id & (ZEROCOPY_INFLIGHT - 1);
+        if (!zc->done[k] && zc->pinned[k] < zc->oldest) {
+            zc->oldest = zc->pinned[k];
+        }
+    }
+}
+
+/**
+ * @brief Reads every completion off a destination's error queue
+ *
+ * @param fd destination socket, with EPOLLERR raised
+ * @return int - completion notifications read, 0 if there were none (so EPOLLERR was an actual error)
+ */
+int zerocopy_reap(dst_zerocopy *zc, int fd) {
+    int reaped = 0;
+
+    while (true) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            return reaped;  // EAGAIN once drained, anything else is for the caller to find out about
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                  || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            const struct sock_extended_err *err = (const struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                continue;
+            }
+
+            zerocopy_complete(zc, err->ee_info, err->ee_data);
+            reaped++;
+
+            if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zc->min_frame > 0) {
+                printf("Destination on fd %d had zero-copy sends copied by the kernel, sending as usual\n", fd);
+                zc->min_frame = 0;  // pinning pages for a deferred copy is strictly worse than copying up front
+            }
+        }
+    }
+}
@@ -0,0 +1,51 @@
+//
+// Created by raven on 17/10/2026.
+//
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ZEROCOPY_INFLIGHT 64  // sends a destination may have awaiting completion, must be a power of two
+#define ZEROCOPY_NONE UINT64_MAX  // oldest, with nothing in flight
+
+/**
+ * @brief MSG_ZEROCOPY egress (-Z) - a destination's sendmsg gathers straight from the broadcast ring as always, but
+ * the kernel hands the ring's pages to the NIC rather than copying them into the socket buffer. Those pages then stay
+ * in use until the kernel says otherwise, by a completion on the socket's error queue (which raises EPOLLERR).
+ *
+ * The kernel numbers each zero-copy send on a socket from 0, and completes them in ranges. Each send in flight keeps
+ * the oldest ring offset it gathered from, and the oldest of those counts towards what the destination still needs
+ * (see dst_oldest), so the producer can't reuse that part of the ring until every send touching it has completed.
+ *
+ * Pinning page references only beats copying for large frames, so a batch only goes out zero-copy if its messages
+ * average at least min_frame bytes. A completion flagged as copied means the kernel had to copy after all (as it
+ * does over loopback, say), at which point the destination goes back to ordinary sends for good.
+ */
+typedef struct {
+    uint64_t pinned[ZEROCOPY_INFLIGHT];  // by id, the oldest ring offset each send in flight gathered from
+    bool done[ZEROCOPY_INFLIGHT];  // by id, completed but still behind an older send that hasn't
+    uint32_t head;  // id the next send will get
+    uint32_t tail;  // oldest id not yet completed
+    uint64_t oldest;  // oldest of pinned from tail to head, ZEROCOPY_NONE if nothing is in flight
+    uint32_t min_frame;  // -Z, average message size a batch needs to be sent zero-copy, 0 once the kernel copies
+} dst_zerocopy;
+
+dst_zerocopy *zerocopy_open(int fd, uint32_t min_frame, dst_zerocopy *zc);
+void zerocopy_abort(const dst_zerocopy *zc, int fd);
+void zerocopy_reset(dst_zerocopy *zc);
+
+/**
+ * @brief Whether a batch of msgs messages totalling bytes should go out zero-copy
+ */
+static inline bool zerocopy_wanted(const dst_zerocopy *zc, uint64_t bytes, int msgs) {
+    return zc != NULL && zc->min_frame > 0 && bytes >= (uint64_t)msgs * zc->min_frame
+           && zc->head - zc->tail < ZEROCOPY_INFLIGHT;
+}
+
+void zerocopy_sent(dst_zerocopy *zc, uint64_t oldest);
+int zerocopy_reap(dst_zerocopy *zc, int fd);
+
+#endif //ZEROCOPY_H